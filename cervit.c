@@ -21,13 +21,21 @@
 // CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 ///////////////////////////////////////////////////////////////////////////////////
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <malloc.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
@@ -35,6 +43,16 @@
 #include <dirent.h>
 #include <time.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <stdatomic.h>
+#include <linux/io_uring.h>
+#include "scan.h"
+#include "http.h"
 
 #ifndef VERSION
 #define VERSION "0.0"
@@ -43,15 +61,25 @@
 #define HTTP_1_1_VERSION "HTTP/1.1"
 #define HTTP_OK_HEADER "HTTP/1.1 200 OK\r\n"
 #define HTTP_CACHE_HEADERS "Server: cervit/" VERSION "\r\nCache-control: no-cache, no-store, must-revalidate\r\nExpires: 0\r\nPragma: no-cache\r\n"
+#define HTTP_REVALIDATE_HEADERS "Server: cervit/" VERSION "\r\nCache-Control: no-cache\r\n"
+#define HTTP_NOT_MODIFIED_HEADER "HTTP/1.1 304 NOT MODIFIED\r\n"
+#define HTTP_ETAG_KEY "ETag: "
+#define HTTP_LAST_MODIFIED_KEY "Last-Modified: "
+#define HTTP_CONTENT_ENCODING_KEY "Content-Encoding: "
+#define HTTP_VARY_ENCODING_HEADER "Vary: Accept-Encoding\r\n"
+#define HTTP_CHUNKED_HEADER "Transfer-Encoding: chunked\r\n"
+#define HTTP_LAST_CHUNK "0\r\n\r\n"
 #define HTTP_CONTENT_TYPE_KEY "Content-Type: "
 #define HTTP_CONTENT_LENGTH_KEY "Content-Length: "
 #define HTTP_DATE_KEY "Date: "
-#define HTTP_NEWLINE "\r\n"
-#define HTTP_END_HEADER HTTP_NEWLINE HTTP_NEWLINE
-
-#define HTTP_METHOD_GET 1
-#define HTTP_METHOD_HEAD 2
-#define HTTP_METHOD_UNSUPPORTED -1
+#define HTTP_KEEP_ALIVE_HEADER "Connection: keep-alive\r\n"
+#define HTTP_CLOSE_HEADER "Connection: close\r\n"
+#define HTTP_PARTIAL_CONTENT_HEADER "HTTP/1.1 206 PARTIAL CONTENT\r\n"
+#define HTTP_ACCEPT_RANGES_HEADER "Accept-Ranges: bytes\r\n"
+#define HTTP_CONTENT_RANGE_KEY "Content-Range: "
+#define HTTP_DATE_PLACEHOLDER "Thu, 01 Jan 1970 00:00:00 GMT"
+#define HTTP_DATE_WORDS ((HTTP_DATE_LENGTH + 7) / 8)
+#define HTTP_HEADERS_END(connectionHeader) HTTP_DATE_KEY HTTP_DATE_PLACEHOLDER HTTP_NEWLINE connectionHeader HTTP_NEWLINE
 
 #define BAD_REQUEST_HEADERS "HTTP/1.1 400 BAD REQUEST\r\nServer: cervit/" VERSION "\r\nContent-Type: text/html\r\nContent-Length: 59\r\n"
 #define BAD_REQUEST_BODY "<html><body>\n<h1>Invalid HTTP request!</h1>\n</body></html>\n"
@@ -61,13 +89,115 @@
 #define METHOD_NOT_SUPPORTED_BODY "<html><body>\n<h1>Method not supported!</h1>\n</body></html>\n"
 #define VERSION_NOT_SUPPORTED_HEADERS "HTTP/1.1 505 VERSION NOT SUPPORTED\r\nServer: cervit/" VERSION "\r\nContent-Type: text/html\r\nContent-Length: 63\r\n"
 #define VERSION_NOT_SUPPORTED_BODY "<html><body>\n<h1>HTTP version must be 1.1!</h1>\n</body></html>\n"
+#define INTERNAL_SERVER_ERROR_HEADERS "HTTP/1.1 500 INTERNAL SERVER ERROR\r\nServer: cervit/" VERSION "\r\nContent-Type: text/html\r\nContent-Length: 60\r\n"
+#define INTERNAL_SERVER_ERROR_BODY "<html><body>\n<h1>Internal server error!</h1>\n</body></html>\n"
+#define RANGE_NOT_SATISFIABLE_HEADERS "HTTP/1.1 416 RANGE NOT SATISFIABLE\r\nServer: cervit/" VERSION "\r\nContent-Type: text/html\r\nContent-Length: 70\r\n"
+#define RANGE_NOT_SATISFIABLE_BODY "<html><body>\n<h1>Requested range not satisfiable!</h1>\n</body></html>\n"
+
+#define RANGE_BOUNDARY "cervit-5e1f0c83a9d24b67"
+#define RANGE_MULTIPART_TYPE "multipart/byteranges; boundary=" RANGE_BOUNDARY
+#define RANGE_MULTIPART_END HTTP_NEWLINE "--" RANGE_BOUNDARY "--" HTTP_NEWLINE
+
+#define HTTP_ERROR_BAD_REQUEST 0
+#define HTTP_ERROR_NOT_FOUND 1
+#define HTTP_ERROR_METHOD_NOT_SUPPORTED 2
+#define HTTP_ERROR_VERSION_NOT_SUPPORTED 3
+#define HTTP_ERROR_INTERNAL_SERVER_ERROR 4
+#define NUM_HTTP_ERRORS 5
+
+#define MIME_TYPES_SYSTEM_FILE "/etc/mime.types"
 
 #define TRANSFER_CHUNK_SIZE 32768
 #define REQUEST_MAX_SIZE (TRANSFER_CHUNK_SIZE * 4)
-
-#define BYTESET_TOKEN_END " \t\r\n"
-#define BYTESET_PATH_END "?#" BYTESET_TOKEN_END
-#define BYTESET_HEADER_KEY_END ":" BYTESET_TOKEN_END
+#define SEND_MAX_IOVECS 64
+
+// A thread's scratch buffers and the connection's response buffer
+// may grow by REQUEST_MEMORY_DEFAULT megabytes in total while a
+// response is prepared, and keep up to BUFFER_RETAIN_SIZE bytes
+// each between requests.
+#define NUM_SCRATCH_BUFFERS 10
+#define REQUEST_MEMORY_DEFAULT 64
+#define BUFFER_RETAIN_SIZE 65536
+#define HEAP_TRIM_THRESHOLD (4 * 1024 * 1024)
+
+#define METRICS_PATH "./__cervit/metrics"
+#define METRICS_CONTENT_TYPE "text/plain; version=0.0.4"
+#define METRICS_NUM_METHODS 3
+#define METRICS_NUM_STATUSES 10
+#define METRICS_PHASE_READ 0
+#define METRICS_PHASE_PREPARE 1
+#define METRICS_PHASE_WRITE 2
+#define METRICS_NUM_PHASES 3
+
+// Latency histograms have HISTOGRAM_SUB_BUCKETS buckets for each power
+// of two nanoseconds from 2^HISTOGRAM_MIN_BITS (about 1 microsecond),
+// plus one below that and one for everything past the last.
+#define HISTOGRAM_MIN_BITS 10
+#define HISTOGRAM_SUB_BITS 2
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_OCTAVES 26
+#define HISTOGRAM_BUCKETS (HISTOGRAM_OCTAVES * HISTOGRAM_SUB_BUCKETS + 2)
+
+#define LOG_FORMAT_COMMON 0
+#define LOG_FORMAT_COMBINED 1
+#define LOG_FORMAT_BINARY 2
+#define LOG_RING_SIZE 1024
+#define LOG_RECORD_TEXT_SIZE 472
+#define LOG_REQUEST_LINE_MAX 256
+#define LOG_REFERER_MAX 128
+#define LOG_OUTPUT_SIZE 65536
+#define LOG_FLUSH_INTERVAL 50
+
+#define EPOLL_MAX_EVENTS 64
+#define RING_ENTRIES 512
+#define RING_BUFFER_COUNT 256
+#define RING_BUFFER_SIZE 4096
+#define RING_BUFFER_GROUP 0
+#define RING_MAX_BUFFERED_INPUT (REQUEST_MAX_SIZE * 2)
+#define CONNECTION_QUEUE_DEFAULT_DEPTH 256
+#define KEEP_ALIVE_DEFAULT_TIMEOUT 5
+#define KEEP_ALIVE_DEFAULT_MAX_REQUESTS 100
+#define KEEP_ALIVE_POLL_INTERVAL 100
+#define CONNECTION_TIMEOUT 30
+#define PIPELINE_MAX_RESPONSES 32
+#define PIPELINE_MAX_BUFFERED 65536
+#define CACHE_INITIAL_BUCKETS 256
+#define CACHE_MAX_ENTRY_SIZE (1024 * 1024)
+#define CACHE_PROTECTED_PERCENT 80
+#define CACHE_FILE 0
+#define CACHE_LISTING 1
+#define NUM_CACHES 2
+#define GZIP_MIN_SIZE 256
+#define LISTING_CACHE_SIZE (64 * 1024 * 1024)
+
+#define DEFLATE_WINDOW_SIZE 32768
+#define DEFLATE_HASH_BITS 15
+#define DEFLATE_HASH_SIZE (1 << DEFLATE_HASH_BITS)
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+#define DEFLATE_NICE_MATCH 128
+#define DEFLATE_MAX_CHAIN 64
+#define DEFLATE_BLOCK_SYMBOLS 16384
+#define DEFLATE_LITERAL_CODES 286
+#define DEFLATE_DISTANCE_CODES 30
+#define DEFLATE_CODE_LENGTH_CODES 19
+#define DEFLATE_END_OF_BLOCK 256
+
+#define IO_DONE 0
+#define IO_WOULD_BLOCK 1
+#define IO_ERROR -1
+
+#define CONNECTION_READING 0
+#define CONNECTION_WRITING 1
+
+// Operations submitted to a thread's io_uring, kept in the low
+// bits of each submission's user data along with the connection
+#define RING_CANCEL 0
+#define RING_ACCEPT 1
+#define RING_RECEIVE 2
+#define RING_SEND 3
+#define RING_POLL 4
+#define RING_OPERATION_MASK 7
 
 #ifdef _SC_NPROCESSORS_ONLN
 #define NUM_THREADS sysconf(_SC_NPROCESSORS_ONLN)
@@ -76,1253 +206,5239 @@
 #endif
 
 const char* DAY_STRINGS[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
-const char* MONTH_STRINGS[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
-
-// Dynamically allocated array.
-// .data: stored data
-// .length: number of bytes currently stored
-// .size: number of bytes allocated to the array
+const char* CONTENT_ENCODING_STRINGS[] = { "identity", "gzip", "br" };
+const char* CONTENT_ENCODING_EXTENSIONS[] = { "", ".gz", ".br" };
+const char* METRICS_METHOD_NAMES[] = { "other", "GET", "HEAD" };
+const int32_t METRICS_STATUS_CODES[] = { 200, 206, 304, 400, 404, 416, 500, 501, 505, 0 };
+const char* METRICS_PHASE_NAMES[] = { "read", "prepare", "write" };
+
+// Range of bytes queued to be sent on a connection, either from
+// the connection's response buffer, a cache entry or a file, or
+// a page of a directory listing.
+// .offset: Offset of the next byte to send (in responseBuffer, the
+//     entry's data or the file)
+// .length: Number of bytes left to send
+// .file: File to read the bytes from, or -1 for bytes in memory or a listing
+// .splice: Send the file through the connection's pipe because
+//     sendfile isn't supported for it
+// .closeFile: Close the file once the segment is sent (only the last of
+//     several segments from one file closes it)
+// .chunked: Send the body as chunks of the chunked transfer coding
+//     (see sendChunkedSegment)
+// .gzip: Compress the body with gzip while sending it (chunked segments)
+// .listing: Page of a directory listing to render while it's sent,
+//     instead of a file (chunked segments)
+// .entry: Cache entry to send the bytes from instead of responseBuffer,
+//     which the segment holds a reference to
 typedef struct {
-    int8_t* data;
+    int64_t offset;
     int64_t length;
-    int64_t size;
-} Buffer;
-
-// Information about the HTTP request
+    int32_t file;
+    int8_t splice;
+    int8_t closeFile;
+    int8_t chunked;
+    int8_t gzip;
+    struct ListingPage* listing;
+    struct CacheEntry* entry;
+} Segment;
+
+// State of a gzip stream being encoded (see the COMPRESSION section).
+// .window: The last 32KB of input already encoded, followed by input
+//     not encoded yet
+// .head: Latest window position for each hash of three bytes, -1 if none
+// .prev: Previous position with the same hash, for each of the last
+//     32KB of positions
+// .symbols: Literals and matches of the current block, as pairs of
+//     literal or match length, and 0 or match distance
+// .windowLength: Number of bytes in window
+// .position: Position in window of the next byte to encode
+// .symbolCount: Number of symbols in the current block
+// .bits, .bitCount: Output bits that don't fill a word yet
+// .crc: CRC-32 of the input so far (inverted)
+// .size: Number of input bytes (modulo 2^32)
 typedef struct {
-    Buffer method;
-    Buffer path;
-    Buffer version;
-} Request;
+    int8_t* window;
+    int32_t* head;
+    int32_t* prev;
+    uint16_t* symbols;
+    int64_t windowLength;
+    int64_t position;
+    int64_t symbolCount;
+    uint64_t bits;
+    int32_t bitCount;
+    uint32_t crc;
+    uint32_t size;
+} GzipEncoder;
+
+// Response body sent as chunks because its length isn't known up front:
+// a file compressed while it's sent or a directory listing rendered
+// while it's sent (see sendChunkedSegment).
+// .encoder: Encoder for a compressed body (only allocated for those)
+// .piece: The last piece of listing rendered
+// .compressed: Compressed output for the last piece of the body
+// .chunk: The last piece framed as a chunk, waiting to be sent
+// .chunkSent: Number of bytes of chunk already sent
+// .finished: Whether chunk ends the body
+typedef struct {
+    GzipEncoder encoder;
+    Buffer piece;
+    Buffer compressed;
+    Buffer chunk;
+    int64_t chunkSent;
+    int8_t finished;
+} ChunkStream;
+
+// A thread's io_uring instance: submission and completion queues
+// shared with the kernel, and a ring of buffers the kernel picks from
+// to receive into (see the IO_URING section).
+// .fd: File descriptor of the ring, -1 if not set up
+// .rings, .ringsSize: Mapping of the submission and completion queue rings
+// .sqes, .sqesSize: Mapping of the submission queue entries
+// .sqHead, .sqTail, .sqMask: Submission queue ring
+// .cqHead, .cqTail, .cqMask: Completion queue ring
+// .cqes: Completion queue entries
+// .queued: Number of submission queue entries filled but not
+//     yet handed to the kernel
+// .bufferRing: Ring of receive buffers provided to the kernel
+// .buffers: Memory of the receive buffers, RING_BUFFER_SIZE bytes each
+// .bufferTail: Tail of the buffer ring
+typedef struct {
+    int32_t fd;
+    int8_t* rings;
+    int64_t ringsSize;
+    struct io_uring_sqe* sqes;
+    int64_t sqesSize;
+    uint32_t* sqHead;
+    uint32_t* sqTail;
+    uint32_t sqMask;
+    uint32_t* cqHead;
+    uint32_t* cqTail;
+    uint32_t cqMask;
+    struct io_uring_cqe* cqes;
+    uint32_t queued;
+    struct io_uring_buf_ring* bufferRing;
+    int8_t* buffers;
+    uint16_t bufferTail;
+} Ring;
+
+// Per-connection state. Reading a request and writing its
+// response can stop when the socket would block and resume
+// where they left off (see processConnection).
+// .requestBuffer: Buffer struct to load incoming request stream. Bytes
+//     received after the current request are the start of the next one.
+// .responseBuffer: Buffer struct to build response headers (and bodies for in-memory
+//     responses) for every request answered since the last write
+// .segments: Segment structs to send, in order
+// .parser: State of the request being parsed from requestBuffer
+// .requestLength: Length of the request headers in requestBuffer, 0 if the request is invalid
+// .responseQueued: Number of bytes of responseBuffer covered by segments
+// .bodyStart, .bodySegment: Length of responseBuffer and number of segments
+//     when the headers of the response being prepared ended, so the size
+//     of its body can be logged (see connection_bodyLength)
+// .segmentIndex: Index of the segment currently being sent
+// .piped: Number of bytes of the current segment waiting in the pipe
+// .requestCount: Number of requests received on the connection
+// .lastActive: Time (monotonic seconds) of the connection's last event (event loop mode)
+// .readStart: Time (monotonic nanoseconds) the first byte of the request
+//     being read arrived, 0 if not timed (see metrics_time)
+// .writeStart: Time (monotonic nanoseconds) the responses started being sent
+// .socket: Accepted socket
+// .address: IPv4 address of the client, in network byte order (for the access log)
+// .pipe: Pipe used to splice files that can't be sent with sendfile,
+//     created the first time it's needed
+// .chunkStream: State of the chunked segment being sent, if any
+// .state: Whether the connection is reading requests or writing responses
+// .keepAlive: Whether to wait for another request once the responses are sent
+// .message, .iovecs: Message of the send in flight (io_uring mode)
+// .gatherEnd: Index after the last segment of the send in flight (io_uring mode)
+// .pendingOperations: Number of operations in flight on the thread's ring (io_uring mode)
+// .sending: Whether a send, or a poll for the socket to be writable,
+//     is in flight (io_uring mode)
+// .receiveClosed: Whether the client has shut down its side (io_uring mode)
+// .closing: Whether the connection is closed and waiting for the
+//     operations in flight to complete (io_uring mode)
+// .prev, .next: Links in the owning thread's list of open connections
+typedef struct Connection {
+    Buffer requestBuffer;
+    Buffer responseBuffer;
+    Buffer segments;
+    RequestParser parser;
+    int64_t requestLength;
+    int64_t responseQueued;
+    int64_t bodyStart;
+    int64_t bodySegment;
+    int64_t segmentIndex;
+    int64_t piped;
+    int64_t requestCount;
+    int64_t lastActive;
+    int64_t readStart;
+    int64_t writeStart;
+    int32_t socket;
+    uint32_t address;
+    int32_t pipe[2];
+    ChunkStream* chunkStream;
+    int8_t state;
+    int8_t keepAlive;
+    struct msghdr message;
+    struct iovec iovecs[SEND_MAX_IOVECS];
+    int64_t gatherEnd;
+    int32_t pendingOperations;
+    int8_t sending;
+    int8_t receiveClosed;
+    int8_t closing;
+    struct Connection* prev;
+    struct Connection* next;
+} Connection;
+
+// Log-linear histogram of durations, like HdrHistogram: each power of
+// two is split into HISTOGRAM_SUB_BUCKETS buckets, so a bucket's width
+// is at most a quarter of its values (see histogram_bucket).
+// .counts: Number of durations in each bucket
+// .sum: Sum of all durations in nanoseconds
+typedef struct {
+    atomic_uint_fast64_t counts[HISTOGRAM_BUCKETS];
+    atomic_uint_fast64_t sum;
+} Histogram;
+
+// A thread's counters, only written by the thread itself and
+// summed over all threads when the metrics are read.
+// .requests: Requests by method, indexed by HTTP_METHOD_* value
+//     (0 for unsupported methods)
+// .responses: Responses by status code (see METRICS_STATUS_CODES)
+// .bytesSent: Bytes written to sockets
+// .cacheHits, .cacheMisses: File cache lookups that found a fresh
+//     entry and that didn't
+// .queueWait: Nanoseconds spent waiting for connections from the
+//     connection queue (blocking mode)
+// .cacheLockWait: Nanoseconds spent waiting for each cache's lock,
+//     indexed by CACHE_* id
+// .logDropped: Access log records dropped because the ring was full
+// .phases: Durations of each METRICS_PHASE_*: from the first byte of
+//     a request to its end, preparing a response, and from the first
+//     byte of a batch of responses being sent to the last
+typedef struct {
+    atomic_uint_fast64_t requests[METRICS_NUM_METHODS];
+    atomic_uint_fast64_t responses[METRICS_NUM_STATUSES];
+    atomic_uint_fast64_t bytesSent;
+    atomic_uint_fast64_t cacheHits;
+    atomic_uint_fast64_t cacheMisses;
+    atomic_uint_fast64_t queueWait;
+    atomic_uint_fast64_t cacheLockWait[NUM_CACHES];
+    atomic_uint_fast64_t logDropped;
+    Histogram phases[METRICS_NUM_PHASES];
+} Metrics;
+
+// An access log entry, filled in by a worker thread in its ring and
+// formatted by the logger thread (see the ACCESS LOG section). In the
+// binary format, a record is written as its fields up to text, in host
+// byte order, followed by the used part of text.
+// .time: Time (seconds since the epoch) the response was prepared
+// .bytes: Number of bytes of the response body, -1 if it's chunked
+// .address: IPv4 address of the client, in network byte order
+// .status: Status code of the response
+// .requestLineLength, .refererLength, .userAgentLength: Number of bytes of
+//     the request line and the Referer and User-Agent headers, stored one
+//     after another in text and cut short to fit. The request line is
+//     empty if the request couldn't be parsed.
+// .text: The request line and headers
+typedef struct {
+    int64_t time;
+    int64_t bytes;
+    uint32_t address;
+    uint16_t status;
+    uint16_t requestLineLength;
+    uint16_t refererLength;
+    uint16_t userAgentLength;
+    int8_t text[LOG_RECORD_TEXT_SIZE];
+} LogRecord;
+
+// Single-producer, single-consumer ring of access log records
+// from a worker thread to the logger thread.
+// .records: LOG_RING_SIZE records
+// .head: Number of records the logger thread has taken
+// .tail: Number of records the worker thread has added
+typedef struct {
+    LogRecord* records;
+    atomic_uint_fast64_t head;
+    atomic_uint_fast64_t tail;
+} LogRing;
 
 // Per-thread variables
 // .thread: The pthread object
 // .request: Parsed data from the request the thread is handling
-// .requestBuffer: Buffer struct to load incoming request stream
-// .responseBuffer: Buffer struct to build response headers
+// .connection: Connection the thread is handling (blocking mode)
 // .dirListingBuffer: Buffer struct to build a directory listing response
 // .dirnameBuffer: Buffer to hold directory names so they can be sorted
 // .filenameBuffer: Buffer to hold filenames so they can be sorted
+// .nameListBuffer: Buffer to hold pointers to the directory names and
+//     filenames for sorting
+// .sortBuffer: Scratch space for sorting nameListBuffer
+// .rangeHeadersBuffer: Buffer to build the part headers of a multipart/byteranges response
+// .etagBuffer: Buffer to build entity tags to compare with the request's
+// .cacheKeyBuffer: Buffer to build the request's cache key
+// .gzipEncoder: Encoder to compress whole responses (gzip mode)
+// .gzipBuffer: Buffer to hold a compressed response body (gzip mode)
+// .transferChunk: Scratch space for socket and file reads
+// .requestMemory: Budget for the growth of the scratch buffers and
+//     the connection's response buffer while a response is prepared
+// .connections, .lastConnection: List of open connections, least recently
+//     active first (event loop and io_uring modes)
+// .freeConnections: Closed connections kept for reuse (event loop and io_uring modes)
 // .id: Id number of the thread
-// .connection: Accepted socket that the thread is handling
+// .listenSocket: Socket the thread accepts connections on (event loop or reuseport mode)
+// .epoll: The thread's epoll instance (event loop mode)
+// .ring: The thread's io_uring instance (io_uring mode)
+// .metrics: Counters for the metrics endpoint
+// .log: Ring of access log records for the logger thread
 typedef struct {
     pthread_t thread;
     Request request;
-    Buffer requestBuffer;
-    Buffer responseBuffer;
+    Connection connection;
     Buffer dirListingBuffer;
     Buffer dirnameBuffer;
     Buffer filenameBuffer;
+    Buffer nameListBuffer;
+    Buffer sortBuffer;
+    Buffer rangeHeadersBuffer;
+    Buffer etagBuffer;
+    Buffer cacheKeyBuffer;
+    GzipEncoder gzipEncoder;
+    Buffer gzipBuffer;
+    _Alignas(8) int8_t transferChunk[TRANSFER_CHUNK_SIZE];
+    MemoryBudget requestMemory;
+    Connection* connections;
+    Connection* lastConnection;
+    Connection* freeConnections;
     int32_t id;
-    int32_t connection;
+    int32_t listenSocket;
+    int32_t epoll;
+    Ring ring;
+    Metrics metrics;
+    LogRing log;
 } Thread;
 
-// The listening socket
+// Slot in the connection queue. The sequence number tells
+// producers whether the slot is free to fill and consumers
+// whether it holds a socket ready to be taken.
+typedef struct {
+    atomic_uint_fast64_t sequence;
+    int32_t socket;
+} ConnectionQueueSlot;
+
+// Bounded lock-free queue of accepted sockets waiting for
+// a worker (D. Vyukov's bounded MPMC queue). Threads that find
+// the queue empty (or full) park on a futex word that is bumped
+// every time a socket is added (or removed).
+// .slots: Ring of capacity slots
+// .mask: capacity - 1 (capacity is a power of two)
+// .enqueuePosition, .dequeuePosition: Positions of the next push and pop,
+//     kept on separate cache lines so producers and consumers don't contend
+// .pushCount, .popCount: Futex words bumped after each push and pop
+// .waitingConsumers, .waitingProducers: Number of threads parked on each futex
+typedef struct {
+    ConnectionQueueSlot* slots;
+    uint64_t mask;
+    _Alignas(64) atomic_uint_fast64_t enqueuePosition;
+    _Alignas(64) atomic_uint_fast64_t dequeuePosition;
+    _Alignas(64) atomic_uint pushCount;
+    atomic_uint popCount;
+    atomic_int waitingConsumers;
+    atomic_int waitingProducers;
+} ConnectionQueue;
+
+// Prebuilt copy of a response, or part of one, with a
+// Date header whose value is filled in for each response.
+// .data: Response bytes, with a placeholder date
+// .dateOffset: Offset of the date in data
+// .bodyOffset: Offset in data just past the end of the headers
+typedef struct {
+    Buffer data;
+    int64_t dateOffset;
+    int64_t bodyOffset;
+} ResponseTemplate;
+
+// The current date formatted as an HTTP date, shared by all
+// threads (see array_writeDate).
+// .sequence: Odd while the date is being updated, bumped by every update
+// .second: Time (seconds since the epoch) the date was formatted for
+// .words: The formatted date, stored as words so it can be read while
+//     another thread updates it
+typedef struct {
+    atomic_uint sequence;
+    atomic_int_fast64_t second;
+    atomic_uint_fast64_t words[HTTP_DATE_WORDS];
+} HttpDate;
+
+// Cached file contents, or the sorted names of a directory's entries.
+// .key: Content codings the client accepts (one byte) followed by the
+//     request path, since they decide which file is sent (file cache),
+//     or the directory's device, inode and modification time (listing cache)
+// .filename: Path of the file the contents were read from
+// .data: Response headers up to the Date header, followed by the file
+//     contents (file cache), or the offset of each name in the names
+//     section followed by the null-terminated names, directories
+//     first (listing cache)
+// .headerLength: Number of bytes of data taken up by the headers
+// .contentType: Content type of the file (a CONTENT_TYPE_* value)
+// .encoding: Content coding of the file (a CONTENT_ENCODING_* value)
+// .directoryCount, .nameCount: Number of directories and of all entries
+//     of a directory (listing cache)
+// .fileInfo: Stat info of the file when it was read
+// .hash: Hash of the key
+// .checked: Time (monotonic seconds) the file was last checked for changes
+// .references: Number of references to the entry, including the cache's own
+// .cached: Whether the entry is still in the cache
+// .protected: Whether the entry is on the protected list
+// .hashNext: Next entry in the same hash bucket
+// .prev, .next: Links in the probation or protected list, most recently used first
+typedef struct CacheEntry {
+    Buffer key;
+    Buffer filename;
+    Buffer data;
+    int64_t headerLength;
+    int32_t contentType;
+    int32_t encoding;
+    int64_t directoryCount;
+    int64_t nameCount;
+    struct stat fileInfo;
+    uint64_t hash;
+    atomic_int_fast64_t checked;
+    atomic_int references;
+    int8_t cached;
+    int8_t protected;
+    struct CacheEntry* hashNext;
+    struct CacheEntry* prev;
+    struct CacheEntry* next;
+} CacheEntry;
+
+// List of cache entries, most recently used first.
+typedef struct {
+    CacheEntry* first;
+    CacheEntry* last;
+} CacheList;
+
+// Hash table of cache entries kept within a byte budget
+// (see the CACHE section).
+// .buckets: Hash buckets, each a chain of entries
+// .mask: Number of buckets - 1 (number of buckets is a power of two)
+// .count: Number of entries
+// .bytes: Number of bytes used by entries
+// .protectedBytes: Number of bytes used by entries on the protected list
+// .budget: Maximum number of bytes to use
+// .maxEntrySize: Size of the largest file that will be cached
+// .lists: Probation and protected lists
+// .mutex: Guards everything but the entries' atomic fields
+// .id: CACHE_* id, which picks the cache's lock wait metric
+typedef struct {
+    CacheEntry** buckets;
+    uint64_t mask;
+    int64_t count;
+    int64_t bytes;
+    int64_t protectedBytes;
+    int64_t budget;
+    int64_t maxEntrySize;
+    CacheList lists[2];
+    pthread_mutex_t mutex;
+    int32_t id;
+} Cache;
+
+// Page of a directory listing, rendered a piece at a time
+// while it's sent.
+// .names: Listing cache entry with the directory's names (a reference)
+// .path: Request path of the directory, used in links
+// .start, .end: Indexes of the first name on the page and the one after the last
+// .next: Index of the next name to render
+// .format: LISTING_HTML or LISTING_JSON
+// .started, .done: Whether the start and the end of the page have been rendered
+typedef struct ListingPage {
+    CacheEntry* names;
+    Buffer path;
+    int64_t start;
+    int64_t end;
+    int64_t next;
+    int32_t format;
+    int8_t started;
+    int8_t done;
+} ListingPage;
+
+// Directory entry as returned by the getdents64 system call.
+typedef struct {
+    uint64_t d_ino;
+    int64_t d_off;
+    uint16_t d_reclen;
+    uint8_t d_type;
+    char d_name[];
+} LinuxDirent64;
+
+// Writer of the access log, run on its own thread
+// .file: File the log is written to
+// .thread: The logger thread
+// .output: Lines (or binary records) formatted for the next write
+typedef struct {
+    int32_t file;
+    pthread_t thread;
+    Buffer output;
+} AccessLog;
+
+// Server options set from the command line
+// .port: Port to listen on
+// .eventLoop: Serve connections from per-thread epoll loops
+//     instead of handing them one at a time to blocking workers
+// .reusePort: Give each thread its own listening socket bound
+//     with SO_REUSEPORT so threads accept connections themselves
+// .queueDepth: Number of accepted sockets that can wait for a worker
+// .keepAliveTimeout: Seconds an idle connection is kept open (0 disables keep-alive)
+// .maxRequests: Number of requests served on a connection before closing it
+// .cacheSize: Megabytes of file contents to keep in memory (0 disables the cache)
+// .requestMemory: Megabytes a thread's buffers may grow by in
+//     total while a response is prepared
+// .caching: Let clients cache files and revalidate them with ETag
+//     and Last-Modified instead of forbidding caching
+// .gzip: Compress text responses that have no precompressed copy
+// .mimeTypes: mime.types file with extra content types (0 if not given)
+// .ioUring: Serve connections from per-thread io_uring loops
+// .metrics: Serve counters and latency histograms at METRICS_PATH
+// .accessLog: File to write the access log to, "-" for stdout
+//     or 0 for no access log
+// .logFormat: Format of the access log (a LOG_FORMAT_* value)
+typedef struct {
+    uint32_t port;
+    uint32_t queueDepth;
+    uint32_t keepAliveTimeout;
+    uint32_t maxRequests;
+    uint32_t cacheSize;
+    uint32_t requestMemory;
+    int8_t eventLoop;
+    int8_t reusePort;
+    int8_t caching;
+    int8_t gzip;
+    int8_t ioUring;
+    int8_t metrics;
+    int8_t logFormat;
+    const char* mimeTypes;
+    const char* accessLog;
+} Options;
+
+Options options;
+
+// The shared listening socket (-1 in reuseport mode)
 int32_t sock;
 
 // Array of thread structs
 int64_t numThreads;
 Thread* threads;
 
+// Accepted sockets passed from the main thread to workers
+ConnectionQueue connectionQueue;
 
-// Shared thread control objects
-int32_t currentConnection;
-pthread_mutex_t currentConnectionLock;
-pthread_cond_t currentConnectionWritten;
-pthread_cond_t currentConnectionRead;
-int8_t currentConnectionWriteDone;
-int8_t currentConnectionReadDone;
-
-///////////////////////////////////////////////
-// STRINGS
-// A "string" is a null-terminated sequence
-// of chars.
-///////////////////////////////////////////////
-
-// Count the number of characters excluding
-// the terminating null.
-int64_t string_length(const char* string) {
-    int64_t length = 0;
-    while (string[length] != '\0') {
-        ++length;
-    }
+// Recently served files
+Cache fileCache;
 
-    return length;
-}
+// Recently rendered directory listings
+Cache listingCache;
 
-// Check if the two string contain the same characters.
-int8_t string_equals(const char* string1, const char* string2) {
-    int64_t i = 0;
-    while (string1[i] != '\0' && string2[i] != '\0') {
-        if (string1[i] != string2[i]) {
-            return 0;
-        }
-        ++i;
-    }
+// Content types, looked up by file extension
+MimeTable mimeTypes;
 
-    return string1[i] == '\0' && string2[i] == '\0';
-}
+// Date and Connection headers ending a response, for closing (0)
+// and kept-alive (1) connections
+ResponseTemplate headersEndTemplates[2];
 
-// Convert a string of decimal digits
-// to a uint32_t value.
-uint32_t string_toUint(const char* string) {
-    int64_t i = string_length(string) - 1;
-    uint32_t multiplier = 1;
-    uint32_t result = 0;
-    while (i >= 0) {
-        char c = string[i];
-        if (c < '0' || c > '9') {
-            return 0;
-        }
-        result += (string[i] - '0') * multiplier;
-        multiplier *= 10;
-        --i;
-    }
+// Complete error responses, by error and keep-alive
+ResponseTemplate errorTemplates[NUM_HTTP_ERRORS][2];
 
-    return result;
-}
+// Date sent in responses
+HttpDate httpDate;
 
-/////////////////////////////////////////////
-// ARRAYS
-// An "array" is a sequence of bytes (int8_t) 
-// and a length value indicating the number 
-// bytes in the sequence.
-/////////////////////////////////////////////
+// Access log, if there is one
+AccessLog accessLog;
 
-// Check if the array bytes values match the character values
-// in the string.
-int8_t array_equalsString(int8_t* array, int64_t length, char* string) {
-    int64_t i;
-    for (i = 0; i < length; ++i) {
-        int8_t c1 = array[i];
-        int8_t c2 = string[i];
+// CRC-32 lookup table (see crc32_init)
+uint32_t crc32Table[256];
 
-        if (c2 == '\0') {
-            // String was too short
-            return 0;
-        }
+/////////////////////////////////
+// RESPONSE TEMPLATES
+//
+// Header blocks that are the same for
+// every response of a kind are built
+// once at startup. Responses copy them
+// and only fill in the body length and
+// the date.
+/////////////////////////////////
 
-        if (c1 != c2) {
-            return 0;
-        }
+// Write a number as exactly width decimal digits.
+void array_writeDigits(int8_t* array, uint32_t n, int32_t width) {
+    for (int32_t i = width - 1; i >= 0; --i) {
+        array[i] = '0' + n % 10;
+        n /= 10;
     }
+}
+
+// Write a time (GMT) as an HTTP date (RFC 7231, 7.1.1.1),
+// which is always HTTP_DATE_LENGTH bytes long.
+void array_formatDate(int8_t* array, time_t t) {
+    struct tm date;
+    gmtime_r(&t, &date);
 
-    return string[i] == '\0';
+    memcpy(array, DAY_STRINGS[date.tm_wday], 3);
+    memcpy(array + 3, ", ", 2);
+    array_writeDigits(array + 5, date.tm_mday, 2);
+    array[7] = ' ';
+    memcpy(array + 8, MONTH_STRINGS[date.tm_mon], 3);
+    array[11] = ' ';
+    array_writeDigits(array + 12, date.tm_year + 1900, 4);
+    array[16] = ' ';
+    array_writeDigits(array + 17, date.tm_hour, 2);
+    array[19] = ':';
+    array_writeDigits(array + 20, date.tm_min, 2);
+    array[22] = ':';
+    array_writeDigits(array + 23, date.tm_sec, 2);
+    memcpy(array + 25, " GMT", 4);
 }
 
-// Check if the array bytes values match the character values
-// in the string, disregarding case for alphabetical values [A-Za-z].
-int8_t array_caseEqualsString(int8_t* array, int64_t length, char* string) {
-    int8_t toLower = 'a' - 'A';
-    int64_t i;
-    for (i = 0; i < length; ++i) {
-        int8_t c1 = array[i];
-        int8_t c2 = string[i];
+// Write the current date as an HTTP date. The formatted date is
+// shared by all threads and only redone by the first thread to
+// need it each second. Readers copy it without locking and retry
+// if it changed while they were copying (a seqlock).
+void array_writeDate(int8_t* array) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
 
-        if (c2 == '\0') {
-            // String was too short
-            return 0;
-        }
+    uint64_t words[HTTP_DATE_WORDS] = { 0 };
 
-        if (c1 >= 'A' && c1 <= 'Z') {
-            c1 += toLower;
-        }
+    while (1) {
+        uint32_t sequence = atomic_load_explicit(&httpDate.sequence, memory_order_acquire);
 
-        if (c2 >= 'A' && c2 <= 'Z') {
-            c2 += toLower;
+        // Another thread is updating the date. Format our
+        // own copy rather than wait for it.
+        if (sequence & 1) {
+            array_formatDate(array, now.tv_sec);
+            return;
         }
 
-        if (c1 != c2) {
-            return 0;
-        }
-    }
+        if (atomic_load_explicit(&httpDate.second, memory_order_relaxed) >= now.tv_sec) {
+            for (int32_t i = 0; i < HTTP_DATE_WORDS; ++i) {
+                words[i] = atomic_load_explicit(&httpDate.words[i], memory_order_relaxed);
+            }
 
-    return string[i] == '\0';
-}
+            atomic_thread_fence(memory_order_acquire);
 
-// Find first occurance in the array of any of the characters a charset (represented
-// as a null-terminated string). If found, return index, else return -1.
-int64_t array_findFromCharSet(const int8_t* array, int64_t length, char* charSet) {
-    int64_t i = 0;
-    while (i < length) {
-        int8_t c = array[i];
-        for (int64_t j = 0; charSet[j]; ++j) {
-            if (c == charSet[j]){
-                return i;
+            if (atomic_load_explicit(&httpDate.sequence, memory_order_relaxed) == sequence) {
+                memcpy(array, words, HTTP_DATE_LENGTH);
+                return;
             }
+
+            continue;
         }
-        ++i;
-    }
 
-    return -1;
-}
+        // The date is out of date. The thread that moves the sequence
+        // number to odd gets to update it, the rest retry.
+        if (atomic_compare_exchange_weak(&httpDate.sequence, &sequence, sequence + 1)) {
+            atomic_thread_fence(memory_order_release);
 
-// Increment an array's pointer by increment and adjust length accordingly. If
-// succesful return 0, else return -1.
-int64_t array_incrementPointer(int8_t** array, int64_t* length, int64_t increment) {
-    if (increment >= *length) {
-        return -1;
-    }
+            array_formatDate((int8_t *) words, now.tv_sec);
 
-    *array += increment;
-    *length -= increment;
+            for (int32_t i = 0; i < HTTP_DATE_WORDS; ++i) {
+                atomic_store_explicit(&httpDate.words[i], words[i], memory_order_relaxed);
+            }
 
-    return 0;
+            atomic_store_explicit(&httpDate.second, now.tv_sec, memory_order_relaxed);
+            atomic_store_explicit(&httpDate.sequence, sequence + 2, memory_order_release);
+
+            memcpy(array, words, HTTP_DATE_LENGTH);
+            return;
+        }
+    }
 }
 
-///////////////////////////////////////////////
-// BUFFERS
-// Buffers are dynamic arrays that will
-// automatically allocate the memory required
-// to store data appended to them.
-///////////////////////////////////////////////
+// Build a template from a string containing a
+// Date header.
+void responseTemplate_init(ResponseTemplate* template, const char* string) {
+    int64_t length = string_length(string);
 
-// Initialize a buffer to the given size.
-void buffer_init(Buffer* buffer, int64_t size) {
-    buffer->data = malloc(size);
-    buffer->length = 0;
+    buffer_init(&template->data, length);
+    buffer_appendFromString(&template->data, string);
 
-    if (!buffer->data) {
-        fprintf(stderr, "buffer_init: Out of memory\n");
-        exit(1);
-    }
+    const char* date = strstr(string, HTTP_DATE_KEY HTTP_DATE_PLACEHOLDER);
+    template->dateOffset = date - string + string_length(HTTP_DATE_KEY);
 
-    buffer->size = size;
+    const char* headersEnd = strstr(string, HTTP_NEWLINE HTTP_NEWLINE);
+    template->bodyOffset = headersEnd ? headersEnd - string + string_length(HTTP_NEWLINE HTTP_NEWLINE) : length;
 }
 
-// Deallocate memory associated with a buffer.
-void buffer_delete(Buffer* buffer) {
-    if (buffer->data == 0) {
+// Append a copy of a template with the
+// current date filled in.
+void buffer_appendTemplate(Buffer* buffer, ResponseTemplate* template) {
+    int64_t start = buffer->length;
+
+    buffer_appendFromArray(buffer, template->data.data, template->data.length);
+
+    if (buffer->failed) {
         return;
     }
-    free(buffer->data);
-    buffer->data = 0;
-    buffer->length = 0;
-    buffer->size = 0;
+
+    array_writeDate(buffer->data + start + template->dateOffset);
 }
 
-// Check if buffer is large enough to hold the requested amount 
-// of data. If not, reallocate buffer with enough memory.
-void buffer_checkAllocation(Buffer* buffer, int64_t requestedSize) {
-    if (requestedSize > buffer->size) {
-        int64_t newSize = buffer->size;
-        int8_t* newData;
-        while (newSize < requestedSize) {
-            newSize <<= 1;
-        }
-        newData = realloc(buffer->data, newSize);
-        if (!newData) {
-            fprintf(stderr, "buffer_checkAllocation: Out of memory\n");
-            exit(1);
-        }
-        buffer->data = newData;
-        buffer->size = newSize;
+// Build all response templates.
+void responseTemplates_init(void) {
+    const char* errorHeaders[] = { BAD_REQUEST_HEADERS, NOT_FOUND_HEADERS, METHOD_NOT_SUPPORTED_HEADERS, VERSION_NOT_SUPPORTED_HEADERS, INTERNAL_SERVER_ERROR_HEADERS };
+    const char* errorBodies[] = { BAD_REQUEST_BODY, NOT_FOUND_BODY, METHOD_NOT_SUPPORTED_BODY, VERSION_NOT_SUPPORTED_BODY, INTERNAL_SERVER_ERROR_BODY };
+    const char* headersEnd[] = { HTTP_HEADERS_END(HTTP_CLOSE_HEADER), HTTP_HEADERS_END(HTTP_KEEP_ALIVE_HEADER) };
+
+    for (int32_t i = 0; i < mimeTable_typeCount(&mimeTypes); ++i) {
+        ContentType* type = mimeTable_type(&mimeTypes, i);
+        buffer_init(&type->headers, 256);
+        buffer_appendFromString(&type->headers, HTTP_OK_HEADER);
+        buffer_appendFromString(&type->headers, options.caching ? HTTP_REVALIDATE_HEADERS : HTTP_CACHE_HEADERS);
+        buffer_appendFromString(&type->headers, HTTP_ACCEPT_RANGES_HEADER HTTP_CONTENT_TYPE_KEY);
+        buffer_appendFromArray(&type->headers, type->name.data, type->name.length);
+        buffer_appendFromString(&type->headers, HTTP_NEWLINE HTTP_CONTENT_LENGTH_KEY);
     }
-}
 
-// Append bytes from array to end of buffer.
-void buffer_appendFromArray(Buffer* buffer, const int8_t* array, int64_t length) {
-    buffer_checkAllocation(buffer, buffer->length + length);
-    memcpy(buffer->data + buffer->length, array, length);
-    buffer->length += length;
-}
+    for (int32_t keepAlive = 0; keepAlive < 2; ++keepAlive) {
+        responseTemplate_init(&headersEndTemplates[keepAlive], headersEnd[keepAlive]);
 
-// Append single character to end of buffer.
-void buffer_appendFromChar(Buffer* buffer, char c) {
-    buffer_appendFromArray(buffer, (int8_t *)&c, 1);
-}
+        for (int32_t i = 0; i < NUM_HTTP_ERRORS; ++i) {
+            Buffer string;
+            buffer_init(&string, 512);
+            buffer_appendFromString(&string, errorHeaders[i]);
+            buffer_appendFromString(&string, headersEnd[keepAlive]);
+            buffer_appendFromString(&string, errorBodies[i]);
+            buffer_appendFromChar(&string, '\0');
 
-// Append non-null bytes from string to end of buffer.
-void buffer_appendFromString(Buffer* buffer, const char* string) {
-    buffer_appendFromArray(buffer, (int8_t *)string, string_length(string));
+            responseTemplate_init(&errorTemplates[i][keepAlive], (char *) string.data);
+            buffer_delete(&string);
+        }
+    }
 }
 
-// Convert unsigned int to array of digit ASCII bytes
-// and append to end of buffer.
-void buffer_appendFromUint(Buffer* buffer, uint32_t n) {
-    uint32_t pow = 1;
-    int64_t length = 1;
-    while (pow * 10 <= n) {
-        pow *= 10;
-        ++length;
+// Deallocate memory associated with the response templates.
+void responseTemplates_delete(void) {
+    for (int32_t i = 0; i < mimeTable_typeCount(&mimeTypes); ++i) {
+        buffer_delete(&mimeTable_type(&mimeTypes, i)->headers);
     }
 
-    int8_t result[length];
-
-    int64_t i = 0;
-    while (pow > 0) {
-        int8_t digit = n / pow;
-        result[i] = digit + '0';
+    for (int32_t keepAlive = 0; keepAlive < 2; ++keepAlive) {
+        buffer_delete(&headersEndTemplates[keepAlive].data);
 
-        n -= digit * pow;
-        pow /= 10;
-        ++i;
+        for (int32_t i = 0; i < NUM_HTTP_ERRORS; ++i) {
+            buffer_delete(&errorTemplates[i][keepAlive].data);
+        }
     }
-
-    buffer_appendFromArray(buffer, result, length);
 }
 
-// Append the current date and time (GMT)
-// to the buffer.
-void buffer_appendDate(Buffer* buffer) {
-    time_t t = time(NULL);
-    struct tm date;
-    gmtime_r(&t, &date);
+// Append the headers of a 200 response up to
+// the Date header.
+void appendOkHeaders(Buffer* buffer, int32_t contentType, int64_t contentLength) {
+    Buffer* headers = &mimeTable_type(&mimeTypes, contentType)->headers;
 
-    buffer_checkAllocation(buffer, buffer->length + 29);
-
-    buffer_appendFromString(buffer, DAY_STRINGS[date.tm_wday]);
-    buffer_appendFromString(buffer, ", ");
-    buffer_appendFromUint(buffer, date.tm_mday);
-    buffer_appendFromChar(buffer, ' ');
-    buffer_appendFromString(buffer, MONTH_STRINGS[date.tm_mon]);
-    buffer_appendFromChar(buffer, ' ');
-    buffer_appendFromUint(buffer, date.tm_year + 1900);
-    buffer_appendFromChar(buffer, ' ');
+    buffer_appendFromArray(buffer, headers->data, headers->length);
+    buffer_appendFromUint(buffer, contentLength);
+    buffer_appendFromString(buffer, HTTP_NEWLINE);
+}
 
-    if (date.tm_hour < 10) {
-        buffer_appendFromChar(buffer, '0');
-    }
-    buffer_appendFromUint(buffer, date.tm_hour);
-    buffer_appendFromChar(buffer, ':');
+// Append the headers of a 200 response whose body is sent
+// in chunks, up to the Date header.
+void appendChunkedOkHeaders(Buffer* buffer, int32_t contentType) {
+    Buffer* headers = &mimeTable_type(&mimeTypes, contentType)->headers;
 
-    if (date.tm_min < 10) {
-        buffer_appendFromChar(buffer, '0');
-    }
-    buffer_appendFromUint(buffer, date.tm_min);
-    buffer_appendFromChar(buffer, ':'); 
+    buffer_appendFromArray(buffer, headers->data, headers->length - string_length(HTTP_CONTENT_LENGTH_KEY));
+    buffer_appendFromString(buffer, HTTP_CHUNKED_HEADER);
+}
 
-    if (date.tm_sec < 10) {
-        buffer_appendFromChar(buffer, '0');
-    }
-    buffer_appendFromUint(buffer, date.tm_sec);
+// Append a template to a connection's response buffer and note
+// where the body of the response starts.
+void connection_appendTemplate(Connection* connection, ResponseTemplate* template) {
+    int64_t start = connection->responseBuffer.length;
 
-    buffer_appendFromString(buffer, " GMT"); 
+    buffer_appendTemplate(&connection->responseBuffer, template);
+    connection->bodyStart = start + template->bodyOffset;
+    connection->bodySegment = connection->segments.length / sizeof(Segment);
 }
 
-// If buffer isn't currently null-terminated, add null
-// in first unused byte. Useful when interacting
-// with system calls that expect null-termination.
-void buffer_externalNull(Buffer* buffer) {
-    // If buffer isn't currently null-terminated, add null
-    // in first unused byte for the read.
-    if (buffer->data[buffer->length - 1] != '\0') {
-        buffer_checkAllocation(buffer, buffer->length + 1);
-        buffer->data[buffer->length] = '\0';
-    }
+// Append the Date and Connection headers and the blank
+// line that ends the response headers.
+void appendResponseHeadersEnd(Connection* connection) {
+    connection_appendTemplate(connection, &headersEndTemplates[connection->keepAlive != 0]);
 }
 
-
-/////////////////////////////////
-// PARSING UTILITY FUNCTIONS
-/////////////////////////////////
-
-// Parse the character value from an array of 
-// two hexadecimal digits
-int8_t parseURIHexCodeFromArray(const int8_t* array) {
-    int8_t result = 0;
-    int32_t multiplier = 16;
-    for (int64_t i = 0; i < 2; ++i) {
-        int8_t c = array[i];
-
-        if (c >= 'A' && c <= 'F') {
-            result += multiplier * (10 + c - 'A');
-        } else if (c >= 'a' && c <= 'f') {
-            result += multiplier * (10 + c - 'a');
-        } else if (c >= '0' && c <= '9') {
-            result += multiplier * (c - '0');
-        } else {
-            return '\0';
-        }
-
-        multiplier >>= 4;
-    }
-
-    return result;
+// Append one of the error responses.
+void errorResponseBuffer(Connection* connection, int32_t error, int8_t keepAlive) {
+    connection_appendTemplate(connection, &errorTemplates[error][keepAlive != 0]);
 }
 
-// Find the first byte in an array that isn't a space (' ') or 
-// tab('\t'), return the index.
-int64_t skipArraySpaces(int8_t* array, int64_t length) {
-    int64_t i = 0;
-    while (i < length) {
-        int8_t c = array[i];
+//////////////////////////////////////////
+// COMPRESSION
+//
+// A small gzip encoder (RFC 1951, 1952)
+// for responses that can't be served from
+// a precompressed copy. Matches are found
+// with hash chains over a sliding 32KB
+// window, and each block of symbols is
+// written with Huffman codes built from
+// its own symbol counts. Input can be fed
+// in pieces, so files can be compressed
+// while they're sent.
+//////////////////////////////////////////
 
-        if (c != ' ' && c != '\t') {
-            break;
+const uint16_t DEFLATE_LENGTH_BASES[] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+const uint8_t DEFLATE_LENGTH_EXTRA_BITS[] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+const uint16_t DEFLATE_DISTANCE_BASES[] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+const uint8_t DEFLATE_DISTANCE_EXTRA_BITS[] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+// Order code length code lengths are written in (RFC 1951, 3.2.7).
+const uint8_t DEFLATE_CODE_LENGTH_ORDER[] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+// Fill in the CRC-32 lookup table used
+// for gzip trailers.
+void crc32_init(void) {
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t crc = i;
+
+        for (int32_t j = 0; j < 8; ++j) {
+            crc = crc & 1 ? (crc >> 1) ^ 0xedb88320 : crc >> 1;
         }
 
-        ++i;
+        crc32Table[i] = crc;
     }
-
-    return i;
 }
 
-// Check if the beginning of the array is an acceptable
-// HTTP newline, '\r\n' or '\n' (RFC 7230, 3.5). If so,
-// return the number of characters that make up the newline,
-// else return 0.
-int64_t isArrayHttpNewline(int8_t* array, int64_t length) {
-    if (length < 1) {
-        return 0;
+// Compute Huffman code lengths for symbols with the given frequencies,
+// none longer than maxLength. Symbols with a frequency of 0 get no
+// code (length 0), but at least two symbols always get one since
+// a code of one symbol can't be decoded. If the tree is too deep,
+// frequencies are halved until it fits. Count can't be more than
+// DEFLATE_LITERAL_CODES.
+void huffman_buildLengths(const uint32_t* frequencies, int32_t count, int32_t maxLength, uint8_t* lengths) {
+    uint32_t weights[DEFLATE_LITERAL_CODES];
+    int32_t symbols[DEFLATE_LITERAL_CODES];
+    uint32_t nodeWeights[2 * DEFLATE_LITERAL_CODES];
+    int32_t parents[2 * DEFLATE_LITERAL_CODES];
+    uint8_t depths[2 * DEFLATE_LITERAL_CODES];
+    int32_t used = 0;
+
+    for (int32_t i = 0; i < count; ++i) {
+        weights[i] = frequencies[i];
+        lengths[i] = 0;
+
+        if (weights[i] > 0) {
+            ++used;
+        }
     }
 
-    if (*array == '\n') {
-        return 1;
+    for (int32_t i = 0; used < 2 && i < count; ++i) {
+        if (weights[i] == 0) {
+            weights[i] = 1;
+            ++used;
+        }
     }
 
-    if (length > 1 && array[0] == '\r' && array[1] == '\n') {
-        return 2;
-    }
+    while (1) {
+        // Sort the used symbols by weight.
+        int32_t leafCount = 0;
 
-    return 0;
-}
+        for (int32_t i = 0; i < count; ++i) {
+            if (weights[i] == 0) {
+                continue;
+            }
 
-// Check if the beginning of the array is an acceptable
-// pair of HTTP newlines. If so, return the number of 
-// characters that make up the newline pair, else return
-// 0.
-int64_t isArrayHttpHeaderEnd(int8_t* array, int64_t length) {
-    if (length < 2) {
-        return 0;
-    }
+            int32_t j = leafCount++;
+            while (j > 0 && weights[symbols[j - 1]] > weights[i]) {
+                symbols[j] = symbols[j - 1];
+                --j;
+            }
+            symbols[j] = i;
+        }
 
-    int64_t i = isArrayHttpNewline(array, length);
+        for (int32_t i = 0; i < leafCount; ++i) {
+            nodeWeights[i] = weights[symbols[i]];
+        }
 
-    if (i == 0) {
-        return 0;
-    }
+        // Leaves and the internal nodes made from them are both
+        // in order of weight, so the two lightest nodes are always
+        // at the front of one of the two lists.
+        int32_t nextLeaf = 0;
+        int32_t nextNode = leafCount;
+        int32_t root = 2 * leafCount - 2;
 
-    int64_t j = isArrayHttpNewline(array + i, length - i);
+        for (int32_t node = leafCount; node <= root; ++node) {
+            nodeWeights[node] = 0;
 
-    if (j == 0) {
-        return 0;
-    }
+            for (int32_t k = 0; k < 2; ++k) {
+                int32_t child;
 
-    return i + j;
-}
+                if (nextLeaf < leafCount && (nextNode >= node || nodeWeights[nextLeaf] <= nodeWeights[nextNode])) {
+                    child = nextLeaf++;
+                } else {
+                    child = nextNode++;
+                }
 
-// Skip over any leading HTTP newlines in array
-int64_t skipArrayHttpNewlines(int8_t* array, int64_t length) {
-    int64_t i = 0;
-    int64_t count = isArrayHttpNewline(array, length);
-    while (count && i < length) {
-        i += count;
-        count = isArrayHttpNewline(array + i, length - i);
-    }
+                parents[child] = node;
+                nodeWeights[node] += nodeWeights[child];
+            }
+        }
 
-    return i;
-}
+        // Parents always come after their children.
+        int32_t deepest = 0;
 
-// Decode any percent-encoded characters
-// from the buffer.
-int8_t hexDecodeBuffer(Buffer* buffer) {
-    int8_t* path = buffer->data;
-    int64_t length = buffer->length;
-    
-    int64_t readIndex = 0;
-    int64_t writeIndex = 0;
+        for (int32_t node = root; node >= 0; --node) {
+            depths[node] = node == root ? 0 : depths[parents[node]] + 1;
 
-    while (readIndex < length) {
-        if (path[readIndex] != '%') {
-            path[writeIndex] = path[readIndex];
-            ++readIndex;
-            ++writeIndex;
-            continue;
+            if (depths[node] > deepest) {
+                deepest = depths[node];
+            }
         }
 
-        if (readIndex + 2 >= length) {
-            return -1;
+        if (deepest <= maxLength) {
+            for (int32_t i = 0; i < leafCount; ++i) {
+                lengths[symbols[i]] = depths[i];
+            }
+
+            return;
         }
 
-        int8_t c = parseURIHexCodeFromArray(path + readIndex + 1);
-        if (c > 0) {
-            path[writeIndex] = c;
-            readIndex += 3;
-            ++writeIndex;
-        } else {
-            return -1;
+        for (int32_t i = 0; i < count; ++i) {
+            if (weights[i] > 0) {
+                weights[i] = (weights[i] + 1) / 2;
+            }
         }
     }
+}
 
-    buffer->length = writeIndex;
+// Assign canonical Huffman codes for the given code lengths
+// (RFC 1951, 3.2.2). Codes are stored bit-reversed since
+// deflate packs them starting from their top bit.
+void huffman_buildCodes(const uint8_t* lengths, int32_t count, uint16_t* codes) {
+    uint16_t lengthCounts[16] = { 0 };
+    uint16_t nextCodes[16];
+    uint16_t code = 0;
 
-    return 0;
-}
+    for (int32_t i = 0; i < count; ++i) {
+        ++lengthCounts[lengths[i]];
+    }
 
-// Remove path '.' and '..' from a path stored in a buffer. (RFC 3986, 5.3.4)
-void removeBufferDotSegments(Buffer* buffer) {
-    // Skip ./ prefix
-    int8_t* path = buffer->data + 2;
-    int64_t length = buffer-> length - 2;
-    
-    int64_t readIndex = 0;
-    int64_t writeIndex = 0;
-    int8_t c1, c2, c3;
-
-    while (readIndex < length) {
-        c1 = path[readIndex];
-
-        // Only interested in segments beginning with '.'
-        if (c1 != '.' || (readIndex > 0 && path[readIndex - 1] != '/')) {
-            path[writeIndex] = path[readIndex];
-            ++readIndex;
-            ++writeIndex;
-            continue;
-        }
+    lengthCounts[0] = 0;
 
-        if (readIndex + 1 == length) {
-            break;
-        }
+    for (int32_t bits = 1; bits < 16; ++bits) {
+        code = (code + lengthCounts[bits - 1]) << 1;
+        nextCodes[bits] = code;
+    }
 
-        c2 = path[readIndex + 1];
-        
-        if (c2 == '/') {
-            readIndex += 2;
-        } else if (c2 == '.') { 
-            if (readIndex + 2 == length) {
-                break;
-            }
+    for (int32_t i = 0; i < count; ++i) {
+        uint16_t reversed = 0;
+        code = nextCodes[lengths[i]]++;
 
-            c3 = path[readIndex + 2];
+        for (int32_t bit = 0; bit < lengths[i]; ++bit) {
+            reversed = (reversed << 1) | ((code >> bit) & 1);
+        }
 
-            if (c3 == '/') {
-                readIndex += 3;
+        codes[i] = reversed;
+    }
+}
 
-                if (writeIndex > 0) {
-                    --writeIndex;
-                    while (writeIndex > 0 && path[writeIndex - 1] != '/') {
-                        --writeIndex;
-                    } 
-                }
-            } else {
-                path[writeIndex] = path[readIndex];
-                path[writeIndex + 1] = path[readIndex + 1];
-                readIndex += 2;
-                writeIndex += 2;
-            }
+// Index of the length code for a match length (0 for 257).
+int32_t deflate_lengthCode(int32_t length) {
+    uint32_t n = length - 3;
 
-        } else {
-            path[writeIndex] = path[readIndex];
-            ++readIndex;
-            ++writeIndex;
-        }
+    if (length == DEFLATE_MAX_MATCH) {
+        return 28;
+    }
 
+    if (n < 8) {
+        return n;
     }
 
-    buffer->length = writeIndex + 2;
+    int32_t bits = 31 - __builtin_clz(n);
+
+    return 4 * (bits - 1) + ((n >> (bits - 2)) & 3);
 }
 
-// Set the buffer's contents to an error responsed base on the 
-// given headers and body.
-void errorResponseBuffer(Buffer* buffer, const char* headers, const char* body) {
-    buffer->length = 0;
+// Distance code for a match distance.
+int32_t deflate_distanceCode(int32_t distance) {
+    uint32_t n = distance - 1;
 
-    buffer_appendFromString(buffer, headers);
-    buffer_appendFromString(buffer, HTTP_DATE_KEY);
-    buffer_appendDate(buffer);
-    buffer_appendFromString(buffer, HTTP_END_HEADER);
-    buffer_appendFromString(buffer, body);
-}
+    if (n < 4) {
+        return n;
+    }
 
-// Open file whose name is stored in buffer.
-int32_t openFileFromBuffer(Buffer* buffer, int64_t flags) {
-    buffer_externalNull(buffer);
+    int32_t bits = 31 - __builtin_clz(n);
 
-    return open((const char*)buffer->data, flags);
+    return 2 * bits + ((n >> (bits - 1)) & 1);
 }
 
-// Stat file whose name is stored in buffer.
-int32_t statFileFromBuffer(Buffer* buffer, struct stat *fileInfo) {
-    buffer_externalNull(buffer);
-
-    return stat((const char*)buffer->data, fileInfo);
+// Deallocate memory associated with an encoder.
+void gzipEncoder_delete(GzipEncoder* encoder) {
+    free(encoder->window);
+    free(encoder->head);
+    free(encoder->prev);
+    free(encoder->symbols);
+    encoder->window = 0;
+    encoder->head = 0;
+    encoder->prev = 0;
+    encoder->symbols = 0;
 }
 
-// Open directory whose name is stored in buffer.
-DIR* openDirFromBuffer(Buffer* buffer) {
-    buffer_externalNull(buffer);
+// Allocate an encoder's window and tables. Returns -1
+// if there isn't enough memory.
+int8_t gzipEncoder_init(GzipEncoder* encoder) {
+    encoder->window = malloc(2 * DEFLATE_WINDOW_SIZE);
+    encoder->head = malloc(DEFLATE_HASH_SIZE * sizeof(int32_t));
+    encoder->prev = malloc(DEFLATE_WINDOW_SIZE * sizeof(int32_t));
+    encoder->symbols = malloc(2 * DEFLATE_BLOCK_SYMBOLS * sizeof(uint16_t));
+
+    if (!encoder->window || !encoder->head || !encoder->prev || !encoder->symbols) {
+        gzipEncoder_delete(encoder);
+        return -1;
+    }
 
-    return opendir((const char*)buffer->data);
+    return 0;
 }
 
-// Guess at content type based on file extension
-// of file name stored in buffer.
-char *contentTypeStringFromBuffer(Buffer* filename) {
-    int64_t offset = filename->length - 1;
-    
-    while (offset > 0 && filename->data[offset] != '.') {
-        --offset;
+// Append the low count bits of value to the output, flushing
+// whole words to the buffer as they fill up.
+void gzipEncoder_putBits(GzipEncoder* encoder, uint32_t value, int32_t count, Buffer* output) {
+    encoder->bits |= (uint64_t) value << encoder->bitCount;
+    encoder->bitCount += count;
+
+    if (encoder->bitCount >= 32) {
+        int8_t bytes[4] = { encoder->bits, encoder->bits >> 8, encoder->bits >> 16, encoder->bits >> 24 };
+        buffer_appendFromArray(output, bytes, 4);
+        encoder->bits >>= 32;
+        encoder->bitCount -= 32;
     }
+}
 
-    if (offset == 0) {
-        return "application/octet-stream";
+// Write the symbols collected so far as a block
+// with dynamic Huffman codes (RFC 1951, 3.2.7).
+void gzipEncoder_writeBlock(GzipEncoder* encoder, int8_t last, Buffer* output) {
+    uint32_t literalFrequencies[DEFLATE_LITERAL_CODES] = { 0 };
+    uint32_t distanceFrequencies[DEFLATE_DISTANCE_CODES] = { 0 };
+    uint8_t lengths[DEFLATE_LITERAL_CODES + DEFLATE_DISTANCE_CODES];
+    uint8_t* literalLengths = lengths;
+    uint8_t distanceLengths[DEFLATE_DISTANCE_CODES];
+    uint16_t literalCodes[DEFLATE_LITERAL_CODES];
+    uint16_t distanceCodes[DEFLATE_DISTANCE_CODES];
+    uint16_t* symbols = encoder->symbols;
+
+    for (int64_t i = 0; i < encoder->symbolCount; ++i) {
+        if (symbols[2 * i + 1] == 0) {
+            ++literalFrequencies[symbols[2 * i]];
+        } else {
+            ++literalFrequencies[257 + deflate_lengthCode(symbols[2 * i])];
+            ++distanceFrequencies[deflate_distanceCode(symbols[2 * i + 1])];
+        }
     }
 
-    int8_t* extension = filename->data + offset;
-    int64_t length = filename->length - offset;
+    literalFrequencies[DEFLATE_END_OF_BLOCK] = 1;
 
-    /////////////
-    // Text
-    /////////////
-    if (array_caseEqualsString(extension, length, ".html") || array_caseEqualsString(extension, length, ".htm")) {
-        return "text/html";
-    }
+    huffman_buildLengths(literalFrequencies, DEFLATE_LITERAL_CODES, 15, literalLengths);
+    huffman_buildLengths(distanceFrequencies, DEFLATE_DISTANCE_CODES, 15, distanceLengths);
+    huffman_buildCodes(literalLengths, DEFLATE_LITERAL_CODES, literalCodes);
+    huffman_buildCodes(distanceLengths, DEFLATE_DISTANCE_CODES, distanceCodes);
 
-    if (array_caseEqualsString(extension, length, ".js")) {
-        return "application/javascript";
+    int32_t literalCount = DEFLATE_LITERAL_CODES;
+    while (literalCount > 257 && literalLengths[literalCount - 1] == 0) {
+        --literalCount;
     }
 
-    if (array_caseEqualsString(extension, length, ".css")) {
-        return "text/css";
+    int32_t distanceCount = DEFLATE_DISTANCE_CODES;
+    while (distanceCount > 1 && distanceLengths[distanceCount - 1] == 0) {
+        --distanceCount;
     }
 
-    if (array_caseEqualsString(extension, length, ".xml")) {
-        return "text/xml";
-    }
+    // Both sets of code lengths are written as one sequence,
+    // with runs shortened using codes 16 (repeat the previous
+    // length), 17 and 18 (repeat zero).
+    int32_t lengthCount = literalCount + distanceCount;
+    uint8_t runCodes[DEFLATE_LITERAL_CODES + DEFLATE_DISTANCE_CODES];
+    uint8_t runExtra[DEFLATE_LITERAL_CODES + DEFLATE_DISTANCE_CODES];
+    uint32_t codeLengthFrequencies[DEFLATE_CODE_LENGTH_CODES] = { 0 };
+    int32_t runCount = 0;
 
-    if (array_caseEqualsString(extension, length, ".json")) {
-        return "application/json";
-    }
+    memmove(lengths + literalCount, distanceLengths, distanceCount);
 
-    if (array_caseEqualsString(extension, length, ".txt")) {
-        return "text/plain";
-    }
+    for (int32_t i = 0; i < lengthCount;) {
+        uint8_t value = lengths[i];
+        int32_t run = 1;
 
-    /////////////
-    // Images
-    /////////////
-    if (array_caseEqualsString(extension, length, ".jpeg") || array_caseEqualsString(extension, length, ".jpg")) {
-        return "image/jpeg";
-    }
+        while (i + run < lengthCount && lengths[i + run] == value) {
+            ++run;
+        }
 
-    if (array_caseEqualsString(extension, length, ".png")) {
-        return "image/png";
-    }
+        if (value == 0 && run >= 11) {
+            run = run > 138 ? 138 : run;
+            runCodes[runCount] = 18;
+            runExtra[runCount] = run - 11;
+        } else if (value == 0 && run >= 3) {
+            runCodes[runCount] = 17;
+            runExtra[runCount] = run - 3;
+        } else if (value != 0 && i > 0 && lengths[i - 1] == value && run >= 3) {
+            run = run > 6 ? 6 : run;
+            runCodes[runCount] = 16;
+            runExtra[runCount] = run - 3;
+        } else {
+            run = 1;
+            runCodes[runCount] = value;
+        }
 
-    if (array_caseEqualsString(extension, length, ".gif")) {
-        return "image/gif";
+        ++codeLengthFrequencies[runCodes[runCount]];
+        ++runCount;
+        i += run;
     }
 
-    if (array_caseEqualsString(extension, length, ".bmp")) {
-        return "image/bmp";
-    }
+    uint8_t codeLengthLengths[DEFLATE_CODE_LENGTH_CODES];
+    uint16_t codeLengthCodes[DEFLATE_CODE_LENGTH_CODES];
+    huffman_buildLengths(codeLengthFrequencies, DEFLATE_CODE_LENGTH_CODES, 7, codeLengthLengths);
+    huffman_buildCodes(codeLengthLengths, DEFLATE_CODE_LENGTH_CODES, codeLengthCodes);
 
-    if (array_caseEqualsString(extension, length, ".svg")) {
-        return "image/svg+xml";
+    int32_t codeLengthCount = DEFLATE_CODE_LENGTH_CODES;
+    while (codeLengthCount > 4 && codeLengthLengths[DEFLATE_CODE_LENGTH_ORDER[codeLengthCount - 1]] == 0) {
+        --codeLengthCount;
     }
 
-    /////////////
-    // Video
-    /////////////
-    if (array_caseEqualsString(extension, length, ".ogv")) {
-        return "video/ogg";
-    }
+    // Block header
+    gzipEncoder_putBits(encoder, last, 1, output);
+    gzipEncoder_putBits(encoder, 2, 2, output);
+    gzipEncoder_putBits(encoder, literalCount - 257, 5, output);
+    gzipEncoder_putBits(encoder, distanceCount - 1, 5, output);
+    gzipEncoder_putBits(encoder, codeLengthCount - 4, 4, output);
 
-    if (array_caseEqualsString(extension, length, ".mp4")) {
-        return "video/mp4";
+    for (int32_t i = 0; i < codeLengthCount; ++i) {
+        gzipEncoder_putBits(encoder, codeLengthLengths[DEFLATE_CODE_LENGTH_ORDER[i]], 3, output);
     }
 
-    if (array_caseEqualsString(extension, length, ".mpg") || array_caseEqualsString(extension, length, ".mpeg")) {
-        return "video/mpeg";
-    }
+    for (int32_t i = 0; i < runCount; ++i) {
+        uint8_t code = runCodes[i];
+        gzipEncoder_putBits(encoder, codeLengthCodes[code], codeLengthLengths[code], output);
 
-    if (array_caseEqualsString(extension, length, ".mov")) {
-        return "video/quicktime";
+        if (code == 16) {
+            gzipEncoder_putBits(encoder, runExtra[i], 2, output);
+        } else if (code == 17) {
+            gzipEncoder_putBits(encoder, runExtra[i], 3, output);
+        } else if (code == 18) {
+            gzipEncoder_putBits(encoder, runExtra[i], 7, output);
+        }
     }
 
-    /////////////
-    // Audio
-    /////////////
-    if (array_caseEqualsString(extension, length, ".ogg")) {
-        return "application/ogg";
-    }
+    // Block contents
+    for (int64_t i = 0; i < encoder->symbolCount; ++i) {
+        uint16_t value = symbols[2 * i];
+        uint16_t distance = symbols[2 * i + 1];
 
-    if (array_caseEqualsString(extension, length, ".oga")) {
-        return "audio/ogg";
-    }
+        if (distance == 0) {
+            gzipEncoder_putBits(encoder, literalCodes[value], literalLengths[value], output);
+            continue;
+        }
 
-    if (array_caseEqualsString(extension, length, ".mp3")) {
-        return "audio/mpeg";
-    }
+        int32_t code = deflate_lengthCode(value);
+        gzipEncoder_putBits(encoder, literalCodes[257 + code], literalLengths[257 + code], output);
+        gzipEncoder_putBits(encoder, value - DEFLATE_LENGTH_BASES[code], DEFLATE_LENGTH_EXTRA_BITS[code], output);
 
-    if (array_caseEqualsString(extension, length, ".wav")) {
-        return "audio/wav";
+        code = deflate_distanceCode(distance);
+        gzipEncoder_putBits(encoder, distanceCodes[code], distanceLengths[code], output);
+        gzipEncoder_putBits(encoder, distance - DEFLATE_DISTANCE_BASES[code], DEFLATE_DISTANCE_EXTRA_BITS[code], output);
     }
 
-    return "application/octet-stream";
+    gzipEncoder_putBits(encoder, literalCodes[DEFLATE_END_OF_BLOCK], literalLengths[DEFLATE_END_OF_BLOCK], output);
+    encoder->symbolCount = 0;
 }
 
-// We only support GET and HEAD. Return an int representing
-// the method.
-int32_t methodCodeFromBuffer(Buffer* buffer) {
-    if (array_caseEqualsString(buffer->data, buffer->length, "GET")) {
-        return HTTP_METHOD_GET;
-    }
+// Add a literal or a match to the current block, writing
+// the block out once it's full.
+void gzipEncoder_addSymbol(GzipEncoder* encoder, uint16_t value, uint16_t distance, Buffer* output) {
+    encoder->symbols[2 * encoder->symbolCount] = value;
+    encoder->symbols[2 * encoder->symbolCount + 1] = distance;
 
-    if (array_caseEqualsString(buffer->data, buffer->length, "HEAD")) {
-        return HTTP_METHOD_HEAD;
+    if (++encoder->symbolCount == DEFLATE_BLOCK_SYMBOLS) {
+        gzipEncoder_writeBlock(encoder, 0, output);
     }
+}
 
-    return HTTP_METHOD_UNSUPPORTED;
+// Hash the three bytes starting at a window position.
+uint32_t gzipEncoder_hash(const uint8_t* bytes) {
+    uint32_t value = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16);
+
+    return (value * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
 }
 
-// Validate and parse the incoming request string.
-int8_t parseRequestFromBuffer(const Buffer* requestBuffer, Request* request) {
-    request->method.length = 0;
-    request->path.length = 0;
-    request->version.length = 0;
+// Add a window position to its hash chain.
+void gzipEncoder_insert(GzipEncoder* encoder, int64_t position, uint32_t hash) {
+    encoder->prev[position & (DEFLATE_WINDOW_SIZE - 1)] = encoder->head[hash];
+    encoder->head[hash] = position;
+}
 
-    int8_t* requestString = requestBuffer->data;
-    int64_t requestStringLength = requestBuffer->length;
+// Encode the window up to its end if finishing, otherwise up to
+// where a match could run past the bytes received so far. Each
+// position takes the longest match found along its hash chain,
+// or is sent as a literal.
+void gzipEncoder_deflate(GzipEncoder* encoder, int8_t finish, Buffer* output) {
+    const uint8_t* window = (uint8_t *) encoder->window;
+    int64_t end = encoder->windowLength;
 
-    // Skip leading newlines
-    int64_t index = skipArrayHttpNewlines(requestString, requestStringLength);
-    if (array_incrementPointer(&requestString, &requestStringLength, index) == -1) {
-        return -1;
+    if (!finish) {
+        end -= DEFLATE_MAX_MATCH + DEFLATE_MIN_MATCH;
     }
 
-    // Get method
-    index = skipArraySpaces(requestString, requestStringLength);
-    if (array_incrementPointer(&requestString, &requestStringLength, index) == -1) {
-        return -1;
-    }
+    while (encoder->position < end) {
+        int64_t position = encoder->position;
+        int64_t available = encoder->windowLength - position;
+        int64_t maxLength = available < DEFLATE_MAX_MATCH ? available : DEFLATE_MAX_MATCH;
+        int64_t bestLength = 0;
+        int64_t bestDistance = 0;
+
+        if (available >= DEFLATE_MIN_MATCH) {
+            uint32_t hash = gzipEncoder_hash(window + position);
+            int64_t candidate = encoder->head[hash];
+            int32_t chain = DEFLATE_MAX_CHAIN;
+
+            while (candidate >= 0 && position - candidate <= DEFLATE_WINDOW_SIZE && chain-- > 0) {
+                // Only a match that beats the best so far is worth comparing.
+                if (window[candidate + bestLength] == window[position + bestLength]) {
+                    int64_t length = 0;
+
+                    while (length < maxLength && window[candidate + length] == window[position + length]) {
+                        ++length;
+                    }
 
-    index = array_findFromCharSet(requestString, requestStringLength, BYTESET_TOKEN_END);
-    if (index == -1) {
-        return -1;
-    }
-    buffer_appendFromArray(&request->method, requestString, index);
-    requestString += index;
-    requestStringLength -= index;
+                    if (length > bestLength) {
+                        bestLength = length;
+                        bestDistance = position - candidate;
 
+                        if (length >= maxLength || length >= DEFLATE_NICE_MATCH) {
+                            break;
+                        }
+                    }
+                }
 
-    // Get path
-    buffer_appendFromChar(&request->path, '.');
+                candidate = encoder->prev[candidate & (DEFLATE_WINDOW_SIZE - 1)];
+            }
 
-    index = skipArraySpaces(requestString, requestStringLength);
-    if (array_incrementPointer(&requestString, &requestStringLength, index) == -1) {
-        return -1;
-    }
+            gzipEncoder_insert(encoder, position, hash);
+        }
 
-    index = array_findFromCharSet(requestString, requestStringLength, BYTESET_PATH_END);
-    if (index == -1) {
-        return -1;
-    }
-    buffer_appendFromArray(&request->path, requestString, index);
-    requestString += index;
-    requestStringLength -= index;
+        if (bestLength >= DEFLATE_MIN_MATCH) {
+            gzipEncoder_addSymbol(encoder, bestLength, bestDistance, output);
 
-    if (hexDecodeBuffer(&request->path) == -1) {
-        return -1;
-    }
-    removeBufferDotSegments(&request->path);
+            for (int64_t i = position + 1; i < position + bestLength && i + DEFLATE_MIN_MATCH <= encoder->windowLength; ++i) {
+                gzipEncoder_insert(encoder, i, gzipEncoder_hash(window + i));
+            }
 
-    // Skip over query (?) and fragment (#) parts, if they exist.
-    index = array_findFromCharSet(requestString, requestStringLength, BYTESET_TOKEN_END);
-    if (array_incrementPointer(&requestString, &requestStringLength, index) == -1) {
-        return -1;
+            encoder->position += bestLength;
+        } else {
+            gzipEncoder_addSymbol(encoder, window[position], 0, output);
+            ++encoder->position;
+        }
     }
+}
 
-    // HTTP version string
-    index = skipArraySpaces(requestString, requestStringLength);
-    if (array_incrementPointer(&requestString, &requestStringLength, index) == -1) {
-        return -1;
-    }
+// Move the second half of a full window to the front, so
+// the last 32KB stay available for matches.
+void gzipEncoder_slide(GzipEncoder* encoder) {
+    memmove(encoder->window, encoder->window + DEFLATE_WINDOW_SIZE, DEFLATE_WINDOW_SIZE);
+    encoder->windowLength -= DEFLATE_WINDOW_SIZE;
+    encoder->position -= DEFLATE_WINDOW_SIZE;
 
-    index = array_findFromCharSet(requestString, requestStringLength, BYTESET_TOKEN_END);
-    if (index == -1) {
-        return -1;
+    for (int32_t i = 0; i < DEFLATE_HASH_SIZE; ++i) {
+        encoder->head[i] = encoder->head[i] >= DEFLATE_WINDOW_SIZE ? encoder->head[i] - DEFLATE_WINDOW_SIZE : -1;
     }
-    buffer_appendFromArray(&request->version, requestString, index);
-    requestString += index;
-    requestStringLength -= index;
 
-    index = skipArraySpaces(requestString, requestStringLength);
-    if (array_incrementPointer(&requestString, &requestStringLength, index) == -1) {
-        return -1;
+    for (int32_t i = 0; i < DEFLATE_WINDOW_SIZE; ++i) {
+        encoder->prev[i] = encoder->prev[i] >= DEFLATE_WINDOW_SIZE ? encoder->prev[i] - DEFLATE_WINDOW_SIZE : -1;
     }
+}
 
-    if (!isArrayHttpNewline(requestString, requestStringLength)) {
-        return -1;
+// Reset the encoder for a new stream and
+// append the gzip header.
+void gzipEncoder_start(GzipEncoder* encoder, Buffer* output) {
+    static const int8_t header[] = { 0x1f, (int8_t) 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+
+    for (int32_t i = 0; i < DEFLATE_HASH_SIZE; ++i) {
+        encoder->head[i] = -1;
     }
 
-    // Find "Host" header. Required to respond with 400 if not found (RFC 7230, 5.4)
-    int8_t hostFound = 0;
-    while (!hostFound && index < requestStringLength) {
-        int64_t index = skipArrayHttpNewlines(requestString, requestStringLength);
-        if (array_incrementPointer(&requestString, &requestStringLength, index) == -1) {
-            return -1;
-        }
+    encoder->windowLength = 0;
+    encoder->position = 0;
+    encoder->symbolCount = 0;
+    encoder->bits = 0;
+    encoder->bitCount = 0;
+    encoder->crc = 0xffffffff;
+    encoder->size = 0;
 
-        index = skipArraySpaces(requestString, requestStringLength);
-        if (array_incrementPointer(&requestString, &requestStringLength, index) == -1) {
-            return -1;
-        }
+    buffer_appendFromArray(output, header, sizeof(header));
+}
 
-        // Get header key
-        index = array_findFromCharSet(requestString, requestStringLength, BYTESET_HEADER_KEY_END);
-        if (index == -1) {
-            return -1;
+// Compress the next piece of the stream, appending whatever
+// output is ready. If finish is set, this is the last piece:
+// everything is flushed and the gzip trailer is appended.
+void gzipEncoder_write(GzipEncoder* encoder, const int8_t* data, int64_t length, int8_t finish, Buffer* output) {
+    while (1) {
+        if (encoder->windowLength == 2 * DEFLATE_WINDOW_SIZE) {
+            gzipEncoder_slide(encoder);
         }
 
-        // Check if it's the host header
-        if (array_caseEqualsString(requestString, index, "Host")) {
-            hostFound = 1;
-        }
-        if (array_incrementPointer(&requestString, &requestStringLength, index) == -1) {
-            return -1;
-        }
+        int64_t space = 2 * DEFLATE_WINDOW_SIZE - encoder->windowLength;
+        int64_t copied = length < space ? length : space;
 
-        // Colon has to come immediately after header key (RFC 7230, 3.2.4)
-        if (*requestString != ':') {
-            return -1;
-        }
+        memcpy(encoder->window + encoder->windowLength, data, copied);
+        encoder->windowLength += copied;
+        encoder->size += copied;
 
-        // We don't care what the header value is.
-        index = array_findFromCharSet(requestString, requestStringLength, HTTP_NEWLINE);
-        if (index == -1) {
-            return -1;
-        } 
-        if (array_incrementPointer(&requestString, &requestStringLength, index) == -1) {
-            return -1;
+        for (int64_t i = 0; i < copied; ++i) {
+            encoder->crc = crc32Table[(encoder->crc ^ (uint8_t) data[i]) & 0xff] ^ (encoder->crc >> 8);
         }
 
-        // Just make sure it has a proper line ending.
-        if (!isArrayHttpNewline(requestString, requestStringLength)) {
-            return -1;
-        }
+        data += copied;
+        length -= copied;
+
+        gzipEncoder_deflate(encoder, finish && length == 0, output);
 
-        if (hostFound || isArrayHttpHeaderEnd(requestString, requestStringLength)) {
+        if (length == 0) {
             break;
         }
     }
 
-    // If we didn't find a "Host" header, it's a bad request
-    if (!hostFound) {
-        return -1;
+    if (!finish) {
+        return;
     }
 
-    return 0;
-}
+    if (encoder->symbolCount > 0) {
+        gzipEncoder_writeBlock(encoder, 1, output);
+    } else {
+        // Empty final block with fixed codes: just the end-of-block code.
+        gzipEncoder_putBits(encoder, 1, 1, output);
+        gzipEncoder_putBits(encoder, 1, 2, output);
+        gzipEncoder_putBits(encoder, 0, 7, output);
+    }
 
-// Null-terminated byte sequences for alphabetical ordering. Result
-// < 0 means filename1 comes first. Result > 0 means filename2
-// should come first, 0 means they're the same.
-// Note that these are byte sequences rather than char strings
-// because they're pointers into a buffer (see handleRequest).
-int32_t compareFilenames(int8_t* filename1, int8_t* filename2) {
-    int64_t i = 0;
-    while (filename1[i] || filename2[i]) {
-        if (!filename1[i]) {
-            // Name 1 is shorter
-            return -1;
-        }
+    while (encoder->bitCount > 0) {
+        buffer_appendFromChar(output, encoder->bits);
+        encoder->bits >>= 8;
+        encoder->bitCount -= encoder->bitCount < 8 ? encoder->bitCount : 8;
+    }
 
-        if (!filename2[i]) {
-            // Name 2 is shorter
+    uint32_t crc = encoder->crc ^ 0xffffffff;
+    int8_t trailer[8] = {
+        crc, crc >> 8, crc >> 16, crc >> 24,
+        encoder->size, encoder->size >> 8, encoder->size >> 16, encoder->size >> 24
+    };
+    buffer_appendFromArray(output, trailer, 8);
+}
+
+// Compress a complete body into a gzip stream.
+void gzipEncoder_compress(GzipEncoder* encoder, const int8_t* data, int64_t length, Buffer* output) {
+    gzipEncoder_start(encoder, output);
+    gzipEncoder_write(encoder, data, length, 1, output);
+}
+
+//////////////////////////////////////////
+// CONNECTION QUEUE
+//
+// Passes accepted sockets from the main
+// thread to blocking workers without locks.
+// Pushing and popping only touch the
+// queue's atomics. Threads only make a
+// system call when they have to park
+// because the queue is empty or full, or
+// to wake a parked thread.
+//////////////////////////////////////////
+
+// Sleep until the value at address is no longer value.
+void futexWait(atomic_uint* address, uint32_t value) {
+    syscall(SYS_futex, address, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+// Wake up to count threads sleeping on address.
+void futexWake(atomic_uint* address, int32_t count) {
+    syscall(SYS_futex, address, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+// Initialize a queue that can hold at least capacity
+// sockets. Capacity is rounded up to a power of two, and
+// at least 2, since with a single slot a filled slot's sequence
+// number would look free to the next producer.
+void connectionQueue_init(ConnectionQueue* queue, uint64_t capacity) {
+    uint64_t size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    queue->slots = malloc(size * sizeof(ConnectionQueueSlot));
+
+    if (!queue->slots) {
+        fprintf(stderr, "connectionQueue_init: Out of memory\n");
+        exit(1);
+    }
+
+    for (uint64_t i = 0; i < size; ++i) {
+        atomic_init(&queue->slots[i].sequence, i);
+        queue->slots[i].socket = -1;
+    }
+
+    queue->mask = size - 1;
+    atomic_init(&queue->enqueuePosition, 0);
+    atomic_init(&queue->dequeuePosition, 0);
+    atomic_init(&queue->pushCount, 0);
+    atomic_init(&queue->popCount, 0);
+    atomic_init(&queue->waitingConsumers, 0);
+    atomic_init(&queue->waitingProducers, 0);
+}
+
+// Deallocate memory associated with a queue.
+void connectionQueue_delete(ConnectionQueue* queue) {
+    if (queue->slots == 0) {
+        return;
+    }
+    free(queue->slots);
+    queue->slots = 0;
+}
+
+// Add a socket to the queue if there's room. If succesful return 0,
+// else return -1.
+int8_t connectionQueue_tryPush(ConnectionQueue* queue, int32_t socket) {
+    ConnectionQueueSlot* slot;
+    uint64_t position = atomic_load_explicit(&queue->enqueuePosition, memory_order_relaxed);
+
+    while (1) {
+        slot = &queue->slots[position & queue->mask];
+        uint64_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        int64_t difference = (int64_t) sequence - (int64_t) position;
+
+        if (difference == 0) {
+            // Slot is free. Claim it if no other producer got there first.
+            if (atomic_compare_exchange_weak_explicit(&queue->enqueuePosition, &position, position + 1, memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (difference < 0) {
+            // Slot still holds a socket from the previous lap.
+            return -1;
+        } else {
+            position = atomic_load_explicit(&queue->enqueuePosition, memory_order_relaxed);
+        }
+    }
+
+    slot->socket = socket;
+    atomic_store_explicit(&slot->sequence, position + 1, memory_order_release);
+
+    return 0;
+}
+
+// Take a socket from the queue if there is one. If succesful return 0,
+// else return -1.
+int8_t connectionQueue_tryPop(ConnectionQueue* queue, int32_t* socket) {
+    ConnectionQueueSlot* slot;
+    uint64_t position = atomic_load_explicit(&queue->dequeuePosition, memory_order_relaxed);
+
+    while (1) {
+        slot = &queue->slots[position & queue->mask];
+        uint64_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        int64_t difference = (int64_t) sequence - (int64_t) (position + 1);
+
+        if (difference == 0) {
+            // Slot is filled. Claim it if no other consumer got there first.
+            if (atomic_compare_exchange_weak_explicit(&queue->dequeuePosition, &position, position + 1, memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (difference < 0) {
+            // Slot hasn't been filled yet.
+            return -1;
+        } else {
+            position = atomic_load_explicit(&queue->dequeuePosition, memory_order_relaxed);
+        }
+    }
+
+    *socket = slot->socket;
+    atomic_store_explicit(&slot->sequence, position + queue->mask + 1, memory_order_release);
+
+    return 0;
+}
+
+// Number of sockets currently waiting in the queue.
+int64_t connectionQueue_size(ConnectionQueue* queue) {
+    uint64_t enqueuePosition = atomic_load_explicit(&queue->enqueuePosition, memory_order_relaxed);
+    uint64_t dequeuePosition = atomic_load_explicit(&queue->dequeuePosition, memory_order_relaxed);
+
+    return enqueuePosition > dequeuePosition ? enqueuePosition - dequeuePosition : 0;
+}
+
+// Add a socket to the queue, parking while the queue is full.
+void connectionQueue_push(ConnectionQueue* queue, int32_t socket) {
+    while (connectionQueue_tryPush(queue, socket) == -1) {
+        // Register as waiting before checking again, so a
+        // consumer that pops after the check will see us.
+        uint32_t popCount = atomic_load(&queue->popCount);
+        atomic_fetch_add(&queue->waitingProducers, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+
+        if (connectionQueue_tryPush(queue, socket) == 0) {
+            atomic_fetch_sub(&queue->waitingProducers, 1);
+            break;
+        }
+
+        futexWait(&queue->popCount, popCount);
+        atomic_fetch_sub(&queue->waitingProducers, 1);
+    }
+
+    atomic_fetch_add(&queue->pushCount, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&queue->waitingConsumers) > 0) {
+        futexWake(&queue->pushCount, 1);
+    }
+}
+
+// Take a socket from the queue, parking while the queue is empty.
+int32_t connectionQueue_pop(ConnectionQueue* queue) {
+    int32_t socket;
+
+    while (connectionQueue_tryPop(queue, &socket) == -1) {
+        // Register as waiting before checking again, so a
+        // producer that pushes after the check will see us.
+        uint32_t pushCount = atomic_load(&queue->pushCount);
+        atomic_fetch_add(&queue->waitingConsumers, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+
+        if (connectionQueue_tryPop(queue, &socket) == 0) {
+            atomic_fetch_sub(&queue->waitingConsumers, 1);
+            break;
+        }
+
+        futexWait(&queue->pushCount, pushCount);
+        atomic_fetch_sub(&queue->waitingConsumers, 1);
+    }
+
+    atomic_fetch_add(&queue->popCount, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&queue->waitingProducers) > 0) {
+        futexWake(&queue->popCount, 1);
+    }
+
+    return socket;
+}
+
+//////////////////////////////////////////
+// METRICS
+//
+// Each thread counts what it does in its
+// own Metrics struct. Only the thread
+// writes its counters, so updating one is
+// a relaxed load and store, and they're
+// only summed over all threads when the
+// metrics endpoint is read.
+//////////////////////////////////////////
+
+// Get the current time in seconds from a clock
+// that can't jump backwards.
+int64_t monotonicSeconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+
+    return now.tv_sec;
+}
+
+// Get the current time in nanoseconds from a clock
+// that can't jump backwards.
+int64_t monotonicNanoseconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Add to one of the calling thread's own counters.
+void metrics_add(atomic_uint_fast64_t* counter, uint64_t value) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+// Get the time to measure a duration from, or 0 if
+// metrics are off and nothing needs timing.
+int64_t metrics_time(void) {
+    return options.metrics ? monotonicNanoseconds() : 0;
+}
+
+// Get the bucket of a histogram a duration in nanoseconds
+// falls into: the power of two below it, then the next
+// HISTOGRAM_SUB_BITS bits.
+int32_t histogram_bucket(uint64_t duration) {
+    if (duration < (1 << HISTOGRAM_MIN_BITS)) {
+        return 0;
+    }
+
+    int32_t octave = 63 - __builtin_clzll(duration);
+    int32_t subBucket = (duration >> (octave - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1);
+    int32_t bucket = (octave - HISTOGRAM_MIN_BITS) * HISTOGRAM_SUB_BUCKETS + subBucket + 1;
+
+    return bucket < HISTOGRAM_BUCKETS - 1 ? bucket : HISTOGRAM_BUCKETS - 1;
+}
+
+// Get the duration in nanoseconds that all durations in a
+// bucket are below. The last bucket has no limit.
+uint64_t histogram_bucketLimit(int32_t bucket) {
+    if (bucket == 0) {
+        return 1 << HISTOGRAM_MIN_BITS;
+    }
+
+    int32_t octave = (bucket - 1) / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_MIN_BITS;
+    int32_t subBucket = (bucket - 1) % HISTOGRAM_SUB_BUCKETS;
+
+    return (uint64_t) (HISTOGRAM_SUB_BUCKETS + subBucket + 1) << (octave - HISTOGRAM_SUB_BITS);
+}
+
+// Record the duration from start (a metrics_time value) until
+// now in one of the calling thread's histograms. Nothing is
+// recorded if start is 0.
+void histogram_record(Histogram* histogram, int64_t start) {
+    if (start == 0) {
+        return;
+    }
+
+    int64_t duration = monotonicNanoseconds() - start;
+    metrics_add(&histogram->counts[histogram_bucket(duration)], 1);
+    metrics_add(&histogram->sum, duration);
+}
+
+// Get the status code from the status line a response starts with.
+int32_t statusFromArray(const int8_t* statusLine) {
+    const int8_t* code = statusLine + string_length("HTTP/1.1 ");
+
+    return (code[0] - '0') * 100 + (code[1] - '0') * 10 + (code[2] - '0');
+}
+
+// Count a response by its status code.
+void metrics_countResponse(Metrics* metrics, int32_t status) {
+    int32_t index = 0;
+
+    // The last index counts all other codes.
+    while (index < METRICS_NUM_STATUSES - 1 && METRICS_STATUS_CODES[index] != status) {
+        ++index;
+    }
+
+    metrics_add(&metrics->responses[index], 1);
+}
+
+// Sum the counters of all threads. Metrics is made up
+// of nothing but counters, so it's summed as an array.
+void metrics_sum(Metrics* total) {
+    atomic_uint_fast64_t* to = (atomic_uint_fast64_t*) total;
+    int64_t count = sizeof(Metrics) / sizeof(atomic_uint_fast64_t);
+
+    memset(total, 0, sizeof(Metrics));
+
+    for (int64_t i = 0; i < numThreads; ++i) {
+        atomic_uint_fast64_t* from = (atomic_uint_fast64_t*) &threads[i].metrics;
+
+        for (int64_t j = 0; j < count; ++j) {
+            metrics_add(&to[j], atomic_load_explicit(&from[j], memory_order_relaxed));
+        }
+    }
+}
+
+// Append a number of nanoseconds as seconds
+// with a decimal fraction.
+void buffer_appendSeconds(Buffer* buffer, uint64_t nanoseconds) {
+    int8_t fraction[9];
+
+    buffer_appendFromUint(buffer, nanoseconds / 1000000000);
+    nanoseconds %= 1000000000;
+
+    for (int32_t i = 8; i >= 0; --i) {
+        fraction[i] = '0' + nanoseconds % 10;
+        nanoseconds /= 10;
+    }
+
+    buffer_appendFromChar(buffer, '.');
+    buffer_appendFromArray(buffer, fraction, 9);
+}
+
+// Append the HELP and TYPE lines that start a metric.
+void appendMetricHeader(Buffer* buffer, const char* name, const char* type, const char* help) {
+    buffer_appendFromString(buffer, "# HELP ");
+    buffer_appendFromString(buffer, name);
+    buffer_appendFromChar(buffer, ' ');
+    buffer_appendFromString(buffer, help);
+    buffer_appendFromString(buffer, "\n# TYPE ");
+    buffer_appendFromString(buffer, name);
+    buffer_appendFromChar(buffer, ' ');
+    buffer_appendFromString(buffer, type);
+    buffer_appendFromChar(buffer, '\n');
+}
+
+// Append a sample of a metric. The labels, if any, are
+// given without the surrounding braces.
+void appendMetricSample(Buffer* buffer, const char* name, const char* labels, uint64_t value) {
+    buffer_appendFromString(buffer, name);
+
+    if (labels) {
+        buffer_appendFromChar(buffer, '{');
+        buffer_appendFromString(buffer, labels);
+        buffer_appendFromChar(buffer, '}');
+    }
+
+    buffer_appendFromChar(buffer, ' ');
+    buffer_appendFromUint(buffer, value);
+    buffer_appendFromChar(buffer, '\n');
+}
+
+// Append a sample of a metric measured in seconds.
+void appendMetricSeconds(Buffer* buffer, const char* name, const char* labels, uint64_t nanoseconds) {
+    buffer_appendFromString(buffer, name);
+
+    if (labels) {
+        buffer_appendFromChar(buffer, '{');
+        buffer_appendFromString(buffer, labels);
+        buffer_appendFromChar(buffer, '}');
+    }
+
+    buffer_appendFromChar(buffer, ' ');
+    buffer_appendSeconds(buffer, nanoseconds);
+    buffer_appendFromChar(buffer, '\n');
+}
+
+// Append the metrics of all threads in the Prometheus
+// text exposition format.
+void appendMetrics(Buffer* buffer) {
+    Metrics total;
+    char labels[64];
+
+    metrics_sum(&total);
+
+    appendMetricHeader(buffer, "cervit_requests_total", "counter", "Requests received, by method.");
+    for (int32_t i = 0; i < METRICS_NUM_METHODS; ++i) {
+        snprintf(labels, sizeof(labels), "method=\"%s\"", METRICS_METHOD_NAMES[i]);
+        appendMetricSample(buffer, "cervit_requests_total", labels, total.requests[i]);
+    }
+
+    appendMetricHeader(buffer, "cervit_responses_total", "counter", "Responses sent, by status code.");
+    for (int32_t i = 0; i < METRICS_NUM_STATUSES; ++i) {
+        if (METRICS_STATUS_CODES[i]) {
+            snprintf(labels, sizeof(labels), "code=\"%d\"", METRICS_STATUS_CODES[i]);
+        } else {
+            snprintf(labels, sizeof(labels), "code=\"other\"");
+        }
+        appendMetricSample(buffer, "cervit_responses_total", labels, total.responses[i]);
+    }
+
+    appendMetricHeader(buffer, "cervit_sent_bytes_total", "counter", "Bytes written to client sockets.");
+    appendMetricSample(buffer, "cervit_sent_bytes_total", 0, total.bytesSent);
+
+    appendMetricHeader(buffer, "cervit_file_cache_hits_total", "counter", "File cache lookups that found a fresh entry.");
+    appendMetricSample(buffer, "cervit_file_cache_hits_total", 0, total.cacheHits);
+    appendMetricHeader(buffer, "cervit_file_cache_misses_total", "counter", "File cache lookups that didn't.");
+    appendMetricSample(buffer, "cervit_file_cache_misses_total", 0, total.cacheMisses);
+
+    appendMetricHeader(buffer, "cervit_queue_wait_seconds_total", "counter", "Time worker threads spent waiting for connections.");
+    appendMetricSeconds(buffer, "cervit_queue_wait_seconds_total", 0, total.queueWait);
+
+    appendMetricHeader(buffer, "cervit_cache_lock_wait_seconds_total", "counter", "Time threads spent waiting for a cache's lock.");
+    appendMetricSeconds(buffer, "cervit_cache_lock_wait_seconds_total", "cache=\"file\"", total.cacheLockWait[CACHE_FILE]);
+    appendMetricSeconds(buffer, "cervit_cache_lock_wait_seconds_total", "cache=\"listing\"", total.cacheLockWait[CACHE_LISTING]);
+
+    appendMetricHeader(buffer, "cervit_access_log_dropped_total", "counter", "Access log records dropped because the logger fell behind.");
+    appendMetricSample(buffer, "cervit_access_log_dropped_total", 0, total.logDropped);
+
+    appendMetricHeader(buffer, "cervit_phase_duration_seconds", "histogram", "Time spent reading requests, preparing responses and writing them.");
+    for (int32_t i = 0; i < METRICS_NUM_PHASES; ++i) {
+        Histogram* histogram = &total.phases[i];
+        uint64_t count = 0;
+
+        // Buckets are cumulative.
+        for (int32_t j = 0; j < HISTOGRAM_BUCKETS; ++j) {
+            count += histogram->counts[j];
+
+            buffer_appendFromString(buffer, "cervit_phase_duration_seconds_bucket{phase=\"");
+            buffer_appendFromString(buffer, METRICS_PHASE_NAMES[i]);
+            buffer_appendFromString(buffer, "\",le=\"");
+
+            if (j < HISTOGRAM_BUCKETS - 1) {
+                buffer_appendSeconds(buffer, histogram_bucketLimit(j));
+            } else {
+                buffer_appendFromString(buffer, "+Inf");
+            }
+
+            buffer_appendFromString(buffer, "\"} ");
+            buffer_appendFromUint(buffer, count);
+            buffer_appendFromChar(buffer, '\n');
+        }
+
+        snprintf(labels, sizeof(labels), "phase=\"%s\"", METRICS_PHASE_NAMES[i]);
+        appendMetricSeconds(buffer, "cervit_phase_duration_seconds_sum", labels, histogram->sum);
+        appendMetricSample(buffer, "cervit_phase_duration_seconds_count", labels, count);
+    }
+}
+
+// Append a response with the current metrics. They change
+// with every request, so clients are told not to cache them.
+void appendMetricsResponse(Thread* thread, Connection* connection, int32_t method) {
+    Buffer* body = &thread->dirListingBuffer;
+    Buffer* responseBuffer = &connection->responseBuffer;
+
+    body->length = 0;
+    appendMetrics(body);
+
+    buffer_appendFromString(responseBuffer, HTTP_OK_HEADER HTTP_CACHE_HEADERS HTTP_CONTENT_TYPE_KEY METRICS_CONTENT_TYPE HTTP_NEWLINE HTTP_CONTENT_LENGTH_KEY);
+    buffer_appendFromUint(responseBuffer, body->length);
+    buffer_appendFromString(responseBuffer, HTTP_NEWLINE);
+    appendResponseHeadersEnd(connection);
+
+    if (method == HTTP_METHOD_GET) {
+        buffer_appendFromArray(responseBuffer, body->data, body->length);
+    }
+}
+
+//////////////////////////////////////////
+// CACHE
+//
+// Keeps the contents of recently served
+// files in memory, shared by all threads.
+// Entries start out on a probation list
+// and move to a protected list when they
+// are hit again, so a scan through many
+// files once can only evict other
+// probationary entries (segmented LRU).
+//////////////////////////////////////////
+
+// Lock a cache's mutex. If another thread holds it, the time
+// spent waiting is added to the calling thread's metrics.
+void cache_lock(Cache* cache, Metrics* metrics) {
+    if (pthread_mutex_trylock(&cache->mutex) == 0) {
+        return;
+    }
+
+    int64_t start = metrics_time();
+    pthread_mutex_lock(&cache->mutex);
+
+    if (start) {
+        metrics_add(&metrics->cacheLockWait[cache->id], monotonicNanoseconds() - start);
+    }
+}
+
+// Initialize a cache that holds up to budget bytes.
+void cache_init(Cache* cache, int32_t id, int64_t budget, int64_t maxEntrySize) {
+    cache->mask = CACHE_INITIAL_BUCKETS - 1;
+    cache->buckets = calloc(CACHE_INITIAL_BUCKETS, sizeof(CacheEntry*));
+
+    if (!cache->buckets) {
+        fprintf(stderr, "cache_init: Out of memory\n");
+        exit(1);
+    }
+
+    cache->count = 0;
+    cache->bytes = 0;
+    cache->protectedBytes = 0;
+    cache->budget = budget;
+    cache->maxEntrySize = maxEntrySize;
+    cache->lists[0].first = 0;
+    cache->lists[0].last = 0;
+    cache->lists[1].first = 0;
+    cache->lists[1].last = 0;
+    pthread_mutex_init(&cache->mutex, 0);
+    cache->id = id;
+}
+
+// Allocate an entry for the given key. The entry starts with one
+// reference, held by the caller.
+CacheEntry* cacheEntry_create(const int8_t* key, int64_t keyLength) {
+    CacheEntry* entry = malloc(sizeof(CacheEntry));
+
+    if (!entry) {
+        return 0;
+    }
+
+    buffer_init(&entry->key, keyLength);
+    buffer_appendFromArray(&entry->key, key, keyLength);
+    buffer_init(&entry->filename, 64);
+    buffer_init(&entry->data, 1024);
+    entry->hash = array_hash(key, keyLength);
+    entry->headerLength = 0;
+    atomic_init(&entry->checked, monotonicSeconds());
+    atomic_init(&entry->references, 1);
+    entry->cached = 0;
+    entry->protected = 0;
+    entry->hashNext = 0;
+    entry->prev = 0;
+    entry->next = 0;
+
+    return entry;
+}
+
+// Take another reference to an entry the caller
+// already holds one to.
+void cacheEntry_retain(CacheEntry* entry) {
+    atomic_fetch_add(&entry->references, 1);
+}
+
+// Drop a reference to an entry, deallocating it if it
+// was the last one.
+void cacheEntry_release(CacheEntry* entry) {
+    if (atomic_fetch_sub(&entry->references, 1) != 1) {
+        return;
+    }
+
+    buffer_delete(&entry->key);
+    buffer_delete(&entry->filename);
+    buffer_delete(&entry->data);
+    free(entry);
+}
+
+// Number of bytes an entry counts against the cache's budget.
+int64_t cacheEntry_size(CacheEntry* entry) {
+    return sizeof(CacheEntry) + entry->key.size + entry->filename.size + entry->data.size;
+}
+
+// Check that the file an entry was read from hasn't changed. The
+// file is only looked at once a second, so most hits don't touch
+// the filesystem at all. Return 1 if the entry can be used, else 0.
+int8_t cacheEntry_isFresh(CacheEntry* entry) {
+    int64_t now = monotonicSeconds();
+
+    if (atomic_load(&entry->checked) == now) {
+        return 1;
+    }
+
+    struct stat fileInfo;
+
+    if (statFileFromBuffer(&entry->filename, &fileInfo) == -1) {
+        return 0;
+    }
+
+    if (
+        fileInfo.st_ino != entry->fileInfo.st_ino ||
+        fileInfo.st_size != entry->fileInfo.st_size ||
+        fileInfo.st_mtim.tv_sec != entry->fileInfo.st_mtim.tv_sec ||
+        fileInfo.st_mtim.tv_nsec != entry->fileInfo.st_mtim.tv_nsec
+    ) {
+        return 0;
+    }
+
+    atomic_store(&entry->checked, now);
+
+    return 1;
+}
+
+// Add an entry to the front of one of the cache's lists.
+void cache_link(Cache* cache, CacheEntry* entry, int8_t protected) {
+    CacheList* list = &cache->lists[protected];
+
+    entry->protected = protected;
+    entry->prev = 0;
+    entry->next = list->first;
+
+    if (list->first) {
+        list->first->prev = entry;
+    } else {
+        list->last = entry;
+    }
+
+    list->first = entry;
+
+    if (protected) {
+        cache->protectedBytes += cacheEntry_size(entry);
+    }
+}
+
+// Remove an entry from whichever list it's on.
+void cache_unlink(Cache* cache, CacheEntry* entry) {
+    CacheList* list = &cache->lists[entry->protected];
+
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        list->first = entry->next;
+    }
+
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        list->last = entry->prev;
+    }
+
+    if (entry->protected) {
+        cache->protectedBytes -= cacheEntry_size(entry);
+    }
+}
+
+// Remove an entry from the cache and drop the cache's reference
+// to it. Must be called with the cache locked.
+void cache_evict(Cache* cache, CacheEntry* entry) {
+    CacheEntry** link = &cache->buckets[entry->hash & cache->mask];
+
+    while (*link != entry) {
+        link = &(*link)->hashNext;
+    }
+
+    *link = entry->hashNext;
+    cache_unlink(cache, entry);
+    cache->bytes -= cacheEntry_size(entry);
+    --cache->count;
+    entry->cached = 0;
+    cacheEntry_release(entry);
+}
+
+// Double the number of hash buckets.
+void cache_grow(Cache* cache) {
+    uint64_t numBuckets = (cache->mask + 1) * 2;
+    CacheEntry** buckets = calloc(numBuckets, sizeof(CacheEntry*));
+
+    // Long chains are slower, but still correct.
+    if (!buckets) {
+        return;
+    }
+
+    for (uint64_t i = 0; i <= cache->mask; ++i) {
+        CacheEntry* entry = cache->buckets[i];
+
+        while (entry) {
+            CacheEntry* next = entry->hashNext;
+            CacheEntry** bucket = &buckets[entry->hash & (numBuckets - 1)];
+            entry->hashNext = *bucket;
+            *bucket = entry;
+            entry = next;
+        }
+    }
+
+    free(cache->buckets);
+    cache->buckets = buckets;
+    cache->mask = numBuckets - 1;
+}
+
+// Find the entry for key. Must be called with the cache locked.
+CacheEntry* cache_find(Cache* cache, const int8_t* key, int64_t keyLength, uint64_t hash) {
+    CacheEntry* entry = cache->buckets[hash & cache->mask];
+
+    while (entry) {
+        if (entry->hash == hash && entry->key.length == keyLength && memcmp(entry->key.data, key, keyLength) == 0) {
+            return entry;
+        }
+
+        entry = entry->hashNext;
+    }
+
+    return 0;
+}
+
+// Look up the entry for key. If found, a reference to it is
+// returned, which the caller has to release when it's done with
+// the entry, else return 0. A hit moves a probationary entry to
+// the protected list, pushing the least recently used protected
+// entries back to probation if the protected list is over its share
+// of the budget.
+CacheEntry* cache_acquire(Cache* cache, Metrics* metrics, const int8_t* key, int64_t keyLength) {
+    uint64_t hash = array_hash(key, keyLength);
+
+    cache_lock(cache, metrics);
+
+    CacheEntry* entry = cache_find(cache, key, keyLength, hash);
+
+    if (entry) {
+        atomic_fetch_add(&entry->references, 1);
+        cache_unlink(cache, entry);
+        cache_link(cache, entry, 1);
+
+        while (cache->protectedBytes > cache->budget / 100 * CACHE_PROTECTED_PERCENT) {
+            CacheEntry* demoted = cache->lists[1].last;
+            cache_unlink(cache, demoted);
+            cache_link(cache, demoted, 0);
+        }
+    }
+
+    pthread_mutex_unlock(&cache->mutex);
+
+    return entry;
+}
+
+// Add an entry to the cache, replacing any entry with the same key,
+// then evict entries until the cache is within its budget, least
+// recently used probationary entries first. The caller keeps its
+// reference to the entry.
+void cache_insert(Cache* cache, Metrics* metrics, CacheEntry* entry) {
+    cache_lock(cache, metrics);
+
+    CacheEntry* existing = cache_find(cache, entry->key.data, entry->key.length, entry->hash);
+
+    if (existing) {
+        cache_evict(cache, existing);
+    }
+
+    if (cache->count >= (int64_t) cache->mask + 1) {
+        cache_grow(cache);
+    }
+
+    CacheEntry** bucket = &cache->buckets[entry->hash & cache->mask];
+    entry->hashNext = *bucket;
+    *bucket = entry;
+    atomic_fetch_add(&entry->references, 1);
+    entry->cached = 1;
+    cache_link(cache, entry, 0);
+    cache->bytes += cacheEntry_size(entry);
+    ++cache->count;
+
+    while (cache->bytes > cache->budget) {
+        CacheEntry* victim = cache->lists[0].last ? cache->lists[0].last : cache->lists[1].last;
+        cache_evict(cache, victim);
+    }
+
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+// Remove an entry from the cache if it's still there, e.g.
+// because the file it was read from has changed.
+void cache_remove(Cache* cache, Metrics* metrics, CacheEntry* entry) {
+    cache_lock(cache, metrics);
+
+    if (entry->cached) {
+        cache_evict(cache, entry);
+    }
+
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+// Deallocate memory associated with a cache.
+void cache_delete(Cache* cache) {
+    if (!cache->buckets) {
+        return;
+    }
+
+    for (int32_t i = 0; i < 2; ++i) {
+        while (cache->lists[i].first) {
+            cache_evict(cache, cache->lists[i].first);
+        }
+    }
+
+    free(cache->buckets);
+    cache->buckets = 0;
+    pthread_mutex_destroy(&cache->mutex);
+}
+
+//////////////////////////////////////////
+// DIRECTORY LISTINGS
+//
+// A directory's entries are read with
+// getdents64, sorted once and kept in the
+// listing cache until the directory
+// changes. Responses render one page of
+// the sorted names at a time while they're
+// sent, so even huge directories don't
+// need a full copy of their listing in
+// memory.
+//////////////////////////////////////////
+
+// Append a JSON string literal with the bytes
+// of an array, escaping as needed.
+void buffer_appendJsonString(Buffer* buffer, const int8_t* array, int64_t length) {
+    buffer_appendFromChar(buffer, '"');
+
+    for (int64_t i = 0; i < length; ++i) {
+        uint8_t c = array[i];
+
+        if (c == '"' || c == '\\') {
+            buffer_appendFromChar(buffer, '\\');
+            buffer_appendFromChar(buffer, c);
+        } else if (c < 0x20) {
+            buffer_appendFromString(buffer, "\\u00");
+            buffer_appendFromChar(buffer, "0123456789abcdef"[c >> 4]);
+            buffer_appendFromChar(buffer, "0123456789abcdef"[c & 0xf]);
+        } else {
+            buffer_appendFromChar(buffer, c);
+        }
+    }
+
+    buffer_appendFromChar(buffer, '"');
+}
+
+// Get one of the sorted names stored in a listing cache entry.
+int8_t* listing_name(CacheEntry* names, int64_t index) {
+    int64_t* offsets = (int64_t*) names->data.data;
+
+    return names->data.data + names->nameCount * sizeof(int64_t) + offsets[index];
+}
+
+// Get the sorted names of the entries of the directory in the request
+// path, from the listing cache or by reading the directory. Only
+// subdirectories and regular files are listed. The cache key includes
+// the directory's modification time, which changes whenever an entry
+// is added, removed or renamed, so a cached list is always current.
+// Returns a reference to the entry, or 0 if the directory couldn't
+// be read.
+CacheEntry* readDirectoryNames(Thread* thread, struct stat* directoryInfo) {
+    Buffer* key = &thread->cacheKeyBuffer;
+    key->length = 0;
+    buffer_appendFromArray(key, (int8_t *) &directoryInfo->st_dev, sizeof(directoryInfo->st_dev));
+    buffer_appendFromArray(key, (int8_t *) &directoryInfo->st_ino, sizeof(directoryInfo->st_ino));
+    buffer_appendFromArray(key, (int8_t *) &directoryInfo->st_mtim.tv_sec, sizeof(directoryInfo->st_mtim.tv_sec));
+    buffer_appendFromArray(key, (int8_t *) &directoryInfo->st_mtim.tv_nsec, sizeof(directoryInfo->st_mtim.tv_nsec));
+
+    CacheEntry* entry = cache_acquire(&listingCache, &thread->metrics, key->data, key->length);
+
+    if (entry) {
+        return entry;
+    }
+
+    int32_t dir = openFileFromBuffer(&thread->request.path, O_RDONLY | O_DIRECTORY);
+
+    if (dir == -1) {
+        perror("Failed to open directory");
+        return 0;
+    }
+
+    thread->dirnameBuffer.length = 0;
+    thread->filenameBuffer.length = 0;
+
+    int64_t dirCount = 0;
+    int64_t fileCount = 0;
+
+    // Read entries a buffer at a time.
+    while (1) {
+        int64_t numRead = syscall(SYS_getdents64, dir, thread->transferChunk, TRANSFER_CHUNK_SIZE);
+
+        if (numRead == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            perror("Failed to read directory");
+            close(dir);
+            return 0;
+        }
+
+        if (numRead == 0) {
+            break;
+        }
+
+        for (int64_t position = 0; position < numRead;) {
+            LinuxDirent64* dirent = (LinuxDirent64*) (thread->transferChunk + position);
+            uint8_t type = dirent->d_type;
+            position += dirent->d_reclen;
+
+            if (string_equals(dirent->d_name, ".") || string_equals(dirent->d_name, "..")) {
+                continue;
+            }
+
+            // Some filesystems don't report types.
+            if (type == DT_UNKNOWN) {
+                struct stat info;
+
+                if (fstatat(dir, dirent->d_name, &info, AT_SYMLINK_NOFOLLOW) == 0) {
+                    type = S_ISDIR(info.st_mode) ? DT_DIR : S_ISREG(info.st_mode) ? DT_REG : DT_UNKNOWN;
+                }
+            }
+
+            // Separate directory and file listings. Names of each
+            // are kept in a single buffer, separated by null characters.
+            if (type == DT_DIR) {
+                buffer_appendFromString(&thread->dirnameBuffer, dirent->d_name);
+                buffer_appendFromChar(&thread->dirnameBuffer, '\0');
+                ++dirCount;
+            } else if (type == DT_REG) {
+                buffer_appendFromString(&thread->filenameBuffer, dirent->d_name);
+                buffer_appendFromChar(&thread->filenameBuffer, '\0');
+                ++fileCount;
+            }
+        }
+
+        // The names no longer fit in the request's memory.
+        if (thread->dirnameBuffer.failed || thread->filenameBuffer.failed) {
+            close(dir);
+            return 0;
+        }
+    }
+
+    close(dir);
+
+    // Here we set up pointers to the beginning of each name in
+    // the two buffers of directory and file names, directories
+    // first. We'll sort pointers to arrange the listing
+    // alphabetically. Large directories can have hundreds of
+    // thousands of names, so the pointers live in buffers
+    // rather than on the stack.
+    int64_t nameCount = dirCount + fileCount;
+
+    if (buffer_checkAllocation(&thread->nameListBuffer, nameCount * sizeof(int8_t*)) == -1 ||
+        buffer_checkAllocation(&thread->sortBuffer, nameCount * sizeof(int8_t*)) == -1) {
+        return 0;
+    }
+
+    int8_t** directoryNames = (int8_t**) thread->nameListBuffer.data;
+    int8_t** filenames = directoryNames + dirCount;
+    Buffer* nameBuffers[] = { &thread->dirnameBuffer, &thread->filenameBuffer };
+    int8_t** lists[] = { directoryNames, filenames };
+
+    for (int32_t i = 0; i < 2; ++i) {
+        int8_t* current = nameBuffers[i]->data;
+        int8_t* end = nameBuffers[i]->data + nameBuffers[i]->length;
+        int64_t count = 0;
+
+        while (current != end) {
+            lists[i][count++] = current;
+            current += string_length((char *) current) + 1;
+        }
+    }
+
+    // Sort the two lists.
+    sortFilenameList(directoryNames, dirCount, (int8_t**) thread->sortBuffer.data);
+    sortFilenameList(filenames, fileCount, (int8_t**) thread->sortBuffer.data);
+
+    entry = cacheEntry_create(key->data, key->length);
+
+    if (!entry) {
+        return 0;
+    }
+
+    entry->fileInfo = *directoryInfo;
+    entry->directoryCount = dirCount;
+    entry->nameCount = nameCount;
+    buffer_appendFromArray(&entry->filename, thread->request.path.data, thread->request.path.length);
+
+    // Offsets of the names, then the names in order.
+    int64_t namesStart = nameCount * sizeof(int64_t);
+
+    if (buffer_checkAllocation(&entry->data, namesStart + thread->dirnameBuffer.length + thread->filenameBuffer.length) == -1) {
+        cacheEntry_release(entry);
+        return 0;
+    }
+
+    entry->data.length = namesStart;
+
+    // The file pointers follow the directory pointers.
+    for (int64_t i = 0; i < nameCount; ++i) {
+        ((int64_t*) entry->data.data)[i] = entry->data.length - namesStart;
+        buffer_appendFromArray(&entry->data, directoryNames[i], string_length((char *) directoryNames[i]) + 1);
+    }
+
+    if (entry->data.length <= listingCache.maxEntrySize) {
+        cache_insert(&listingCache, &thread->metrics, entry);
+    }
+
+    return entry;
+}
+
+// Set up a page of a listing for the request path. The page takes
+// over the caller's reference to names.
+void listingPage_init(ListingPage* page, CacheEntry* names, Buffer* path, int64_t offset, int64_t limit, int32_t format) {
+    page->names = names;
+    buffer_init(&page->path, path->length);
+    buffer_appendFromArray(&page->path, path->data, path->length);
+    page->start = offset < names->nameCount ? offset : names->nameCount;
+    page->end = limit >= 0 && limit < names->nameCount - page->start ? page->start + limit : names->nameCount;
+    page->next = page->start;
+    page->format = format;
+    page->started = 0;
+    page->done = 0;
+}
+
+// Deallocate memory associated with a listing page.
+void listingPage_delete(ListingPage* page) {
+    cacheEntry_release(page->names);
+    buffer_delete(&page->path);
+}
+
+// Render the next piece of a listing page, stopping once the buffer
+// holds at least size bytes. The page is done once its end has been
+// rendered.
+void listingPage_render(ListingPage* page, Buffer* buffer, int64_t size) {
+    // Skip the '.' at the start of the path.
+    int8_t* path = page->path.data + 1;
+    int64_t pathLength = page->path.length - 1;
+
+    if (!page->started) {
+        if (page->format == LISTING_JSON) {
+            buffer_appendFromString(buffer, "{\"path\":");
+            buffer_appendJsonString(buffer, path, pathLength);
+            buffer_appendFromString(buffer, ",\"total\":");
+            buffer_appendFromUint(buffer, page->names->nameCount);
+            buffer_appendFromString(buffer, ",\"offset\":");
+            buffer_appendFromUint(buffer, page->start);
+            buffer_appendFromString(buffer, ",\"entries\":[");
+        } else {
+            buffer_appendFromString(buffer, "<html><body><h1>Directory listing for: ");
+            buffer_appendFromArray(buffer, path, pathLength);
+            buffer_appendFromString(buffer, "</h1><ul>\n");
+        }
+
+        page->started = 1;
+    }
+
+    while (page->next < page->end && buffer->length < size) {
+        int8_t* name = listing_name(page->names, page->next);
+        int8_t isDirectory = page->next < page->names->directoryCount;
+
+        if (page->format == LISTING_JSON) {
+            if (page->next > page->start) {
+                buffer_appendFromChar(buffer, ',');
+            }
+
+            buffer_appendFromString(buffer, "{\"name\":");
+            buffer_appendJsonString(buffer, name, string_length((char *) name));
+            buffer_appendFromString(buffer, isDirectory ? ",\"type\":\"directory\"}" : ",\"type\":\"file\"}");
+        } else {
+            buffer_appendFromString(buffer, "<li><a href=\"");
+            buffer_appendFromArray(buffer, path, pathLength);
+            buffer_appendFromString(buffer, (char *) name);
+            buffer_appendFromString(buffer, isDirectory ? "/\">" : "\">");
+            buffer_appendFromString(buffer, (char *) name);
+            buffer_appendFromString(buffer, isDirectory ? "/</a></li>\n" : "</a></li>\n");
+        }
+
+        ++page->next;
+    }
+
+    if (page->next == page->end && buffer->length < size) {
+        buffer_appendFromString(buffer, page->format == LISTING_JSON ? "]}\n" : "</ul></body></html>\n");
+        page->done = 1;
+    }
+}
+
+//////////////////////////////////////////
+// CONNECTIONS
+//
+// A connection reads requests into its
+// request buffer, then writes the responses
+// prepared for them. Both steps can be
+// suspended and resumed when the socket
+// is non-blocking.
+//////////////////////////////////////////
+
+// Allocate a connection's buffers.
+void connection_init(Connection* connection) {
+    buffer_init(&connection->requestBuffer, 2048);
+    buffer_init(&connection->responseBuffer, 1024);
+    buffer_init(&connection->segments, 4 * sizeof(Segment));
+    connection->requestLength = 0;
+    connection->responseQueued = 0;
+    connection->segmentIndex = 0;
+    connection->socket = -1;
+    connection->pipe[0] = -1;
+    connection->pipe[1] = -1;
+    connection->piped = 0;
+    connection->chunkStream = 0;
+    requestParser_reset(&connection->parser);
+    connection->readStart = 0;
+    connection->writeStart = 0;
+    connection->pendingOperations = 0;
+    connection->closing = 0;
+    connection->prev = 0;
+    connection->next = 0;
+}
+
+// Free the state of the chunked segment being sent.
+void connection_endChunkStream(Connection* connection) {
+    ChunkStream* stream = connection->chunkStream;
+
+    if (!stream) {
+        return;
+    }
+
+    gzipEncoder_delete(&stream->encoder);
+    buffer_delete(&stream->piece);
+    buffer_delete(&stream->compressed);
+    buffer_delete(&stream->chunk);
+    free(stream);
+    connection->chunkStream = 0;
+}
+
+// Deallocate memory associated with a connection.
+void connection_delete(Connection* connection) {
+    buffer_delete(&connection->requestBuffer);
+    buffer_delete(&connection->responseBuffer);
+    buffer_delete(&connection->segments);
+
+    if (connection->pipe[0] != -1) {
+        close(connection->pipe[0]);
+        close(connection->pipe[1]);
+        connection->pipe[0] = -1;
+        connection->pipe[1] = -1;
+    }
+
+    connection_endChunkStream(connection);
+}
+
+// Number of response segments queued on the connection.
+int64_t connection_segmentCount(Connection* connection) {
+    return connection->segments.length / sizeof(Segment);
+}
+
+// Get a pointer to one of the connection's response segments.
+Segment* connection_segment(Connection* connection, int64_t index) {
+    return (Segment*) connection->segments.data + index;
+}
+
+// Check if a segment's bytes are in memory (in the response
+// buffer or a cache entry), so they can be gathered into one
+// write with its neighbours.
+int8_t segment_isInMemory(Segment* segment) {
+    return segment->file == -1 && !segment->chunked;
+}
+
+// Get a pointer to the next byte to send of a segment in memory.
+int8_t* connection_segmentData(Connection* connection, Segment* segment) {
+    Buffer* buffer = segment->entry ? &segment->entry->data : &connection->responseBuffer;
+    return buffer->data + segment->offset;
+}
+
+// Queue everything appended to the response buffer since the
+// last segment was queued. Consecutive ranges of the response
+// buffer are merged so they go out in a single write.
+void connection_queueResponseBuffer(Connection* connection) {
+    int64_t start = connection->responseQueued;
+    int64_t length = connection->responseBuffer.length - start;
+
+    if (length == 0) {
+        return;
+    }
+
+    int64_t count = connection_segmentCount(connection);
+    Segment* last = count > connection->segmentIndex ? connection_segment(connection, count - 1) : 0;
+
+    if (last && segment_isInMemory(last) && !last->entry && last->offset + last->length == start) {
+        last->length += length;
+    } else {
+        Segment segment = { start, length, -1, 0, 0, 0, 0, 0, 0 };
+        buffer_appendFromArray(&connection->segments, (int8_t *) &segment, sizeof(Segment));
+    }
+
+    connection->responseQueued = connection->responseBuffer.length;
+}
+
+// Queue a range of an open file to be sent after everything
+// appended to the response buffer so far. If closeFile is set,
+// the connection takes ownership of the file and closes it
+// once the range is sent.
+void connection_queueFile(Connection* connection, int32_t file, int64_t offset, int64_t length, int8_t closeFile) {
+    connection_queueResponseBuffer(connection);
+
+    Segment segment = { offset, length, file, 0, closeFile, 0, 0, 0, 0 };
+    buffer_appendFromArray(&connection->segments, (int8_t *) &segment, sizeof(Segment));
+}
+
+// Queue a range of a cache entry's data to be sent after everything
+// appended to the response buffer so far, without copying it. The
+// segment takes its own reference to the entry, so the bytes stay
+// valid even if the entry is evicted before they're sent.
+void connection_queueCacheEntry(Connection* connection, CacheEntry* entry, int64_t offset, int64_t length) {
+    connection_queueResponseBuffer(connection);
+    cacheEntry_retain(entry);
+
+    Segment segment = { offset, length, -1, 0, 0, 0, 0, 0, entry };
+    buffer_appendFromArray(&connection->segments, (int8_t *) &segment, sizeof(Segment));
+}
+
+// Queue an open file to be compressed with gzip and sent in chunks
+// after everything appended to the response buffer so far. The
+// connection takes ownership of the file and closes it once
+// it's sent.
+void connection_queueGzipFile(Connection* connection, int32_t file, int64_t length) {
+    connection_queueResponseBuffer(connection);
+
+    Segment segment = { 0, length, file, 0, 1, 1, 1, 0, 0 };
+    buffer_appendFromArray(&connection->segments, (int8_t *) &segment, sizeof(Segment));
+}
+
+// Queue a page of a directory listing to be rendered and sent in
+// chunks (compressed if gzip is set) after everything appended to
+// the response buffer so far. The connection takes ownership of
+// the page and deletes it once it's sent.
+void connection_queueListing(Connection* connection, ListingPage* page, int8_t gzip) {
+    connection_queueResponseBuffer(connection);
+
+    Segment segment = { 0, 0, -1, 0, 0, 1, gzip, page, 0 };
+    buffer_appendFromArray(&connection->segments, (int8_t *) &segment, sizeof(Segment));
+}
+
+// Release what a segment holds once it's sent or dropped.
+void segment_finish(Segment* segment) {
+    if (segment->closeFile) {
+        close(segment->file);
+        segment->closeFile = 0;
+    }
+
+    if (segment->listing) {
+        listingPage_delete(segment->listing);
+        free(segment->listing);
+        segment->listing = 0;
+    }
+
+    if (segment->entry) {
+        cacheEntry_release(segment->entry);
+        segment->entry = 0;
+    }
+}
+
+// Close files, free listings and release cache entries of any
+// segments that haven't been sent and empty the segment list and response buffer.
+void connection_clearResponses(Connection* connection) {
+    int64_t count = connection_segmentCount(connection);
+
+    for (int64_t i = connection->segmentIndex; i < count; ++i) {
+        segment_finish(connection_segment(connection, i));
+    }
+
+    // Bytes left in the pipe belong to a response that won't
+    // be finished, so the pipe can't be reused.
+    if (connection->piped > 0) {
+        close(connection->pipe[0]);
+        close(connection->pipe[1]);
+        connection->pipe[0] = -1;
+        connection->pipe[1] = -1;
+        connection->piped = 0;
+    }
+
+    connection_endChunkStream(connection);
+
+    connection->segments.length = 0;
+    connection->segmentIndex = 0;
+    connection->responseBuffer.length = 0;
+    connection->responseQueued = 0;
+}
+
+// Drop everything queued on the connection from the given segment
+// and response buffer offset on, when the response that starts
+// there can't be finished.
+void connection_dropResponse(Connection* connection, int64_t segmentCount, int64_t responseStart) {
+    int64_t count = connection_segmentCount(connection);
+
+    for (int64_t i = segmentCount; i < count; ++i) {
+        segment_finish(connection_segment(connection, i));
+    }
+
+    // The response's first bytes may have been merged
+    // into the segment before it.
+    if (segmentCount > connection->segmentIndex) {
+        Segment* last = connection_segment(connection, segmentCount - 1);
+
+        if (segment_isInMemory(last) && !last->entry && last->offset + last->length > responseStart) {
+            last->length = responseStart - last->offset;
+        }
+    }
+
+    connection->segments.length = segmentCount * sizeof(Segment);
+    connection->segments.failed = 0;
+    connection->responseBuffer.length = responseStart;
+    connection->responseBuffer.failed = 0;
+    connection->responseQueued = responseStart;
+}
+
+// Prepare a connection to read a request from
+// a newly accepted socket.
+void connection_open(Connection* connection, int32_t socket) {
+    connection->socket = socket;
+    connection->address = 0;
+
+    // Only the access log needs the client's address.
+    if (options.accessLog) {
+        struct sockaddr_in address;
+        socklen_t addressLength = sizeof(address);
+
+        if (getpeername(socket, (struct sockaddr*) &address, &addressLength) == 0 && address.sin_family == AF_INET) {
+            connection->address = address.sin_addr.s_addr;
+        }
+    }
+
+    connection->state = CONNECTION_READING;
+    connection->requestBuffer.length = 0;
+    connection->responseBuffer.length = 0;
+    connection->segments.length = 0;
+    connection->requestLength = 0;
+    requestParser_reset(&connection->parser);
+    connection->responseQueued = 0;
+    connection->segmentIndex = 0;
+    connection->requestCount = 0;
+    connection->keepAlive = 0;
+    connection->readStart = 0;
+    connection->pendingOperations = 0;
+    connection->sending = 0;
+    connection->receiveClosed = 0;
+    connection->closing = 0;
+}
+
+// Check if the connection is being kept alive waiting for
+// its next request.
+int8_t connection_isIdle(Connection* connection) {
+    return connection->state == CONNECTION_READING && connection->requestCount > 0 && connection->requestBuffer.length == 0;
+}
+
+// Number of seconds the connection can go without any
+// activity before it's closed.
+int64_t connection_timeout(Connection* connection) {
+    return connection_isIdle(connection) ? options.keepAliveTimeout : CONNECTION_TIMEOUT;
+}
+
+// Parse the request bytes received since the last call. If the
+// request's headers are complete, the request is malformed or it
+// has grown too big, set requestLength and return 1, else return 0.
+// A request that's malformed or too big is left with a requestLength
+// of 0 so it's rejected.
+int8_t connection_parseRequest(Connection* connection) {
+    Buffer* requestBuffer = &connection->requestBuffer;
+    int32_t state = requestParser_parse(&connection->parser, requestBuffer->data, requestBuffer->length);
+
+    if (state == PARSE_DONE) {
+        connection->requestLength = connection->parser.position;
+        return 1;
+    }
+
+    if (state == PARSE_ERROR || requestBuffer->length > REQUEST_MAX_SIZE) {
+        connection->requestLength = 0;
+        return 1;
+    }
+
+    return 0;
+}
+
+// Remove the request that was just handled from the request
+// buffer, keeping any bytes received after it as the start
+// of the next request.
+void connection_consumeRequest(Connection* connection) {
+    Buffer* requestBuffer = &connection->requestBuffer;
+    int64_t remaining = connection->requestLength > 0 ? requestBuffer->length - connection->requestLength : 0;
+
+    memmove(requestBuffer->data, requestBuffer->data + connection->requestLength, remaining);
+    requestBuffer->length = remaining;
+    connection->requestLength = 0;
+    requestParser_reset(&connection->parser);
+}
+
+// Close the connection's socket and any files
+// it was sending. Buffers that grew for a big
+// response give their memory back before the
+// connection is reused.
+void connection_close(Connection* connection) {
+    connection_clearResponses(connection);
+
+    buffer_reset(&connection->requestBuffer, BUFFER_RETAIN_SIZE);
+    buffer_reset(&connection->responseBuffer, BUFFER_RETAIN_SIZE);
+    buffer_reset(&connection->segments, BUFFER_RETAIN_SIZE);
+
+    if (connection->socket != -1) {
+        close(connection->socket);
+        connection->socket = -1;
+    }
+}
+
+// Read from the connection's socket until the next request's headers
+// have been received, parsing them as they arrive. Since we only accept
+// GET and HEAD requests, there's no body to read. Bytes after the headers
+// belong to pipelined requests and are left in the buffer. Returns IO_DONE once
+// a request is complete, IO_WOULD_BLOCK if the socket has no more data
+// for now and IO_ERROR if the connection should be dropped.
+int8_t receiveRequest(Thread* thread, Connection* connection) {
+    // The request may already have arrived with the previous one.
+    if (connection->requestBuffer.length > 0 && connection_parseRequest(connection)) {
+        return IO_DONE;
+    }
+
+    while (1) {
+        int64_t received = recv(connection->socket, thread->transferChunk, TRANSFER_CHUNK_SIZE, 0);
+
+        if (received == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return IO_WOULD_BLOCK;
+            }
+
+            if (errno == EINTR) {
+                continue;
+            }
+
+            perror("Failed to receive data");
+            return IO_ERROR;
+        }
+
+        // Client closed the connection.
+        if (received == 0) {
+            return IO_ERROR;
+        }
+
+        if (connection->requestBuffer.length == 0) {
+            connection->readStart = metrics_time();
+        }
+
+        buffer_appendFromArray(&connection->requestBuffer, thread->transferChunk, received);
+
+        if (connection->requestBuffer.failed) {
+            return IO_ERROR;
+        }
+
+        if (connection_parseRequest(connection)) {
+            return IO_DONE;
+        }
+    }
+}
+
+// Send a file segment through the connection's pipe: splice a chunk
+// of the file into the pipe, then from the pipe into the socket. A
+// chunk that only partly makes it to the socket stays in the pipe
+// until the socket is writable again.
+int8_t spliceSegment(Thread* thread, Connection* connection, Segment* segment) {
+    if (connection->pipe[0] == -1 && pipe2(connection->pipe, O_NONBLOCK) == -1) {
+        perror("Failed to create pipe");
+        return IO_ERROR;
+    }
+
+    while (segment->length > 0) {
+        if (connection->piped == 0) {
+            loff_t offset = segment->offset;
+            int64_t length = segment->length;
+
+            // A pipe holds at least 64KB, so a chunk always
+            // fits in the empty pipe.
+            if (length > TRANSFER_CHUNK_SIZE) {
+                length = TRANSFER_CHUNK_SIZE;
+            }
+
+            int64_t numRead = splice(segment->file, &offset, connection->pipe[1], 0, length, SPLICE_F_MOVE);
+
+            if (numRead <= 0) {
+                if (numRead == -1 && errno == EINTR) {
+                    continue;
+                }
+
+                perror("Failed to read file");
+                return IO_ERROR;
+            }
+
+            segment->offset = offset;
+            connection->piped = numRead;
+        }
+
+        // Like sendfile, hold back a partly filled packet while
+        // more of the file is still to come.
+        int32_t flags = segment->length > connection->piped ? SPLICE_F_MOVE | SPLICE_F_MORE : SPLICE_F_MOVE;
+        int64_t sent = splice(connection->pipe[0], 0, connection->socket, 0, connection->piped, flags);
+
+        if (sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return IO_WOULD_BLOCK;
+            }
+
+            if (errno == EINTR) {
+                continue;
+            }
+
+            perror("Failed to send response");
+            return IO_ERROR;
+        }
+
+        connection->piped -= sent;
+        segment->length -= sent;
+        metrics_add(&thread->metrics.bytesSent, sent);
+    }
+
+    return IO_DONE;
+}
+
+// Fill iovecs with the run of segments in memory starting at the
+// connection's current segment, up to SEND_MAX_IOVECS of them, so
+// headers and a body from the cache (or several pipelined responses)
+// go out in one write and, if small enough, one packet. Sets end to
+// the index after the last segment gathered and returns the flags
+// to send them with.
+int32_t connection_gatherSegments(Connection* connection, struct iovec* iovecs, int64_t* end) {
+    int64_t count = connection_segmentCount(connection);
+    int64_t index = connection->segmentIndex;
+
+    while (index < count && index - connection->segmentIndex < SEND_MAX_IOVECS && segment_isInMemory(connection_segment(connection, index))) {
+        Segment* segment = connection_segment(connection, index);
+        iovecs[index - connection->segmentIndex].iov_base = connection_segmentData(connection, segment);
+        iovecs[index - connection->segmentIndex].iov_len = segment->length;
+        ++index;
+    }
+
+    *end = index;
+
+    // When a file or chunked body comes next, tell the kernel so
+    // a partly filled packet waits for the start of the body
+    // instead of going out on its own. An empty file sends
+    // nothing that would push the packet out, so it doesn't count.
+    if (index < count) {
+        Segment* next = connection_segment(connection, index);
+
+        if (next->chunked || (next->file != -1 && next->length > 0)) {
+            return MSG_NOSIGNAL | MSG_MORE;
+        }
+    }
+
+    return MSG_NOSIGNAL;
+}
+
+// Move past sent bytes of the segments gathered up to end. Segments
+// that are fully sent are finished and a partly sent one resumes
+// from its first unsent byte.
+void connection_advanceSegments(Connection* connection, int64_t end, int64_t sent) {
+    while (connection->segmentIndex < end) {
+        Segment* segment = connection_segment(connection, connection->segmentIndex);
+        int64_t length = sent < segment->length ? sent : segment->length;
+
+        segment->offset += length;
+        segment->length -= length;
+        sent -= length;
+
+        if (segment->length > 0) {
+            break;
+        }
+
+        segment_finish(segment);
+        ++connection->segmentIndex;
+    }
+}
+
+// Send the run of segments in memory starting at the connection's
+// current segment, gathering them into as few sendmsg calls as
+// possible. Returns IO_DONE once the next segment isn't in memory.
+int8_t sendMemorySegments(Thread* thread, Connection* connection) {
+    while (1) {
+        struct iovec iovecs[SEND_MAX_IOVECS];
+        int64_t end;
+        int32_t flags = connection_gatherSegments(connection, iovecs, &end);
+
+        if (end == connection->segmentIndex) {
+            break;
+        }
+
+        struct msghdr message = {0};
+        message.msg_iov = iovecs;
+        message.msg_iovlen = end - connection->segmentIndex;
+
+        int64_t sent = sendmsg(connection->socket, &message, flags);
+
+        if (sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return IO_WOULD_BLOCK;
+            }
+
+            if (errno == EINTR) {
+                continue;
+            }
+
+            perror("Failed to send response");
+            return IO_ERROR;
+        }
+
+        connection_advanceSegments(connection, end, sent);
+        metrics_add(&thread->metrics.bytesSent, sent);
+    }
+
+    return IO_DONE;
+}
+
+// Send a file segment of the response, starting from wherever the
+// last call left off. Files are sent with sendfile, which advances
+// the segment's offset past whatever the socket accepted, so a
+// partial send simply resumes from the first unsent byte.
+int8_t sendSegment(Thread* thread, Connection* connection, Segment* segment) {
+    if (segment->splice) {
+        return spliceSegment(thread, connection, segment);
+    }
+
+    while (segment->length > 0) {
+        off_t offset = segment->offset;
+        int64_t sent = sendfile(connection->socket, segment->file, &offset, segment->length);
+
+        // The file doesn't support sendfile.
+        if (sent == -1 && (errno == EINVAL || errno == ENOSYS)) {
+            segment->splice = 1;
+            return spliceSegment(thread, connection, segment);
+        }
+
+        // File was truncated after its length was sent.
+        if (sent == 0) {
+            fprintf(stderr, "Failed to read file: unexpected end of file\n");
+            return IO_ERROR;
+        }
+
+        if (sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return IO_WOULD_BLOCK;
+            }
+
+            if (errno == EINTR) {
+                continue;
+            }
+
+            perror("Failed to send response");
+            return IO_ERROR;
+        }
+
+        segment->offset += sent;
+        segment->length -= sent;
+        metrics_add(&thread->metrics.bytesSent, sent);
+    }
+
+    return IO_DONE;
+}
+
+// Send a chunked segment: a file compressed with gzip or a page of a
+// directory listing, possibly compressed. The body is read or rendered
+// a piece at a time, and whatever output is ready is sent as a chunk
+// of the chunked transfer coding, followed by the last chunk once the
+// body is done. A chunk that only partly makes it to the socket is
+// finished the next time.
+int8_t sendChunkedSegment(Thread* thread, Connection* connection, Segment* segment) {
+    ChunkStream* stream = connection->chunkStream;
+
+    if (!stream) {
+        // Zeroed so an unused encoder can be deleted.
+        stream = calloc(1, sizeof(ChunkStream));
+
+        if (!stream || (segment->gzip && gzipEncoder_init(&stream->encoder) == -1)) {
+            fprintf(stderr, "Failed to allocate chunk stream\n");
+            free(stream);
+            return IO_ERROR;
+        }
+
+        buffer_init(&stream->piece, TRANSFER_CHUNK_SIZE);
+        buffer_init(&stream->compressed, TRANSFER_CHUNK_SIZE);
+        buffer_init(&stream->chunk, TRANSFER_CHUNK_SIZE);
+        connection->chunkStream = stream;
+
+        if (segment->gzip) {
+            gzipEncoder_start(&stream->encoder, &stream->compressed);
+        }
+    }
+
+    while (1) {
+        if (stream->chunkSent < stream->chunk.length) {
+            int64_t sent = send(connection->socket, stream->chunk.data + stream->chunkSent, stream->chunk.length - stream->chunkSent, MSG_NOSIGNAL);
+
+            if (sent == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return IO_WOULD_BLOCK;
+                }
+
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                perror("Failed to send response");
+                return IO_ERROR;
+            }
+
+            stream->chunkSent += sent;
+            metrics_add(&thread->metrics.bytesSent, sent);
+            continue;
+        }
+
+        if (stream->finished) {
+            break;
+        }
+
+        // Get the next piece of the body.
+        int8_t* piece = thread->transferChunk;
+        int64_t pieceLength = 0;
+
+        if (segment->listing) {
+            stream->piece.length = 0;
+            listingPage_render(segment->listing, &stream->piece, TRANSFER_CHUNK_SIZE);
+            piece = stream->piece.data;
+            pieceLength = stream->piece.length;
+            stream->finished = segment->listing->done;
+        } else {
+            if (segment->length > 0) {
+                pieceLength = pread(segment->file, thread->transferChunk, segment->length < TRANSFER_CHUNK_SIZE ? segment->length : TRANSFER_CHUNK_SIZE, segment->offset);
+
+                if (pieceLength == -1 && errno == EINTR) {
+                    continue;
+                }
+
+                if (pieceLength <= 0) {
+                    fprintf(stderr, "Failed to read file: %s\n", pieceLength == 0 ? "unexpected end of file" : strerror(errno));
+                    return IO_ERROR;
+                }
+
+                segment->offset += pieceLength;
+                segment->length -= pieceLength;
+            }
+
+            stream->finished = segment->length == 0;
+        }
+
+        if (segment->gzip) {
+            gzipEncoder_write(&stream->encoder, piece, pieceLength, stream->finished, &stream->compressed);
+            piece = stream->compressed.data;
+            pieceLength = stream->compressed.length;
+        }
+
+        // A zero-length chunk would end the body early, so
+        // wait until there's some output.
+        stream->chunk.length = 0;
+        stream->chunkSent = 0;
+
+        if (pieceLength > 0) {
+            buffer_appendFromHex(&stream->chunk, pieceLength);
+            buffer_appendFromString(&stream->chunk, HTTP_NEWLINE);
+            buffer_appendFromArray(&stream->chunk, piece, pieceLength);
+            buffer_appendFromString(&stream->chunk, HTTP_NEWLINE);
+            stream->compressed.length = 0;
+        }
+
+        if (stream->finished) {
+            buffer_appendFromString(&stream->chunk, HTTP_LAST_CHUNK);
+        }
+    }
+
+    connection_endChunkStream(connection);
+
+    return IO_DONE;
+}
+
+// Write the queued responses to the connection's socket. Runs of
+// segments in memory are gathered into single writes, files and
+// chunked bodies are sent one segment at a time. Returns IO_DONE
+// once everything has been sent.
+int8_t sendResponse(Thread* thread, Connection* connection) {
+    int64_t count = connection_segmentCount(connection);
+
+    while (connection->segmentIndex < count) {
+        Segment* segment = connection_segment(connection, connection->segmentIndex);
+
+        if (segment_isInMemory(segment)) {
+            int8_t status = sendMemorySegments(thread, connection);
+
+            if (status != IO_DONE) {
+                return status;
+            }
+
+            continue;
+        }
+
+        int8_t status = segment->chunked ? sendChunkedSegment(thread, connection, segment) : sendSegment(thread, connection, segment);
+
+        if (status != IO_DONE) {
+            return status;
+        }
+
+        segment_finish(segment);
+
+        ++connection->segmentIndex;
+    }
+
+    histogram_record(&thread->metrics.phases[METRICS_PHASE_WRITE], connection->writeStart);
+    connection_clearResponses(connection);
+
+    return IO_DONE;
+}
+
+//////////////////////////////////////////
+// ACCESS LOG
+//
+// Worker threads never write the access
+// log themselves. Each fills in records
+// in its own ring, which the logger
+// thread empties, formats and writes in
+// batches. A record is dropped, and
+// counted, if the ring is full.
+//////////////////////////////////////////
+
+// Allocate a ring's records. Returns -1 if there
+// isn't enough memory.
+int8_t logRing_init(LogRing* ring) {
+    ring->records = malloc(LOG_RING_SIZE * sizeof(LogRecord));
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+
+    return ring->records ? 0 : -1;
+}
+
+// Deallocate a ring's records.
+void logRing_delete(LogRing* ring) {
+    free(ring->records);
+    ring->records = 0;
+}
+
+// Get the record for the producer to fill in next, or 0 if
+// the ring is full. The record isn't passed on to the
+// logger thread until logRing_commit is called.
+LogRecord* logRing_next(LogRing* ring) {
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    if (tail - atomic_load_explicit(&ring->head, memory_order_acquire) == LOG_RING_SIZE) {
+        return 0;
+    }
+
+    return &ring->records[tail % LOG_RING_SIZE];
+}
+
+// Pass the record from logRing_next on to the logger thread.
+void logRing_commit(LogRing* ring) {
+    atomic_store_explicit(&ring->tail, atomic_load_explicit(&ring->tail, memory_order_relaxed) + 1, memory_order_release);
+}
+
+// Copy up to max bytes of a span of the request buffer into
+// a record's text at offset. Returns the number of bytes copied.
+uint16_t logRecord_copyText(LogRecord* record, int64_t offset, const int8_t* data, int64_t length, int64_t max) {
+    if (length > max) {
+        length = max;
+    }
+
+    memcpy(record->text + offset, data, length);
+
+    return length;
+}
+
+// Get the number of body bytes of the response just prepared,
+// or -1 if it has a chunked body since its length isn't known
+// until it's sent. Response buffer bytes are counted from the
+// buffer itself, since they may have been merged into an
+// earlier segment.
+int64_t connection_bodyLength(Connection* connection) {
+    int64_t bytes = connection->responseBuffer.length - connection->bodyStart;
+    int64_t count = connection_segmentCount(connection);
+
+    for (int64_t i = connection->bodySegment; i < count; ++i) {
+        Segment* segment = connection_segment(connection, i);
+
+        if (segment->chunked) {
+            return -1;
+        }
+
+        if (segment->file != -1 || segment->entry) {
+            bytes += segment->length;
+        }
+    }
+
+    return bytes;
+}
+
+// Add a record of the request the connection just prepared a
+// response for to the thread's ring. Must be called before the
+// request is consumed, since the request line and headers are
+// copied out of the request buffer.
+void logRequest(Thread* thread, Connection* connection, int32_t status, int64_t bytes) {
+    LogRecord* record = logRing_next(&thread->log);
+
+    if (!record) {
+        metrics_add(&thread->metrics.logDropped, 1);
+        return;
+    }
+
+    RequestParser* parser = &connection->parser;
+    int8_t* data = connection->requestBuffer.data;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+
+    record->time = now.tv_sec;
+    record->bytes = bytes;
+    record->address = connection->address;
+    record->status = status;
+    record->requestLineLength = 0;
+    record->refererLength = 0;
+    record->userAgentLength = 0;
+
+    // A request that couldn't be parsed has no request line.
+    if (connection->requestLength > 0) {
+        int64_t end = parser->version.offset + parser->version.length;
+        record->requestLineLength = logRecord_copyText(record, 0, data, end, LOG_REQUEST_LINE_MAX);
+
+        int64_t offset = record->requestLineLength;
+        int32_t referer = parser->last[HEADER_REFERER];
+        int32_t userAgent = parser->last[HEADER_USER_AGENT];
+
+        if (referer != -1) {
+            Span value = parser->headers[referer].value;
+            record->refererLength = logRecord_copyText(record, offset, data + value.offset, value.length, LOG_REFERER_MAX);
+            offset += record->refererLength;
+        }
+
+        if (userAgent != -1) {
+            Span value = parser->headers[userAgent].value;
+            record->userAgentLength = logRecord_copyText(record, offset, data + value.offset, value.length, LOG_RECORD_TEXT_SIZE - offset);
+        }
+    }
+
+    logRing_commit(&thread->log);
+}
+
+// Append bytes from a request to a text log line, or "-" if
+// there are none. Since they came from the client, quotes,
+// backslashes and anything that isn't printable ASCII are
+// escaped as \xHH, so a line can't be broken up or forged.
+void buffer_appendLogString(Buffer* buffer, const int8_t* array, int64_t length) {
+    if (length == 0) {
+        buffer_appendFromChar(buffer, '-');
+        return;
+    }
+
+    for (int64_t i = 0; i < length; ++i) {
+        uint8_t c = array[i];
+
+        if (c < 0x20 || c > 0x7e || c == '"' || c == '\\') {
+            buffer_appendFromString(buffer, "\\x");
+            buffer_appendFromChar(buffer, "0123456789abcdef"[c >> 4]);
+            buffer_appendFromChar(buffer, "0123456789abcdef"[c & 0xf]);
+        } else {
+            buffer_appendFromChar(buffer, c);
+        }
+    }
+}
+
+// Append a record's time the way Common Log Format does,
+// e.g. [10/Oct/2000:13:55:36 +0000].
+void buffer_appendLogTime(Buffer* buffer, time_t t) {
+    struct tm date;
+    gmtime_r(&t, &date);
+
+    int8_t array[28];
+    array[0] = '[';
+    array_writeDigits(array + 1, date.tm_mday, 2);
+    array[3] = '/';
+    memcpy(array + 4, MONTH_STRINGS[date.tm_mon], 3);
+    array[7] = '/';
+    array_writeDigits(array + 8, date.tm_year + 1900, 4);
+    array[12] = ':';
+    array_writeDigits(array + 13, date.tm_hour, 2);
+    array[15] = ':';
+    array_writeDigits(array + 16, date.tm_min, 2);
+    array[18] = ':';
+    array_writeDigits(array + 19, date.tm_sec, 2);
+    memcpy(array + 21, " +0000]", 7);
+
+    buffer_appendFromArray(buffer, array, 28);
+}
+
+// Append a record to the access log's output in the format
+// picked with --log-format.
+void buffer_appendLogRecord(Buffer* buffer, LogRecord* record) {
+    int64_t textLength = record->requestLineLength + record->refererLength + record->userAgentLength;
+
+    // Binary records are the fixed-size fields followed by the text.
+    if (options.logFormat == LOG_FORMAT_BINARY) {
+        buffer_appendFromArray(buffer, (int8_t *) record, offsetof(LogRecord, text));
+        buffer_appendFromArray(buffer, record->text, textLength);
+        return;
+    }
+
+    int8_t* referer = record->text + record->requestLineLength;
+    int8_t* userAgent = referer + record->refererLength;
+    char host[INET_ADDRSTRLEN] = "-";
+
+    if (record->address) {
+        inet_ntop(AF_INET, &record->address, host, sizeof(host));
+    }
+
+    buffer_appendFromString(buffer, host);
+    buffer_appendFromString(buffer, " - - ");
+    buffer_appendLogTime(buffer, record->time);
+    buffer_appendFromString(buffer, " \"");
+    buffer_appendLogString(buffer, record->text, record->requestLineLength);
+    buffer_appendFromString(buffer, "\" ");
+    buffer_appendFromUint(buffer, record->status);
+    buffer_appendFromChar(buffer, ' ');
+
+    // Like other servers, a response without a body logs "-".
+    if (record->bytes > 0) {
+        buffer_appendFromUint(buffer, record->bytes);
+    } else {
+        buffer_appendFromChar(buffer, '-');
+    }
+
+    if (options.logFormat == LOG_FORMAT_COMBINED) {
+        buffer_appendFromString(buffer, " \"");
+        buffer_appendLogString(buffer, referer, record->refererLength);
+        buffer_appendFromString(buffer, "\" \"");
+        buffer_appendLogString(buffer, userAgent, record->userAgentLength);
+        buffer_appendFromChar(buffer, '"');
+    }
+
+    buffer_appendFromChar(buffer, '\n');
+}
+
+// Write out everything formatted so far. If the log can't
+// be written to, the lines are dropped.
+void accessLog_flush(AccessLog* log) {
+    int64_t written = 0;
+
+    while (written < log->output.length) {
+        int64_t result = write(log->file, log->output.data + written, log->output.length - written);
+
+        if (result == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            perror("Failed to write access log");
+            break;
+        }
+
+        written += result;
+    }
+
+    log->output.length = 0;
+}
+
+// Format and write the records waiting in every thread's ring.
+// Returns the number of records written.
+int64_t accessLog_drain(AccessLog* log) {
+    int64_t drained = 0;
+
+    for (int64_t i = 0; i < numThreads; ++i) {
+        LogRing* ring = &threads[i].log;
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+        for (; head != tail; ++head) {
+            buffer_appendLogRecord(&log->output, &ring->records[head % LOG_RING_SIZE]);
+
+            if (log->output.length >= LOG_OUTPUT_SIZE) {
+                accessLog_flush(log);
+            }
+        }
+
+        drained += tail - atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+        // Records are copied out, so the slots can be reused.
+        atomic_store_explicit(&ring->head, tail, memory_order_release);
+    }
+
+    if (log->output.length > 0) {
+        accessLog_flush(log);
+    }
+
+    return drained;
+}
+
+//////////////////////////////////////////
+// RESPONSES
+//
+// Parse the received request and prepare
+// the response to send on the connection.
+//////////////////////////////////////////
+
+// Append a strong entity tag for a file made from its inode,
+// size and modification time, so it changes whenever the file
+// is replaced or written to. Encoded responses get the coding
+// added, since a file compressed on the fly is a different
+// representation of the same file.
+void buffer_appendETag(Buffer* buffer, struct stat* fileInfo, int32_t encoding) {
+    buffer_appendFromChar(buffer, '"');
+    buffer_appendFromHex(buffer, fileInfo->st_ino);
+    buffer_appendFromChar(buffer, '-');
+    buffer_appendFromHex(buffer, fileInfo->st_size);
+    buffer_appendFromChar(buffer, '-');
+    buffer_appendFromHex(buffer, (uint64_t) fileInfo->st_mtim.tv_sec * 1000000000 + fileInfo->st_mtim.tv_nsec);
+
+    if (encoding != CONTENT_ENCODING_IDENTITY) {
+        buffer_appendFromChar(buffer, '-');
+        buffer_appendFromString(buffer, CONTENT_ENCODING_STRINGS[encoding]);
+    }
+
+    buffer_appendFromChar(buffer, '"');
+}
+
+// Append the ETag and Last-Modified headers for a file.
+void appendValidatorHeaders(Buffer* buffer, struct stat* fileInfo, int32_t encoding) {
+    buffer_appendFromString(buffer, HTTP_ETAG_KEY);
+    buffer_appendETag(buffer, fileInfo, encoding);
+    buffer_appendFromString(buffer, HTTP_NEWLINE HTTP_LAST_MODIFIED_KEY);
+
+    int64_t start = buffer->length;
+
+    if (!buffer->failed && buffer_checkAllocation(buffer, start + HTTP_DATE_LENGTH) == 0) {
+        array_formatDate(buffer->data + start, fileInfo->st_mtime);
+        buffer->length += HTTP_DATE_LENGTH;
+    }
+
+    buffer_appendFromString(buffer, HTTP_NEWLINE);
+}
+
+// Check if an If-None-Match header value matches the
+// entity tag, using the weak comparison (RFC 7232, 3.2).
+int8_t array_matchesETag(int8_t* array, int64_t length, Buffer* etag) {
+    while (length > 0) {
+        if (*array == ' ' || *array == '\t' || *array == ',') {
+            ++array;
+            --length;
+            continue;
+        }
+
+        if (*array == '*') {
+            return 1;
+        }
+
+        if (length > 1 && array[0] == 'W' && array[1] == '/') {
+            array += 2;
+            length -= 2;
+        }
+
+        if (length == 0 || *array != '"') {
+            return 0;
+        }
+
+        // Entity tags can contain commas, so find the closing quote.
+        int64_t tagLength = 1;
+        while (tagLength < length && array[tagLength] != '"') {
+            ++tagLength;
+        }
+
+        if (tagLength == length) {
+            return 0;
+        }
+
+        ++tagLength;
+
+        if (tagLength == etag->length && memcmp(array, etag->data, tagLength) == 0) {
+            return 1;
+        }
+
+        array += tagLength;
+        length -= tagLength;
+    }
+
+    return 0;
+}
+
+// Check the request's If-None-Match and If-Modified-Since headers
+// against the file (RFC 7232, 6). If-Modified-Since is only
+// looked at when there's no If-None-Match. Return 1 if the client's
+// copy is current and a 304 should be sent, else 0.
+int8_t isNotModified(Thread* thread, struct stat* fileInfo, int32_t encoding) {
+    Request* request = &thread->request;
+    int32_t index = request->parser->first[HEADER_IF_NONE_MATCH];
+
+    // Repeated headers combine into one list (RFC 7230, 3.2.2).
+    if (index != -1) {
+        thread->etagBuffer.length = 0;
+        buffer_appendETag(&thread->etagBuffer, fileInfo, encoding);
+
+        for (; index != -1; index = request->parser->headers[index].next) {
+            Slice value = request_header(request, index);
+
+            if (array_matchesETag(value.data, value.length, &thread->etagBuffer)) {
+                return 1;
+            }
+        }
+
+        return 0;
+    }
+
+    if (request->ifModifiedSince.length > 0) {
+        time_t since;
+
+        if (parseHttpDateFromArray(request->ifModifiedSince.data, request->ifModifiedSince.length, &since) == -1) {
+            return 0;
+        }
+
+        return fileInfo->st_mtime <= since;
+    }
+
+    return 0;
+}
+
+// Check if files of a content type are worth compressing,
+// i.e. text formats.
+int8_t isContentTypeCompressible(int32_t contentType) {
+    return mimeTable_type(&mimeTypes, contentType)->compressible;
+}
+
+// Append the Content-Encoding header for an encoded file, and
+// let caches know that compressible types depend on the
+// Accept-Encoding header.
+void appendEncodingHeaders(Buffer* buffer, int32_t contentType, int32_t encoding) {
+    if (encoding != CONTENT_ENCODING_IDENTITY) {
+        buffer_appendFromString(buffer, HTTP_CONTENT_ENCODING_KEY);
+        buffer_appendFromString(buffer, CONTENT_ENCODING_STRINGS[encoding]);
+        buffer_appendFromString(buffer, HTTP_NEWLINE);
+    }
+
+    if (isContentTypeCompressible(contentType)) {
+        buffer_appendFromString(buffer, HTTP_VARY_ENCODING_HEADER);
+    }
+}
+
+// Look for a precompressed copy of the file whose name is in the
+// request path (e.g. "app.js.br" next to "app.js") in a coding the
+// client accepts, preferring brotli to gzip. If found, the path and
+// fileInfo are switched to it and its coding is returned, else
+// CONTENT_ENCODING_IDENTITY.
+int32_t findEncodedFile(Thread* thread, struct stat* fileInfo) {
+    Buffer* path = &thread->request.path;
+    int64_t pathLength = path->length;
+    int32_t encodings[] = { CONTENT_ENCODING_BR, CONTENT_ENCODING_GZIP };
+
+    for (int32_t i = 0; i < 2; ++i) {
+        if (!(thread->request.acceptEncodings & (1 << encodings[i]))) {
+            continue;
+        }
+
+        struct stat encodedInfo;
+        buffer_appendFromString(path, CONTENT_ENCODING_EXTENSIONS[encodings[i]]);
+
+        if (statFileFromBuffer(path, &encodedInfo) == 0 && (encodedInfo.st_mode & S_IFMT) == S_IFREG) {
+            *fileInfo = encodedInfo;
+            return encodings[i];
+        }
+
+        path->length = pathLength;
+    }
+
+    return CONTENT_ENCODING_IDENTITY;
+}
+
+// Check if a response should be compressed on the fly: the server
+// is in gzip mode, the client accepts gzip and the body is text
+// big enough to be worth it.
+int8_t shouldCompress(Thread* thread, int32_t contentType, int64_t size) {
+    return options.gzip && (thread->request.acceptEncodings & (1 << CONTENT_ENCODING_GZIP)) && isContentTypeCompressible(contentType) && size >= GZIP_MIN_SIZE;
+}
+
+// Compress the first size bytes of an open file into the buffer
+// with the thread's encoder. Returns -1 if the file couldn't be read.
+int8_t gzipFile(Thread* thread, int32_t fd, int64_t size, Buffer* output) {
+    int64_t offset = 0;
+
+    gzipEncoder_start(&thread->gzipEncoder, output);
+
+    while (offset < size) {
+        int64_t length = size - offset < TRANSFER_CHUNK_SIZE ? size - offset : TRANSFER_CHUNK_SIZE;
+        int64_t numRead = pread(fd, thread->transferChunk, length, offset);
+
+        if (numRead <= 0) {
+            if (numRead == -1 && errno == EINTR) {
+                continue;
+            }
+
+            return -1;
+        }
+
+        offset += numRead;
+        gzipEncoder_write(&thread->gzipEncoder, thread->transferChunk, numRead, offset == size, output);
+    }
+
+    return 0;
+}
+
+// Append a 304 response for a file.
+void appendNotModifiedResponse(Connection* connection, struct stat* fileInfo, int32_t contentType, int32_t encoding) {
+    buffer_appendFromString(&connection->responseBuffer, HTTP_NOT_MODIFIED_HEADER HTTP_REVALIDATE_HEADERS);
+    appendValidatorHeaders(&connection->responseBuffer, fileInfo, encoding);
+    appendEncodingHeaders(&connection->responseBuffer, contentType, encoding);
+    appendResponseHeadersEnd(connection);
+}
+
+// Check whether the validator in an If-Range header still matches
+// the file (RFC 7233, 3.2). Entity tags must match exactly (strong
+// comparison) and dates must equal the file's Last-Modified date.
+// With no file, there's nothing to validate against.
+int8_t ifRangeMatches(Thread* thread, Slice* ifRange, struct stat* fileInfo) {
+    if (!fileInfo) {
+        return 0;
+    }
+
+    if (ifRange->length > 0 && ifRange->data[0] == '"') {
+        thread->etagBuffer.length = 0;
+        buffer_appendETag(&thread->etagBuffer, fileInfo, CONTENT_ENCODING_IDENTITY);
+
+        return ifRange->length == thread->etagBuffer.length && memcmp(ifRange->data, thread->etagBuffer.data, ifRange->length) == 0;
+    }
+
+    if (ifRange->length != HTTP_DATE_LENGTH) {
+        return 0;
+    }
+
+    int8_t lastModified[HTTP_DATE_LENGTH];
+    array_formatDate(lastModified, fileInfo->st_mtime);
+
+    return memcmp(ifRange->data, lastModified, HTTP_DATE_LENGTH) == 0;
+}
+
+// Append a "Content-Range" header value for a range of a
+// body of the given size.
+void appendContentRange(Buffer* buffer, ByteRange* range, int64_t size) {
+    buffer_appendFromString(buffer, HTTP_RANGE_UNIT " ");
+    buffer_appendFromUint(buffer, range->offset);
+    buffer_appendFromChar(buffer, '-');
+    buffer_appendFromUint(buffer, range->offset + range->length - 1);
+    buffer_appendFromChar(buffer, '/');
+    buffer_appendFromUint(buffer, size);
+}
+
+// Append the headers that introduce one part of a
+// multipart/byteranges body (RFC 7233, appendix A).
+void appendRangePartHeaders(Buffer* buffer, int32_t contentType, ByteRange* range, int64_t size) {
+    buffer_appendFromString(buffer, HTTP_NEWLINE "--" RANGE_BOUNDARY HTTP_NEWLINE HTTP_CONTENT_TYPE_KEY);
+    Buffer* name = &mimeTable_type(&mimeTypes, contentType)->name;
+    buffer_appendFromArray(buffer, name->data, name->length);
+    buffer_appendFromString(buffer, HTTP_NEWLINE HTTP_CONTENT_RANGE_KEY);
+    appendContentRange(buffer, range, size);
+    buffer_appendFromString(buffer, HTTP_NEWLINE HTTP_NEWLINE);
+}
+
+// Append the bytes of a range of a body, either copied from
+// memory or queued to be sent from an open file.
+void appendRangeBody(Connection* connection, ByteRange* range, const int8_t* data, int32_t fd, int8_t closeFile) {
+    if (fd == -1) {
+        buffer_appendFromArray(&connection->responseBuffer, data + range->offset, range->length);
+    } else {
+        connection_queueFile(connection, fd, range->offset, range->length, closeFile);
+    }
+}
+
+// If a GET request asks for part of a body (RFC 7233), append
+// a 206 response with the requested ranges, or a 416 response if
+// none of them are in the body, and return 1. Otherwise return 0 and
+// leave it to the caller to send the whole body. The body is either
+// in memory (data) or in an open file (fd), which is taken over
+// when 1 is returned. fileInfo is used to check If-Range, and
+// is 0 for bodies that aren't files. encodable is set if the
+// whole body could be sent encoded, so the partial response
+// has the same Vary header as the whole one.
+int8_t appendPartialResponse(Thread* thread, Connection* connection, int32_t contentType, struct stat* fileInfo, int8_t encodable, int64_t size, const int8_t* data, int32_t fd) {
+    Request* request = &thread->request;
+    Buffer* responseBuffer = &connection->responseBuffer;
+    ByteRange ranges[RANGE_MAX_COUNT];
+
+    if (request->range.length == 0) {
+        return 0;
+    }
+
+    if (request->ifRange.length > 0 && !ifRangeMatches(thread, &request->ifRange, fileInfo)) {
+        return 0;
+    }
+
+    int32_t count = parseRangesFromSlice(&request->range, size, ranges);
+
+    if (count == 0) {
+        return 0;
+    }
+
+    if (count == -1) {
+        buffer_appendFromString(responseBuffer, RANGE_NOT_SATISFIABLE_HEADERS HTTP_CONTENT_RANGE_KEY HTTP_RANGE_UNIT " */");
+        buffer_appendFromUint(responseBuffer, size);
+        buffer_appendFromString(responseBuffer, HTTP_NEWLINE);
+        appendResponseHeadersEnd(connection);
+        buffer_appendFromString(responseBuffer, RANGE_NOT_SATISFIABLE_BODY);
+
+        if (fd != -1) {
+            close(fd);
+        }
+
+        return 1;
+    }
+
+    buffer_appendFromString(responseBuffer, HTTP_PARTIAL_CONTENT_HEADER);
+
+    if (options.caching) {
+        buffer_appendFromString(responseBuffer, HTTP_REVALIDATE_HEADERS);
+
+        if (fileInfo) {
+            appendValidatorHeaders(responseBuffer, fileInfo, CONTENT_ENCODING_IDENTITY);
+        }
+    } else {
+        buffer_appendFromString(responseBuffer, HTTP_CACHE_HEADERS);
+    }
+
+    if (encodable) {
+        appendEncodingHeaders(responseBuffer, contentType, CONTENT_ENCODING_IDENTITY);
+    }
+
+    buffer_appendFromString(responseBuffer, HTTP_ACCEPT_RANGES_HEADER HTTP_CONTENT_TYPE_KEY);
+
+    if (count == 1) {
+        Buffer* name = &mimeTable_type(&mimeTypes, contentType)->name;
+        buffer_appendFromArray(responseBuffer, name->data, name->length);
+        buffer_appendFromString(responseBuffer, HTTP_NEWLINE HTTP_CONTENT_RANGE_KEY);
+        appendContentRange(responseBuffer, &ranges[0], size);
+        buffer_appendFromString(responseBuffer, HTTP_NEWLINE HTTP_CONTENT_LENGTH_KEY);
+        buffer_appendFromUint(responseBuffer, ranges[0].length);
+        buffer_appendFromString(responseBuffer, HTTP_NEWLINE);
+        appendResponseHeadersEnd(connection);
+        appendRangeBody(connection, &ranges[0], data, fd, 1);
+
+        return 1;
+    }
+
+    // The part headers are built ahead of the response headers
+    // to get the length of the body.
+    Buffer* partHeaders = &thread->rangeHeadersBuffer;
+    int64_t partHeaderEnds[RANGE_MAX_COUNT];
+    int64_t contentLength = string_length(RANGE_MULTIPART_END);
+    partHeaders->length = 0;
+
+    for (int32_t i = 0; i < count; ++i) {
+        appendRangePartHeaders(partHeaders, contentType, &ranges[i], size);
+        partHeaderEnds[i] = partHeaders->length;
+        contentLength += ranges[i].length;
+    }
+
+    contentLength += partHeaders->length;
+
+    buffer_appendFromString(responseBuffer, RANGE_MULTIPART_TYPE HTTP_NEWLINE HTTP_CONTENT_LENGTH_KEY);
+    buffer_appendFromUint(responseBuffer, contentLength);
+    buffer_appendFromString(responseBuffer, HTTP_NEWLINE);
+    appendResponseHeadersEnd(connection);
+
+    // All parts of a file share its descriptor, so only
+    // the last one closes it.
+    for (int32_t i = 0; i < count; ++i) {
+        int64_t start = i > 0 ? partHeaderEnds[i - 1] : 0;
+        buffer_appendFromArray(responseBuffer, partHeaders->data + start, partHeaderEnds[i] - start);
+        appendRangeBody(connection, &ranges[i], data, fd, i == count - 1);
+    }
+
+    buffer_appendFromString(responseBuffer, RANGE_MULTIPART_END);
+
+    return 1;
+}
+
+// Read an open file into a new entry in the file cache under
+// the given key, compressing it first if asked to. Returns a
+// reference to the entry, or 0 if the file couldn't be read.
+CacheEntry* cacheFile(Thread* thread, Buffer* key, Buffer* filename, int32_t fd, int32_t contentType, int32_t encoding, int8_t compress) {
+    CacheEntry* entry = cacheEntry_create(key->data, key->length);
+
+    if (!entry) {
+        return 0;
+    }
+
+    // Stat the open file so the entry describes exactly
+    // what was read.
+    if (fstat(fd, &entry->fileInfo) == -1) {
+        cacheEntry_release(entry);
+        return 0;
+    }
+
+    buffer_appendFromArray(&entry->filename, filename->data, filename->length);
+
+    // The compressed size has to be known before the headers
+    // are written.
+    Buffer* compressed = &thread->gzipBuffer;
+    compressed->length = 0;
+
+    if (compress && gzipFile(thread, fd, entry->fileInfo.st_size, compressed) == -1) {
+        cacheEntry_release(entry);
+        return 0;
+    }
+
+    appendOkHeaders(&entry->data, contentType, compress ? compressed->length : entry->fileInfo.st_size);
+
+    if (options.caching) {
+        appendValidatorHeaders(&entry->data, &entry->fileInfo, encoding);
+    }
+
+    appendEncodingHeaders(&entry->data, contentType, encoding);
+
+    entry->headerLength = entry->data.length;
+    entry->contentType = contentType;
+    entry->encoding = encoding;
+
+    if (compress) {
+        buffer_appendFromArray(&entry->data, compressed->data, compressed->length);
+
+        if (entry->data.failed) {
+            cacheEntry_release(entry);
+            return 0;
+        }
+
+        cache_insert(&fileCache, &thread->metrics, entry);
+
+        return entry;
+    }
+
+    int64_t size = entry->headerLength + entry->fileInfo.st_size;
+
+    if (entry->data.failed || buffer_checkAllocation(&entry->data, size) == -1) {
+        cacheEntry_release(entry);
+        return 0;
+    }
+
+    while (entry->data.length < size) {
+        int64_t numRead = pread(fd, entry->data.data + entry->data.length, size - entry->data.length, entry->data.length - entry->headerLength);
+
+        if (numRead <= 0) {
+            if (numRead == -1 && errno == EINTR) {
+                continue;
+            }
+
+            cacheEntry_release(entry);
+            return 0;
+        }
+
+        entry->data.length += numRead;
+    }
+
+    cache_insert(&fileCache, &thread->metrics, entry);
+
+    return entry;
+}
+
+// Append the response stored in a cache entry. The file
+// contents are only included for GET requests. The stored
+// headers and contents are queued straight from the entry
+// rather than copied, with the headers that change per
+// request appended in between.
+void appendCachedResponse(Thread* thread, Connection* connection, CacheEntry* entry, int32_t method) {
+    int8_t* body = entry->data.data + entry->headerLength;
+    int64_t size = entry->data.length - entry->headerLength;
+
+    if (options.caching && isNotModified(thread, &entry->fileInfo, entry->encoding)) {
+        appendNotModifiedResponse(connection, &entry->fileInfo, entry->contentType, entry->encoding);
+        return;
+    }
+
+    // Ranges are only served from unencoded files.
+    if (method == HTTP_METHOD_GET && entry->encoding == CONTENT_ENCODING_IDENTITY && appendPartialResponse(thread, connection, entry->contentType, &entry->fileInfo, 1, size, body, -1)) {
+        return;
+    }
+
+    connection_queueCacheEntry(connection, entry, 0, entry->headerLength);
+    appendResponseHeadersEnd(connection);
+
+    if (method == HTTP_METHOD_GET && size > 0) {
+        connection_queueCacheEntry(connection, entry, entry->headerLength, size);
+    }
+}
+
+// Append a listing of the directory in the request path, or the page
+// of it picked by the offset and limit query parameters, as HTML or
+// (with format=json) JSON. The body is rendered in chunks while it's
+// sent. A range of a listing needs the whole page, so range requests
+// get it rendered up front instead.
+void appendListingResponse(Thread* thread, Connection* connection, struct stat* directoryInfo, int32_t method) {
+    int64_t offset;
+    int64_t limit;
+    int32_t format;
+
+    parseListingQuery(&thread->request.query, &offset, &limit, &format);
+
+    int32_t contentType = format == LISTING_JSON ? CONTENT_TYPE_JSON : CONTENT_TYPE_HTML;
+    int8_t compress = shouldCompress(thread, contentType, GZIP_MIN_SIZE);
+    int32_t encoding = compress ? CONTENT_ENCODING_GZIP : CONTENT_ENCODING_IDENTITY;
+
+    // The listing only changes along with the directory.
+    if (options.caching && isNotModified(thread, directoryInfo, encoding)) {
+        appendNotModifiedResponse(connection, directoryInfo, contentType, encoding);
+        return;
+    }
+
+    CacheEntry* names = readDirectoryNames(thread, directoryInfo);
+    ListingPage* page = names ? malloc(sizeof(ListingPage)) : 0;
+
+    if (!page) {
+        if (names) {
+            cacheEntry_release(names);
+        }
+
+        errorResponseBuffer(connection, HTTP_ERROR_NOT_FOUND, connection->keepAlive);
+        return;
+    }
+
+    listingPage_init(page, names, &thread->request.path, offset, limit, format);
+
+    if (method == HTTP_METHOD_GET && !compress && thread->request.range.length > 0) {
+        Buffer* listing = &thread->dirListingBuffer;
+        listing->length = 0;
+        listingPage_render(page, listing, INT64_MAX);
+        listingPage_delete(page);
+        free(page);
+
+        if (appendPartialResponse(thread, connection, contentType, directoryInfo, options.gzip, listing->length, listing->data, -1)) {
+            return;
+        }
+
+        appendOkHeaders(&connection->responseBuffer, contentType, listing->length);
+
+        if (options.caching) {
+            appendValidatorHeaders(&connection->responseBuffer, directoryInfo, encoding);
+        }
+
+        if (options.gzip) {
+            appendEncodingHeaders(&connection->responseBuffer, contentType, encoding);
+        }
+
+        appendResponseHeadersEnd(connection);
+        buffer_appendFromArray(&connection->responseBuffer, listing->data, listing->length);
+        return;
+    }
+
+    appendChunkedOkHeaders(&connection->responseBuffer, contentType);
+
+    if (options.caching) {
+        appendValidatorHeaders(&connection->responseBuffer, directoryInfo, encoding);
+    }
+
+    if (options.gzip) {
+        appendEncodingHeaders(&connection->responseBuffer, contentType, encoding);
+    }
+
+    appendResponseHeadersEnd(connection);
+
+    if (method == HTTP_METHOD_GET) {
+        connection_queueListing(connection, page, compress);
+    } else {
+        listingPage_delete(page);
+        free(page);
+    }
+}
+
+void prepareResponse(Thread* thread, Connection* connection) {
+    int32_t method = 0;
+    struct stat fileInfo;
+
+    connection->keepAlive = 0;
+    ++connection->requestCount;
+
+    // Request ended without header terminator or was too big.
+    if (connection->requestLength == 0) {
+        errorResponseBuffer(connection, HTTP_ERROR_BAD_REQUEST, 0);
+        return;
+    }
+
+    // Fill in the request struct from the parsed request.
+    if (request_fromParser(&thread->request, &connection->parser, connection->requestBuffer.data) == -1) {
+        errorResponseBuffer(connection, HTTP_ERROR_BAD_REQUEST, 0);
+        return;
+    }
+
+    // Keep the connection open for another request unless the client
+    // asked us not to or it has reached its request limit.
+    connection->keepAlive = thread->request.keepAlive && options.keepAliveTimeout > 0 && connection->requestCount < options.maxRequests;
+
+    method = methodCodeFromSlice(&thread->request.method);
+    metrics_add(&thread->metrics.requests[method > 0 ? method : 0], 1);
+
+    if (method == HTTP_METHOD_UNSUPPORTED) {
+        errorResponseBuffer(connection, HTTP_ERROR_METHOD_NOT_SUPPORTED, 0);
+        return;
+    }
+
+    // We only support HTTP 1.1
+    if (!array_caseEqualsString(thread->request.version.data, thread->request.version.length, HTTP_1_1_VERSION)) {
+        errorResponseBuffer(connection, HTTP_ERROR_VERSION_NOT_SUPPORTED, 0);
+        return;
+    }
+
+    if (options.metrics && array_equalsString(thread->request.path.data, thread->request.path.length, METRICS_PATH)) {
+        appendMetricsResponse(thread, connection, method);
+        return;
+    }
+
+    // The cache key is the request path, prefixed with the content
+    // codings the client accepts since those decide which file is sent.
+    Buffer* cacheKey = &thread->cacheKeyBuffer;
+    cacheKey->length = 0;
+    buffer_appendFromChar(cacheKey, thread->request.acceptEncodings);
+    buffer_appendFromArray(cacheKey, thread->request.path.data, thread->request.path.length);
+
+    if (options.cacheSize > 0) {
+        CacheEntry* entry = cache_acquire(&fileCache, &thread->metrics, cacheKey->data, cacheKey->length);
+
+        if (entry) {
+            if (cacheEntry_isFresh(entry)) {
+                metrics_add(&thread->metrics.cacheHits, 1);
+                appendCachedResponse(thread, connection, entry, method);
+                cacheEntry_release(entry);
+                return;
+            }
+
+            cache_remove(&fileCache, &thread->metrics, entry);
+            cacheEntry_release(entry);
+        }
+
+        metrics_add(&thread->metrics.cacheMisses, 1);
+    }
+
+    if (statFileFromBuffer(&thread->request.path, &fileInfo) == -1) {
+        errorResponseBuffer(connection, HTTP_ERROR_NOT_FOUND, connection->keepAlive);
+        return;
+    }
+
+    // Handle directory
+    if ((fileInfo.st_mode & S_IFMT) == S_IFDIR) {
+        if (thread->request.path.data[thread->request.path.length - 1] != '/') {
+            buffer_appendFromString(&thread->request.path, "/");
+        }
+
+        // Try to send index.html. Keep track of length of original path
+        // in case this doesn't work.
+        struct stat directoryInfo = fileInfo;
+        int64_t baseLength = thread->request.path.length;
+        buffer_appendFromString(&thread->request.path, "index.html");
+
+        // Otherwise send directory listing.
+        if (statFileFromBuffer(&thread->request.path, &fileInfo) == -1) {
+            thread->request.path.length = baseLength;
+            appendListingResponse(thread, connection, &directoryInfo, method);
+            return;
+        }
+
+    } // End of directory handling.
+
+    // Content type comes from the requested file even if a
+    // precompressed copy is sent.
+    int32_t contentType = contentTypeFromBuffer(&mimeTypes, &thread->request.path);
+    int32_t encoding = CONTENT_ENCODING_IDENTITY;
+
+    int8_t compress = 0;
+
+    if (thread->request.acceptEncodings && isContentTypeCompressible(contentType)) {
+        encoding = findEncodedFile(thread, &fileInfo);
+
+        // Without a precompressed copy, compress the file ourselves.
+        if (encoding == CONTENT_ENCODING_IDENTITY && shouldCompress(thread, contentType, fileInfo.st_size)) {
+            encoding = CONTENT_ENCODING_GZIP;
+            compress = 1;
+        }
+    }
+
+    // The client's copy of the file is still good.
+    if (options.caching && isNotModified(thread, &fileInfo, encoding)) {
+        appendNotModifiedResponse(connection, &fileInfo, contentType, encoding);
+        return;
+    }
+
+    // We're trying to send a file. Should exist since it was
+    // stated above.
+    int32_t fd = openFileFromBuffer(&thread->request.path, O_RDONLY);
+
+    if (fd == -1) {
+        perror("Failed to open file");
+        errorResponseBuffer(connection, HTTP_ERROR_NOT_FOUND, connection->keepAlive);
+        return;
+    }
+
+    // Small files are read into the cache and
+    // served from there.
+    if (method == HTTP_METHOD_GET && options.cacheSize > 0 && fileInfo.st_size <= fileCache.maxEntrySize) {
+        CacheEntry* entry = cacheFile(thread, cacheKey, &thread->request.path, fd, contentType, encoding, compress);
+
+        if (entry) {
+            close(fd);
+            appendCachedResponse(thread, connection, entry, method);
+            cacheEntry_release(entry);
+            return;
+        }
+    }
+
+    // Ranges are only served from unencoded files.
+    if (method == HTTP_METHOD_GET && encoding == CONTENT_ENCODING_IDENTITY && appendPartialResponse(thread, connection, contentType, &fileInfo, 1, fileInfo.st_size, 0, fd)) {
+        return;
+    }
+
+    // Prepare response headers. The length of a body compressed
+    // while it's sent isn't known up front, so it's sent in chunks.
+    if (compress) {
+        appendChunkedOkHeaders(&connection->responseBuffer, contentType);
+    } else {
+        appendOkHeaders(&connection->responseBuffer, contentType, fileInfo.st_size);
+    }
+
+    if (options.caching) {
+        appendValidatorHeaders(&connection->responseBuffer, &fileInfo, encoding);
+    }
+
+    appendEncodingHeaders(&connection->responseBuffer, contentType, encoding);
+    appendResponseHeadersEnd(connection);
+
+    // If we got a GET request, send file after the headers.
+    if (method == HTTP_METHOD_GET && compress) {
+        connection_queueGzipFile(connection, fd, fileInfo.st_size);
+    } else if (method == HTTP_METHOD_GET) {
+        connection_queueFile(connection, fd, 0, fileInfo.st_size, 1);
+    } else {
+        close(fd);
+    }
+}
+
+// Get the buffers a thread prepares responses in. They only
+// hold data for the request being handled, so they're
+// reset together once its response is prepared.
+void thread_scratchBuffers(Thread* thread, Buffer** buffers) {
+    buffers[0] = &thread->request.path;
+    buffers[1] = &thread->dirListingBuffer;
+    buffers[2] = &thread->dirnameBuffer;
+    buffers[3] = &thread->filenameBuffer;
+    buffers[4] = &thread->nameListBuffer;
+    buffers[5] = &thread->sortBuffer;
+    buffers[6] = &thread->rangeHeadersBuffer;
+    buffers[7] = &thread->etagBuffer;
+    buffers[8] = &thread->cacheKeyBuffer;
+    buffers[9] = &thread->gzipBuffer;
+}
+
+// Check if the response just prepared needed more memory than
+// it could get. Returns 1 if any of the thread's scratch buffers
+// or the connection's response buffers failed to grow, else 0.
+int8_t thread_responseFailed(Thread* thread, Connection* connection) {
+    Buffer* scratch[NUM_SCRATCH_BUFFERS];
+    thread_scratchBuffers(thread, scratch);
+
+    for (int32_t i = 0; i < NUM_SCRATCH_BUFFERS; ++i) {
+        if (scratch[i]->failed) {
             return 1;
         }
+    }
 
-        int32_t cmp = filename1[i] - filename2[i];
+    return connection->responseBuffer.failed || connection->segments.failed;
+}
 
-        if (cmp != 0) {
-            return cmp;
-        }
+// Empty the thread's scratch buffers for the next request and give
+// it the whole memory budget. Any that grew past BUFFER_RETAIN_SIZE
+// for the last one are shrunk back, so a huge directory listing
+// doesn't keep its memory in the thread for good.
+void thread_resetScratch(Thread* thread) {
+    Buffer* scratch[NUM_SCRATCH_BUFFERS];
+    thread_scratchBuffers(thread, scratch);
 
-        ++i;
+    for (int32_t i = 0; i < NUM_SCRATCH_BUFFERS; ++i) {
+        buffer_reset(scratch[i], BUFFER_RETAIN_SIZE);
     }
 
-    return 0;
+    thread->requestMemory.used = 0;
 }
 
-// Sort a list of strings. Used for directory 
-// listing responses (see handleResponse).
-void sortFilenameList(int8_t** list, int64_t length) {
-    int8_t *current;
-    for (int64_t i = 1; i < length; ++i) {
-        current = list[i];
-        int64_t j = i;
-        while (j > 0) {
-            if (compareFilenames(current, list[j - 1]) < 0) {
-                list[j] = list[j - 1];
-            } else {
-                break;
+// Prepare responses for the request that was just received and any
+// requests already in the buffer behind it, so their responses go out
+// in as few sends as possible, then switch the connection to writing.
+// Stop at the first response that closes the connection, since later
+// requests won't be answered.
+void prepareResponses(Thread* thread, Connection* connection) {
+    int64_t batched = 0;
+
+    histogram_record(&thread->metrics.phases[METRICS_PHASE_READ], connection->readStart);
+
+    // Responses are built in the response buffer, so its
+    // growth counts against each request's memory too.
+    connection->responseBuffer.budget = &thread->requestMemory;
+
+    do {
+        // The response starts either in the response buffer or,
+        // for a cached file, in the first segment queued for it.
+        int64_t segmentCount = connection_segmentCount(connection);
+        int64_t responseStart = connection->responseBuffer.length;
+        int64_t start = metrics_time();
+
+        prepareResponse(thread, connection);
+        connection_queueResponseBuffer(connection);
+
+        int8_t failed = thread_responseFailed(thread, connection);
+        thread_resetScratch(thread);
+
+        // A response that ran out of memory is replaced
+        // with an error rather than sent incomplete.
+        if (failed) {
+            connection_dropResponse(connection, segmentCount, responseStart);
+            connection->keepAlive = 0;
+            errorResponseBuffer(connection, HTTP_ERROR_INTERNAL_SERVER_ERROR, 0);
+            connection_queueResponseBuffer(connection);
+        }
+        histogram_record(&thread->metrics.phases[METRICS_PHASE_PREPARE], start);
+
+        Segment* first = connection_segmentCount(connection) > segmentCount ? connection_segment(connection, segmentCount) : 0;
+        int32_t status = statusFromArray(first && first->entry ? connection_segmentData(connection, first) : connection->responseBuffer.data + responseStart);
+        metrics_countResponse(&thread->metrics, status);
+
+        if (options.accessLog) {
+            logRequest(thread, connection, status, connection_bodyLength(connection));
+        }
+
+        connection_consumeRequest(connection);
+        ++batched;
+    } while (
+        connection->keepAlive &&
+        batched < PIPELINE_MAX_RESPONSES &&
+        connection->responseBuffer.length < PIPELINE_MAX_BUFFERED &&
+        connection->requestBuffer.length > 0 &&
+        connection_parseRequest(connection)
+    );
+
+    connection->responseBuffer.budget = 0;
+
+    // Bytes already received of the next request count
+    // from now on.
+    connection->readStart = connection->requestBuffer.length > 0 ? metrics_time() : 0;
+    connection->writeStart = metrics_time();
+    connection->state = CONNECTION_WRITING;
+}
+
+// Move the connection forward as far as its socket allows: finish
+// reading a request, prepare responses for it and any requests
+// pipelined behind it, and send them together, then start on the
+// next request if the connection is kept alive. Returns
+// IO_WOULD_BLOCK if the connection has to wait for its socket,
+// otherwise the connection is finished and should be closed.
+int8_t processConnection(Thread* thread, Connection* connection) {
+    while (1) {
+        int8_t status;
+
+        if (connection->state == CONNECTION_READING) {
+            status = receiveRequest(thread, connection);
+
+            if (status != IO_DONE) {
+                return status;
             }
-            --j;
+
+            prepareResponses(thread, connection);
+        }
+
+        status = sendResponse(thread, connection);
+
+        if (status != IO_DONE || !connection->keepAlive) {
+            return status;
         }
-        list[j] = current;
+
+        connection->state = CONNECTION_READING;
     }
 }
 
 //////////////////////////////////////////
 // MAIN THREAD FUNCTION
 //
-// Read data from accepted socket, parse
-// request, send response.
+// Take accepted sockets from the main
+// thread, or accept them from the
+// thread's own listening socket in
+// reuseport mode, and handle them one at
+// a time.
 //////////////////////////////////////////
+
+// Check if clients are waiting for a worker: queued by the main
+// thread, or in reuseport mode, pending on the thread's own
+// listening socket.
+int8_t clientsWaiting(Thread* thread) {
+    if (!options.reusePort) {
+        return connectionQueue_size(&connectionQueue) > 0;
+    }
+
+    struct pollfd listenFd = { thread->listenSocket, POLLIN, 0 };
+
+    return poll(&listenFd, 1, 0) > 0;
+}
+
+// Block until the connection's socket is ready for whatever
+// the connection is waiting to do. A connection idling between
+// requests is given up once it has been idle for a poll interval
+// while other clients are waiting for a worker, so a client that
+// sends its next request promptly keeps its connection. Returns 0
+// if the socket is ready, or -1 if the connection timed out and
+// should be closed.
+int8_t waitForSocket(Thread* thread, Connection* connection) {
+    int8_t idle = connection_isIdle(connection);
+    struct pollfd fd;
+    fd.fd = connection->socket;
+    fd.events = connection->state == CONNECTION_READING ? POLLIN : POLLOUT;
+
+    // Idle connections check for waiting clients between short polls.
+    int32_t interval = idle ? KEEP_ALIVE_POLL_INTERVAL : -1;
+    int64_t remaining = connection_timeout(connection) * 1000;
+
+    while (remaining > 0) {
+        int32_t timeout = interval > 0 && interval < remaining ? interval : remaining;
+        int32_t ready = poll(&fd, 1, timeout);
+
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            perror("Failed to wait for connection");
+            return -1;
+        }
+
+        if (ready > 0) {
+            return 0;
+        }
+
+        if (idle && clientsWaiting(thread)) {
+            return -1;
+        }
+
+        remaining -= timeout;
+    }
+
+    return -1;
+}
+
 void *handleRequest(void* args) {
     Thread* thread = (Thread*) args;
 
-    int8_t transferChunk[TRANSFER_CHUNK_SIZE];
-    int32_t method = 0;
-    struct stat fileInfo;
-
     while(1) {
-        thread->requestBuffer.length = 0;
-        thread->responseBuffer.length = 0;
-
-        // Communication with main thread.
-        // Get accecpted connection socket.
-        pthread_mutex_lock(&currentConnectionLock);
-        while(!currentConnectionWriteDone) {
-            pthread_cond_wait(&currentConnectionWritten, &currentConnectionLock);
-        }
-        currentConnectionWriteDone = 0;
-        thread->connection = currentConnection;
-        currentConnectionReadDone = 1;
-        pthread_mutex_unlock(&currentConnectionLock);
-        pthread_cond_signal(&currentConnectionRead);
-
-        // Read request stream into a buffer. Read in chunks of TRANSFER_CHUNK_SIZE.
-        // Since we only accept GET and HEAD requests, just read up to first double newline.
-        int8_t validRequest = 0;
-        while(1) {
-            int64_t received = recv(thread->connection, transferChunk, TRANSFER_CHUNK_SIZE, 0);
-
-            if (received == -1) {
-                perror("Failed to receive data");
+        int32_t socket;
+
+        if (options.reusePort) {
+            socket = accept4(thread->listenSocket, 0, 0, SOCK_NONBLOCK);
+
+            if (socket == -1) {
+                perror("Connection failed");
+                continue;
+            }
+        } else {
+            // Get accecpted connection socket from main thread.
+            int64_t start = metrics_time();
+            socket = connectionQueue_pop(&connectionQueue);
+
+            if (start) {
+                metrics_add(&thread->metrics.queueWait, monotonicNanoseconds() - start);
+            }
+        }
+
+        // The socket is non-blocking, so the connection is processed
+        // the same way as in the event loop, waiting for the socket
+        // with poll between steps.
+        connection_open(&thread->connection, socket);
+
+        while (processConnection(thread, &thread->connection) == IO_WOULD_BLOCK) {
+            if (waitForSocket(thread, &thread->connection) == -1) {
                 break;
             }
+        }
 
-            // See if we've found the end of the headers.
-            // Start search a little ways into the previous 
-            // chunk in case double newline is split between chunks.
-            int64_t index = thread->requestBuffer.length > 3 ? thread->requestBuffer.length - 3 : 0;
-            buffer_appendFromArray(&thread->requestBuffer, transferChunk, received);
+        connection_close(&thread->connection);
+    }
+}
 
-            for (int64_t i = index; i < thread->requestBuffer.length; ++i) {
-                if (isArrayHttpHeaderEnd(thread->requestBuffer.data + i, thread->requestBuffer.length - i)) {
-                    validRequest = 1;
-                    break;
-                }
+//////////////////////////////////////////
+// IO_URING
+//
+// A thread's ring takes batches of
+// operations on its sockets in one system
+// call and hands back their results as
+// completions. Receives pick buffers from
+// a ring of buffers shared with the kernel.
+//////////////////////////////////////////
+
+// Release a ring's mappings and buffers and close it.
+void ring_delete(Ring* ring) {
+    if (ring->bufferRing) {
+        munmap(ring->bufferRing, RING_BUFFER_COUNT * sizeof(struct io_uring_buf));
+        ring->bufferRing = 0;
+    }
+
+    free(ring->buffers);
+    ring->buffers = 0;
+
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqesSize);
+        ring->sqes = 0;
+    }
+
+    if (ring->rings) {
+        munmap(ring->rings, ring->ringsSize);
+        ring->rings = 0;
+    }
+
+    if (ring->fd != -1) {
+        close(ring->fd);
+        ring->fd = -1;
+    }
+}
+
+// Hand a receive buffer back to the kernel.
+void ring_returnBuffer(Ring* ring, uint16_t id) {
+    struct io_uring_buf* buffer = &ring->bufferRing->bufs[ring->bufferTail & (RING_BUFFER_COUNT - 1)];
+    buffer->addr = (uint64_t) (uintptr_t) (ring->buffers + (int64_t) id * RING_BUFFER_SIZE);
+    buffer->len = RING_BUFFER_SIZE;
+    buffer->bid = id;
+
+    ++ring->bufferTail;
+    __atomic_store_n(&ring->bufferRing->tail, ring->bufferTail, __ATOMIC_RELEASE);
+}
+
+// Set up a ring and its receive buffers. The ring starts out
+// disabled, to be enabled by the thread that submits to it
+// (see ring_enable). It needs Linux 6.1 or later for the setup
+// flags used, which also covers multishot accept and receive and
+// provided buffer rings. Returns 0 on success or -1 (with errno
+// set) if the kernel doesn't support it.
+int8_t ring_init(Ring* ring) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(Ring));
+
+    // Completions are only processed when the thread asks for them,
+    // and multishot receives can post many per submission.
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_R_DISABLED;
+    params.cq_entries = RING_ENTRIES * 4;
+
+    ring->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+
+    if (ring->fd == -1) {
+        return -1;
+    }
+
+    uint32_t required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+
+    if ((params.features & required) != required) {
+        ring_delete(ring);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    int64_t sqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    int64_t cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ringsSize = sqRingSize > cqRingSize ? sqRingSize : cqRingSize;
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    void* rings = mmap(0, ring->ringsSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->rings = rings == MAP_FAILED ? 0 : rings;
+
+    void* sqes = mmap(0, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    ring->sqes = sqes == MAP_FAILED ? 0 : sqes;
+
+    void* bufferRing = mmap(0, RING_BUFFER_COUNT * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring->bufferRing = bufferRing == MAP_FAILED ? 0 : bufferRing;
+    ring->buffers = malloc((int64_t) RING_BUFFER_COUNT * RING_BUFFER_SIZE);
+
+    if (!ring->rings || !ring->sqes || !ring->bufferRing || !ring->buffers) {
+        int32_t error = errno;
+        ring_delete(ring);
+        errno = error;
+        return -1;
+    }
+
+    ring->sqHead = (uint32_t*) (ring->rings + params.sq_off.head);
+    ring->sqTail = (uint32_t*) (ring->rings + params.sq_off.tail);
+    ring->sqMask = *(uint32_t*) (ring->rings + params.sq_off.ring_mask);
+    ring->cqHead = (uint32_t*) (ring->rings + params.cq_off.head);
+    ring->cqTail = (uint32_t*) (ring->rings + params.cq_off.tail);
+    ring->cqMask = *(uint32_t*) (ring->rings + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (ring->rings + params.cq_off.cqes);
+
+    // Entries are always submitted in order.
+    uint32_t* array = (uint32_t*) (ring->rings + params.sq_off.array);
+    for (uint32_t i = 0; i < params.sq_entries; ++i) {
+        array[i] = i;
+    }
+
+    struct io_uring_buf_reg bufferRegistration;
+    memset(&bufferRegistration, 0, sizeof(bufferRegistration));
+    bufferRegistration.ring_addr = (uint64_t) (uintptr_t) ring->bufferRing;
+    bufferRegistration.ring_entries = RING_BUFFER_COUNT;
+    bufferRegistration.bgid = RING_BUFFER_GROUP;
+
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &bufferRegistration, 1) == -1) {
+        int32_t error = errno;
+        ring_delete(ring);
+        errno = error;
+        return -1;
+    }
+
+    for (int32_t i = 0; i < RING_BUFFER_COUNT; ++i) {
+        ring_returnBuffer(ring, i);
+    }
+
+    return 0;
+}
+
+// Enable a ring set up by ring_init. Only the calling thread
+// can submit to it from then on. Returns 0 on success or -1.
+int8_t ring_enable(Ring* ring) {
+    return syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_ENABLE_RINGS, 0, 0) == -1 ? -1 : 0;
+}
+
+// Hand the kernel the entries filled since the last call, and with
+// timeout (in milliseconds, -1 to wait indefinitely) at least 0,
+// wait up to that long for a completion. Returns 0, or -1 if
+// io_uring_enter failed for any reason but the wait timing out.
+int8_t ring_submit(Ring* ring, int32_t timeout) {
+    __atomic_store_n(ring->sqTail, *ring->sqTail + ring->queued, __ATOMIC_RELEASE);
+    ring->queued = 0;
+
+    uint32_t toSubmit = *ring->sqTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+    uint32_t flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    uint32_t minComplete = 1;
+
+    struct __kernel_timespec time;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+
+    if (timeout == 0) {
+        minComplete = 0;
+    } else if (timeout > 0) {
+        time.tv_sec = timeout / 1000;
+        time.tv_nsec = (timeout % 1000) * 1000000;
+        arg.ts = (uint64_t) (uintptr_t) &time;
+    }
+
+    if (syscall(__NR_io_uring_enter, ring->fd, toSubmit, minComplete, flags, &arg, sizeof(arg)) == -1 && errno != ETIME) {
+        return -1;
+    }
+
+    return 0;
+}
+
+// Get a zeroed submission queue entry to fill in. It's handed to
+// the kernel with the rest of the batch by the next ring_submit,
+// or right away if the queue is full.
+struct io_uring_sqe* ring_getSqe(Ring* ring) {
+    uint32_t tail = *ring->sqTail + ring->queued;
+
+    if (tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) > ring->sqMask) {
+        if (ring_submit(ring, 0) == -1) {
+            perror("Failed to submit to io_uring");
+        }
+
+        tail = *ring->sqTail;
+    }
+
+    struct io_uring_sqe* sqe = &ring->sqes[tail & ring->sqMask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ++ring->queued;
+
+    return sqe;
+}
+
+// Take the next completion off the ring. Returns 1 if
+// there was one, else 0.
+int8_t ring_nextCompletion(Ring* ring, struct io_uring_cqe* cqe) {
+    uint32_t head = *ring->cqHead;
+
+    if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+
+    *cqe = ring->cqes[head & ring->cqMask];
+    __atomic_store_n(ring->cqHead, head + 1, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+// Cancel every operation in flight on a file descriptor.
+void ring_queueCancel(Ring* ring, int32_t fd) {
+    struct io_uring_sqe* sqe = ring_getSqe(ring);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = RING_CANCEL;
+}
+
+//////////////////////////////////////////
+// EVENT LOOP THREAD FUNCTION
+//
+// Each thread waits on its own epoll
+// instance for the listening socket and
+// any connections it has accepted. Sockets
+// are non-blocking and edge-triggered, so
+// a connection is processed until it
+// would block and picked up again on its
+// next event.
+//////////////////////////////////////////
+
+// Add a connection to the end of the thread's list
+// of open connections and mark it as active.
+void linkThreadConnection(Thread* thread, Connection* connection) {
+    connection->lastActive = monotonicSeconds();
+    connection->next = 0;
+    connection->prev = thread->lastConnection;
+
+    if (thread->lastConnection) {
+        thread->lastConnection->next = connection;
+    } else {
+        thread->connections = connection;
+    }
+
+    thread->lastConnection = connection;
+}
+
+// Remove a connection from the thread's list
+// of open connections.
+void unlinkThreadConnection(Thread* thread, Connection* connection) {
+    if (connection->prev) {
+        connection->prev->next = connection->next;
+    } else {
+        thread->connections = connection->next;
+    }
+
+    if (connection->next) {
+        connection->next->prev = connection->prev;
+    } else {
+        thread->lastConnection = connection->prev;
+    }
+
+    connection->prev = 0;
+    connection->next = 0;
+}
+
+// Open a connection for a socket the thread accepted, reusing a
+// closed one if there is one, and add it to the thread's list.
+// Returns the connection, or 0 if it couldn't be allocated, in
+// which case the socket is closed.
+Connection* openThreadConnection(Thread* thread, int32_t socket) {
+    Connection* connection = thread->freeConnections;
+
+    if (connection) {
+        thread->freeConnections = connection->next;
+    } else {
+        connection = malloc(sizeof(Connection));
+
+        if (!connection) {
+            fprintf(stderr, "openThreadConnection: Out of memory\n");
+            close(socket);
+            return 0;
+        }
+
+        connection_init(connection);
+    }
+
+    connection_open(connection, socket);
+    linkThreadConnection(thread, connection);
+
+    return connection;
+}
+
+// Close a connection that's no longer in the thread's
+// list and keep it for reuse.
+void releaseThreadConnection(Thread* thread, Connection* connection) {
+    connection_close(connection);
+
+    connection->next = thread->freeConnections;
+    thread->freeConnections = connection;
+}
+
+// Close a connection owned by the thread and keep it for reuse.
+// Operations still in flight on the thread's ring (io_uring mode)
+// refer to the connection, so they're cancelled and the connection
+// is only released once the last of them completes.
+void closeThreadConnection(Thread* thread, Connection* connection) {
+    unlinkThreadConnection(thread, connection);
+
+    if (connection->pendingOperations > 0) {
+        connection->closing = 1;
+        ring_queueCancel(&thread->ring, connection->socket);
+        return;
+    }
+
+    releaseThreadConnection(thread, connection);
+}
+
+// Close connections that have gone without activity for longer
+// than their timeout. The least recently active connections are
+// at the front of the list, so only those inactive for at least
+// the shorter of the two timeouts need to be checked.
+void closeIdleConnections(Thread* thread) {
+    int64_t now = monotonicSeconds();
+    int64_t shortestTimeout = CONNECTION_TIMEOUT;
+
+    if (options.keepAliveTimeout > 0 && options.keepAliveTimeout < shortestTimeout) {
+        shortestTimeout = options.keepAliveTimeout;
+    }
+
+    Connection* connection = thread->connections;
+    while (connection && now - connection->lastActive >= shortestTimeout) {
+        Connection* next = connection->next;
+
+        if (now - connection->lastActive >= connection_timeout(connection)) {
+            closeThreadConnection(thread, connection);
+        }
+
+        connection = next;
+    }
+}
+
+// Accept all pending connections on the thread's listening socket
+// and add them to the thread's epoll instance.
+void acceptConnections(Thread* thread) {
+    while (1) {
+        int32_t socket = accept4(thread->listenSocket, 0, 0, SOCK_NONBLOCK);
+
+        if (socket == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            // EAGAIN means another thread got there first
+            // or there's nothing left to accept.
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("Connection failed");
+            }
+            break;
+        }
+
+        Connection* connection = openThreadConnection(thread, socket);
+
+        if (!connection) {
+            break;
+        }
+
+        // Wait for both directions at once so the connection never
+        // has to be modified as it moves between reading and writing.
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = connection;
+
+        if (epoll_ctl(thread->epoll, EPOLL_CTL_ADD, socket, &event) == -1) {
+            perror("Failed to add connection to epoll");
+            closeThreadConnection(thread, connection);
+        }
+    }
+}
+
+void *handleEvents(void* args) {
+    Thread* thread = (Thread*) args;
+
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+
+    while(1) {
+        // Wake up at least once a second to check for idle connections.
+        int32_t numEvents = epoll_wait(thread->epoll, events, EPOLL_MAX_EVENTS, thread->connections ? 1000 : -1);
+
+        if (numEvents == -1) {
+            if (errno != EINTR) {
+                perror("Failed to wait for events");
+            }
+            continue;
+        }
+
+        for (int32_t i = 0; i < numEvents; ++i) {
+            Connection* connection = events[i].data.ptr;
+
+            // The listening socket is registered with a null pointer.
+            if (!connection) {
+                acceptConnections(thread);
+                continue;
+            }
+
+            if (processConnection(thread, connection) == IO_WOULD_BLOCK) {
+                // Move to the back of the list as the most recently active.
+                unlinkThreadConnection(thread, connection);
+                linkThreadConnection(thread, connection);
+            } else {
+                closeThreadConnection(thread, connection);
+            }
+        }
+
+        closeIdleConnections(thread);
+    }
+}
+
+//////////////////////////////////////////
+// IO_URING THREAD FUNCTION
+//
+// Like the event loop, but each thread
+// submits accepts, receives and sends to
+// its own ring in batches, and handles
+// their completions. Accepts and receives
+// are multishot, so they're submitted
+// once and keep completing.
+//////////////////////////////////////////
+
+// Queue a multishot accept on the thread's listening socket.
+void queueRingAccept(Thread* thread) {
+    struct io_uring_sqe* sqe = ring_getSqe(&thread->ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = thread->listenSocket;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    sqe->user_data = RING_ACCEPT;
+}
+
+// Queue a multishot receive on a connection's socket. Each
+// completion carries one of the ring's buffers.
+void queueRingReceive(Thread* thread, Connection* connection) {
+    struct io_uring_sqe* sqe = ring_getSqe(&thread->ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = connection->socket;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RING_BUFFER_GROUP;
+    sqe->user_data = (uint64_t) (uintptr_t) connection | RING_RECEIVE;
+    ++connection->pendingOperations;
+}
+
+// Queue a send of the run of segments in memory starting at the
+// connection's current segment.
+void queueRingSend(Thread* thread, Connection* connection) {
+    int32_t flags = connection_gatherSegments(connection, connection->iovecs, &connection->gatherEnd);
+
+    memset(&connection->message, 0, sizeof(struct msghdr));
+    connection->message.msg_iov = connection->iovecs;
+    connection->message.msg_iovlen = connection->gatherEnd - connection->segmentIndex;
+
+    struct io_uring_sqe* sqe = ring_getSqe(&thread->ring);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = connection->socket;
+    sqe->addr = (uint64_t) (uintptr_t) &connection->message;
+    sqe->len = 1;
+    sqe->msg_flags = flags;
+    sqe->user_data = (uint64_t) (uintptr_t) connection | RING_SEND;
+    ++connection->pendingOperations;
+    connection->sending = 1;
+}
+
+// Queue a poll for a connection's socket to be writable.
+void queueRingPoll(Thread* thread, Connection* connection) {
+    struct io_uring_sqe* sqe = ring_getSqe(&thread->ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = connection->socket;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = (uint64_t) (uintptr_t) connection | RING_POLL;
+    ++connection->pendingOperations;
+    connection->sending = 1;
+}
+
+// Send the queued responses of a connection. Runs of segments in
+// memory go to the ring as one sendmsg. Files and chunked bodies
+// are sent right away as in the event loop, since sendfile has no
+// ring equivalent, with a poll on the ring when they'd block.
+// Returns IO_WOULD_BLOCK while an operation is in flight and
+// IO_DONE once everything has been sent.
+int8_t sendRingResponse(Thread* thread, Connection* connection) {
+    int64_t count = connection_segmentCount(connection);
+
+    while (connection->segmentIndex < count) {
+        Segment* segment = connection_segment(connection, connection->segmentIndex);
+
+        if (segment_isInMemory(segment)) {
+            queueRingSend(thread, connection);
+            return IO_WOULD_BLOCK;
+        }
+
+        int8_t status = segment->chunked ? sendChunkedSegment(thread, connection, segment) : sendSegment(thread, connection, segment);
+
+        if (status == IO_WOULD_BLOCK) {
+            queueRingPoll(thread, connection);
+        }
+
+        if (status != IO_DONE) {
+            return status;
+        }
+
+        segment_finish(segment);
+
+        ++connection->segmentIndex;
+    }
+
+    histogram_record(&thread->metrics.phases[METRICS_PHASE_WRITE], connection->writeStart);
+    connection_clearResponses(connection);
+
+    return IO_DONE;
+}
+
+// Move a connection forward after a completion, as processConnection
+// does, with the bytes its receives have added to the request buffer.
+// Returns IO_WOULD_BLOCK if the connection has to wait for another
+// completion, otherwise the connection should be closed.
+int8_t advanceRingConnection(Thread* thread, Connection* connection) {
+    while (1) {
+        if (connection->state == CONNECTION_READING) {
+            if (connection->requestBuffer.length == 0 || !connection_parseRequest(connection)) {
+                return connection->receiveClosed ? IO_ERROR : IO_WOULD_BLOCK;
+            }
+
+            prepareResponses(thread, connection);
+        }
+
+        int8_t status = sendRingResponse(thread, connection);
+
+        if (status != IO_DONE || !connection->keepAlive) {
+            return status;
+        }
+
+        connection->state = CONNECTION_READING;
+    }
+}
+
+// Handle a completion from the thread's ring.
+void handleRingCompletion(Thread* thread, struct io_uring_cqe* cqe) {
+    int32_t operation = cqe->user_data & RING_OPERATION_MASK;
+    Connection* connection = (Connection*) (uintptr_t) (cqe->user_data & ~(uint64_t) RING_OPERATION_MASK);
+    int8_t more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+
+    if (operation == RING_CANCEL) {
+        return;
+    }
+
+    if (operation == RING_ACCEPT) {
+        if (cqe->res >= 0) {
+            connection = openThreadConnection(thread, cqe->res);
+
+            if (connection) {
+                queueRingReceive(thread, connection);
             }
+        } else {
+            fprintf(stderr, "Connection failed: %s\n", strerror(-cqe->res));
+        }
+
+        if (!more) {
+            queueRingAccept(thread);
+        }
+        return;
+    }
+
+    // The buffer received into goes back to the kernel
+    // as soon as its bytes are copied.
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        uint16_t id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
 
-            if (validRequest) {
-                break;
-            } else if (received < TRANSFER_CHUNK_SIZE) {
-                // Request ended without header terminator
-                errorResponseBuffer(&thread->responseBuffer, BAD_REQUEST_HEADERS, BAD_REQUEST_BODY);
-                if (write(thread->connection, thread->responseBuffer.data, thread->responseBuffer.length) == -1) {
-                    perror("Failed to send response");
-                }
-                break;
-            } else if (thread->requestBuffer.length > REQUEST_MAX_SIZE) {
-                // Request is too big.
-                errorResponseBuffer(&thread->responseBuffer, BAD_REQUEST_HEADERS, BAD_REQUEST_BODY);
-                if (write(thread->connection, thread->responseBuffer.data, thread->responseBuffer.length) == -1) {
-                    perror("Failed to send response");
-                }
-                break;
+        if (cqe->res > 0 && !connection->closing) {
+            if (connection->requestBuffer.length == 0) {
+                connection->readStart = metrics_time();
             }
+
+            buffer_appendFromArray(&connection->requestBuffer, thread->ring.buffers + (int64_t) id * RING_BUFFER_SIZE, cqe->res);
         }
 
-        // Wasn't a valid HTTP request
-        if (!validRequest) {
-            close(thread->connection);
-            continue;
+        ring_returnBuffer(&thread->ring, id);
+    }
+
+    if (!more) {
+        --connection->pendingOperations;
+    }
+
+    if (connection->closing) {
+        if (connection->pendingOperations == 0) {
+            releaseThreadConnection(thread, connection);
         }
+        return;
+    }
 
-        // Parse request string into request struct.
-        if (parseRequestFromBuffer(&thread->requestBuffer, &thread->request) == -1) {
-            errorResponseBuffer(&thread->responseBuffer, BAD_REQUEST_HEADERS, BAD_REQUEST_BODY);
-            if (write(thread->connection, thread->responseBuffer.data, thread->responseBuffer.length) == -1) {
-                perror("Failed to send response");
-            }
-            close(thread->connection);
-            continue;
+    int8_t status = IO_WOULD_BLOCK;
+
+    if (operation == RING_RECEIVE) {
+        if (cqe->res == 0) {
+            // Client closed the connection. Requests it sent
+            // before that are still answered.
+            connection->receiveClosed = 1;
+        } else if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+            fprintf(stderr, "Failed to receive data: %s\n", strerror(-cqe->res));
+            status = IO_ERROR;
+        } else if (!more) {
+            // The receive stops when the ring runs out of buffers.
+            queueRingReceive(thread, connection);
         }
 
-        method = methodCodeFromBuffer(&thread->request.method);
-        if (method == HTTP_METHOD_UNSUPPORTED) {
-            errorResponseBuffer(&thread->responseBuffer, METHOD_NOT_SUPPORTED_HEADERS, METHOD_NOT_SUPPORTED_BODY);
-            if (write(thread->connection, thread->responseBuffer.data, thread->responseBuffer.length) == -1) {
-                perror("Failed to send response");
-            }
-            close(thread->connection);
-            continue;
+        // Bytes that didn't fit in memory are lost.
+        if (connection->requestBuffer.failed) {
+            status = IO_ERROR;
         }
 
-        // We only support HTTP 1.1
-        if (!array_caseEqualsString(thread->request.version.data, thread->request.version.length, HTTP_1_1_VERSION)) {
-            errorResponseBuffer(&thread->responseBuffer, VERSION_NOT_SUPPORTED_HEADERS, VERSION_NOT_SUPPORTED_BODY);
-            if (write(thread->connection, thread->responseBuffer.data, thread->responseBuffer.length) == -1) {
-                perror("Failed to send response");
+        // Requests that arrive while responses are being sent
+        // wait until they're done, up to a limit.
+        if (status == IO_WOULD_BLOCK) {
+            if (connection->state == CONNECTION_READING) {
+                status = advanceRingConnection(thread, connection);
+            } else if (connection->requestBuffer.length > RING_MAX_BUFFERED_INPUT) {
+                status = IO_ERROR;
             }
-            close(thread->connection);
-            continue;
         }
+    } else {
+        connection->sending = 0;
 
-        printf("%.*s %.*s handled by thread %d\n", (int32_t) thread->request.method.length, thread->request.method.data, (int32_t) thread->request.path.length - 1, thread->request.path.data + 1, thread->id);
+        if (operation == RING_SEND && cqe->res < 0) {
+            fprintf(stderr, "Failed to send response: %s\n", strerror(-cqe->res));
+            status = IO_ERROR;
+        } else {
+            if (operation == RING_SEND) {
+                connection_advanceSegments(connection, connection->gatherEnd, cqe->res);
+                metrics_add(&thread->metrics.bytesSent, cqe->res);
+            }
 
-        if (statFileFromBuffer(&thread->request.path, &fileInfo) == -1) {
-            errorResponseBuffer(&thread->responseBuffer, NOT_FOUND_HEADERS, NOT_FOUND_BODY);
-            if (write(thread->connection, thread->responseBuffer.data, thread->responseBuffer.length) == -1) {
-                perror("Failed to send response");
-            }  
-            close(thread->connection);
-            continue;
+            status = advanceRingConnection(thread, connection);
         }
+    }
 
-        // Handle directory
-        if ((fileInfo.st_mode & S_IFMT) == S_IFDIR) {
-            if (thread->request.path.data[thread->request.path.length - 1] != '/') {
-                buffer_appendFromString(&thread->request.path, "/");
-            }
+    if (status == IO_WOULD_BLOCK) {
+        // Move to the back of the list as the most recently active.
+        unlinkThreadConnection(thread, connection);
+        linkThreadConnection(thread, connection);
+    } else {
+        closeThreadConnection(thread, connection);
+    }
+}
 
-            // Try to send index.html. Keep track of length of original path
-            // in case this doesn't work.
-            int64_t baseLength = thread->request.path.length;
-            buffer_appendFromString(&thread->request.path, "index.html");
-
-            // Otherwise send directory listing.
-            if (statFileFromBuffer(&thread->request.path, &fileInfo) == -1) {
-                thread->dirListingBuffer.length = 0;
-                thread->dirnameBuffer.length = 0;
-                thread->filenameBuffer.length = 0;
-                thread->request.path.length = baseLength;
-                buffer_appendFromString(&thread->dirListingBuffer, "<html><body><h1>Directory listing for: ");
-                buffer_appendFromArray(&thread->dirListingBuffer, thread->request.path.data + 1, thread->request.path.length - 1); // Skip '.'
-                buffer_appendFromString(&thread->dirListingBuffer, "</h1><ul>\n");
-
-                DIR *dir = openDirFromBuffer(&thread->request.path);
-
-                if (!dir) {
-                    perror("Failed to open directory");
-                    errorResponseBuffer(&thread->responseBuffer, NOT_FOUND_HEADERS, NOT_FOUND_BODY);
-                    if (write(thread->connection, thread->responseBuffer.data, thread->responseBuffer.length) == -1) {
-                        perror("Failed to send response");
-                    } 
-                    close(thread->connection);
-                    continue;
-                }
-                
-                struct dirent entry;
-                struct dirent* entryp;
-
-                int64_t dirCount = 0;
-                int64_t fileCount = 0;
-
-                readdir_r(dir, &entry, &entryp);
-                while (entryp) {
-                    if (string_equals(entry.d_name, ".") || string_equals(entry.d_name, "..")) {
-                        readdir_r(dir, &entry, &entryp);
-                        continue;
-                    }
+void *handleRing(void* args) {
+    Thread* thread = (Thread*) args;
 
-                    // Reset to original path, i.e. get rid of
-                    // name from last iteration of loop.
-                    thread->request.path.length = baseLength;
-                    
-                    buffer_appendFromString(&thread->request.path, entry.d_name);
-
-                    // Separate directory and file listings. Names of each
-                    // are kept in a single buffer, separated by null characters.
-                    if (entry.d_type == DT_DIR) {
-                        buffer_appendFromString(&thread->dirnameBuffer, entry.d_name); 
-                        buffer_appendFromChar(&thread->dirnameBuffer, '\0'); 
-                        ++dirCount;
-                    } else if (entry.d_type == DT_REG) {
-                        buffer_appendFromString(&thread->filenameBuffer, entry.d_name); 
-                        buffer_appendFromChar(&thread->filenameBuffer, '\0'); 
-                        ++fileCount;
-                    }
+    // The ring was set up disabled so the thread that
+    // submits to it can claim it.
+    if (ring_enable(&thread->ring) == -1) {
+        perror("Failed to enable io_uring");
+        return 0;
+    }
 
-                    readdir_r(dir, &entry, &entryp);
-                }
+    queueRingAccept(thread);
 
-                // Here we set up pointers to the begine of each name
-                // two buffers of file and directory names. We'll
-                // sort pointers to arrange the listing alphabetically.
-                int8_t* directoryNames[dirCount];
-                int8_t* filenames[fileCount];
-                int64_t currentFile = 1;
-                int64_t currentDir = 1;
-
-                directoryNames[0] = thread->dirnameBuffer.data;
-                filenames[0] = thread->filenameBuffer.data;
-
-                int8_t* current = thread->dirnameBuffer.data;
-                int8_t* end = thread->dirnameBuffer.data + thread->dirnameBuffer.length;
-                while (current != end && currentDir < dirCount) {
-                    if (*current == '\0') {
-                        directoryNames[currentDir] = current + 1;
-                        ++currentDir;
-                    }
-                    ++current;
-                }
+    while(1) {
+        // Wake up at least once a second to check for idle connections.
+        if (ring_submit(&thread->ring, thread->connections ? 1000 : -1) == -1) {
+            if (errno != EINTR) {
+                perror("Failed to wait for completions");
+            }
+            continue;
+        }
 
-                current = thread->filenameBuffer.data;
-                end = thread->filenameBuffer.data + thread->filenameBuffer.length;
-                while (current != end && currentFile < fileCount) {
-                    if (*current == '\0') {
-                        filenames[currentFile] = current + 1;
-                        ++currentFile;
-                    }
-                    ++current;
-                }
+        struct io_uring_cqe cqe;
+        while (ring_nextCompletion(&thread->ring, &cqe)) {
+            handleRingCompletion(thread, &cqe);
+        }
 
-                // Sort the two lists.
-                sortFilenameList(directoryNames, dirCount);
-                sortFilenameList(filenames, fileCount);
-
-                // Reset path again for display.
-                thread->request.path.length = baseLength;
-                
-                // List directories.
-                for (int64_t i = 0; i < dirCount; ++i) {
-                    buffer_appendFromString(&thread->dirListingBuffer, "<li><a href=\"");
-                    buffer_appendFromArray(&thread->dirListingBuffer, thread->request.path.data + 1, thread->request.path.length - 1); // Skip '.'
-                    buffer_appendFromString(&thread->dirListingBuffer, (char *)directoryNames[i]);
-                    buffer_appendFromString(&thread->dirListingBuffer, "/\">");
-                    buffer_appendFromString(&thread->dirListingBuffer, (char *)directoryNames[i]);
-                    buffer_appendFromString(&thread->dirListingBuffer, "/</a></li>\n");
-                }
+        closeIdleConnections(thread);
+    }
+}
 
-                // List files.
-                for (int64_t i = 0; i < fileCount; ++i) {
-                    buffer_appendFromString(&thread->dirListingBuffer, "<li><a href=\"");
-                    buffer_appendFromArray(&thread->dirListingBuffer, thread->request.path.data + 1, thread->request.path.length - 1); // Skip '.'
-                    buffer_appendFromString(&thread->dirListingBuffer, (char *)filenames[i]);
-                    buffer_appendFromString(&thread->dirListingBuffer, "\">");
-                    buffer_appendFromString(&thread->dirListingBuffer, (char *)filenames[i]);
-                    buffer_appendFromString(&thread->dirListingBuffer, "</a></li>\n");
-                }
-                buffer_appendFromString(&thread->dirListingBuffer, "</ul></body></html>\n");
-                
-                // Prepare response headers.
-                buffer_appendFromString(&thread->responseBuffer, HTTP_OK_HEADER HTTP_CACHE_HEADERS "Content-Type: text/html" HTTP_NEWLINE);
-                buffer_appendFromString(&thread->responseBuffer, HTTP_CONTENT_LENGTH_KEY);
-                buffer_appendFromUint(&thread->responseBuffer, thread->dirListingBuffer.length);
-                buffer_appendFromString(&thread->responseBuffer, HTTP_NEWLINE);
-                buffer_appendFromString(&thread->responseBuffer, HTTP_DATE_KEY);
-                buffer_appendDate(&thread->responseBuffer);
-                buffer_appendFromString(&thread->responseBuffer, HTTP_END_HEADER);
-
-                // Append listing if we got a GET request.
-                if (method == HTTP_METHOD_GET) {
-                    buffer_appendFromArray(&thread->responseBuffer, thread->dirListingBuffer.data, thread->dirListingBuffer.length);
-                }
+//////////////////////////////////////////
+// ACCESS LOG THREAD FUNCTION
+//
+// Empty the threads' rings, then sleep
+// for a bit once they're all empty.
+//////////////////////////////////////////
 
-                // Send response.
-                if (write(thread->connection, thread->responseBuffer.data, thread->responseBuffer.length) == -1) {
-                    perror("Failed to send response");
-                }  
-                
-                // Clean up.
-                close(thread->connection);
-                closedir(dir);
-                continue;
-            }
-            
-        } // End of directory handling.
+void *handleAccessLog(void* args) {
+    AccessLog* log = (AccessLog*) args;
+    struct timespec interval = { 0, LOG_FLUSH_INTERVAL * 1000000 };
 
-        // We're trying to send a file. Should exist since it was
-        // stated above.
-        int32_t fd = openFileFromBuffer(&thread->request.path, O_RDONLY);
+    // Only allow the thread to be cancelled while it sleeps,
+    // so records are never half written on exit.
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, 0);
 
-        if (fd == -1) {
-            perror("Failed to open file");
-            errorResponseBuffer(&thread->responseBuffer, NOT_FOUND_HEADERS, NOT_FOUND_BODY);
-            if (write(thread->connection, thread->responseBuffer.data, thread->responseBuffer.length) == -1) {
-                perror("Failed to send response");
-            }
-            close(thread->connection);
-            continue; 
-        }
-
-        // Prepare response headers.
-        buffer_appendFromString(&thread->responseBuffer, HTTP_OK_HEADER);
-        buffer_appendFromString(&thread->responseBuffer, HTTP_CACHE_HEADERS);
-        buffer_appendFromString(&thread->responseBuffer, HTTP_CONTENT_TYPE_KEY);
-        buffer_appendFromString(&thread->responseBuffer, contentTypeStringFromBuffer(&thread->request.path));
-        buffer_appendFromString(&thread->responseBuffer, HTTP_NEWLINE);
-        buffer_appendFromString(&thread->responseBuffer, HTTP_CONTENT_LENGTH_KEY);
-        buffer_appendFromUint(&thread->responseBuffer, fileInfo.st_size);
-        buffer_appendFromString(&thread->responseBuffer, HTTP_NEWLINE);
-        buffer_appendFromString(&thread->responseBuffer, HTTP_DATE_KEY);
-        buffer_appendDate(&thread->responseBuffer);
-        buffer_appendFromString(&thread->responseBuffer, HTTP_END_HEADER);
-        
-        // Send response headers.
-        if (write(thread->connection, thread->responseBuffer.data, thread->responseBuffer.length) == -1) {
-            perror("Failed to send response headers");
-            close(thread->connection);
-            close(fd);
-            continue; 
+    while (1) {
+        if (accessLog_drain(log) == 0) {
+            pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, 0);
+            nanosleep(&interval, 0);
+            pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, 0);
         }
+    }
+}
+
+// Create a socket listening on the given port. With reusePort,
+// several sockets can be bound to the same port and the kernel
+// balances incoming connections between them. Returns the socket,
+// or -1 if it couldn't be set up.
+int32_t createListeningSocket(uint32_t port, int8_t reusePort, int8_t nonBlocking) {
+    int32_t listenSocket = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenSocket == -1) {
+        perror("Failed to create socket");
+        return -1;
+    }
 
-        // If we got a GET request, send file.
-        if (method == HTTP_METHOD_GET) {
-            int64_t i = 0;
-            
-            while (i < fileInfo.st_size) {
-                int64_t length = TRANSFER_CHUNK_SIZE;
+    // To prevent the socket from remaining occupied on exit.
+    int32_t sockoptTrue = 1;
+    if (setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &sockoptTrue, sizeof(sockoptTrue)) == -1) {
+        perror("Failed to set socket options");
+        close(listenSocket);
+        return -1;
+    }
 
-                if (i + length > fileInfo.st_size) {
-                    length = fileInfo.st_size - i;
-                }
+    if (reusePort && setsockopt(listenSocket, SOL_SOCKET, SO_REUSEPORT, &sockoptTrue, sizeof(sockoptTrue)) == -1) {
+        perror("Failed to set SO_REUSEPORT");
+        close(listenSocket);
+        return -1;
+    }
 
-                int64_t numRead = read(fd, transferChunk, length);
+    // Responses are already written in as few sends as possible
+    // (MSG_MORE marks the ones with more to come), so don't let
+    // Nagle's algorithm hold back the last small one, such as the
+    // end of a chunked body, until the client's delayed ACK.
+    // Accepted sockets inherit the option.
+    if (setsockopt(listenSocket, IPPROTO_TCP, TCP_NODELAY, &sockoptTrue, sizeof(sockoptTrue)) == -1) {
+        perror("Failed to set TCP_NODELAY");
+        close(listenSocket);
+        return -1;
+    }
 
-                if (numRead > 0) {
-                    i += numRead;
-                } else {
-                    break;
-                }
+    // Start listening on the socket.
+    struct sockaddr_in addr;
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
 
-                if (write(thread->connection, transferChunk, length) == -1) {
-                    perror("Failed to send response");
-                    break;
-                }
-            }
-        } 
+    if (bind(listenSocket, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+        perror("Failed to bind");
+        close(listenSocket);
+        return -1;
+    }
 
-        // Clean up.
-        close(thread->connection);
-        close(fd);
+    if (listen(listenSocket, SOMAXCONN) == -1) {
+        perror("Failed to listen");
+        close(listenSocket);
+        return -1;
+    }
+
+    // Event loop threads wait on listening sockets in epoll,
+    // so accepting mustn't block.
+    if (nonBlocking && fcntl(listenSocket, F_SETFL, fcntl(listenSocket, F_GETFL) | O_NONBLOCK) == -1) {
+        perror("Failed to make socket non-blocking");
+        close(listenSocket);
+        return -1;
     }
+
+    return listenSocket;
 }
 
 // Close sockets, free memory, destroy thread
 // control objects on process exit.
 void onClose(void) {
-    pthread_mutex_destroy(&currentConnectionLock);
-    pthread_cond_destroy(&currentConnectionWritten);
-    pthread_cond_destroy(&currentConnectionRead);
-
     if (!threads) {
         return;
     }
 
     for (int64_t i = 0; i < numThreads; ++i) {
         pthread_cancel(threads[i].thread);
-        buffer_delete(&threads[i].requestBuffer);
-        buffer_delete(&threads[i].responseBuffer);
-        buffer_delete(&threads[i].request.method);
         buffer_delete(&threads[i].request.path);
-        buffer_delete(&threads[i].request.version);
         buffer_delete(&threads[i].dirListingBuffer);
         buffer_delete(&threads[i].dirnameBuffer);
         buffer_delete(&threads[i].filenameBuffer);
-        close(threads[i].connection);
+        buffer_delete(&threads[i].nameListBuffer);
+        buffer_delete(&threads[i].sortBuffer);
+        buffer_delete(&threads[i].rangeHeadersBuffer);
+        buffer_delete(&threads[i].etagBuffer);
+        buffer_delete(&threads[i].cacheKeyBuffer);
+        buffer_delete(&threads[i].gzipBuffer);
+        gzipEncoder_delete(&threads[i].gzipEncoder);
+        connection_close(&threads[i].connection);
+        connection_delete(&threads[i].connection);
+
+        Connection* lists[] = { threads[i].connections, threads[i].freeConnections };
+        for (int32_t j = 0; j < 2; ++j) {
+            Connection* connection = lists[j];
+            while (connection) {
+                Connection* next = connection->next;
+                connection_close(connection);
+                connection_delete(connection);
+                free(connection);
+                connection = next;
+            }
+        }
+
+        if (threads[i].epoll != -1) {
+            close(threads[i].epoll);
+        }
+
+        ring_delete(&threads[i].ring);
+
+        if (threads[i].listenSocket != sock) {
+            close(threads[i].listenSocket);
+        }
+    }
+
+    // Write out whatever the threads logged before stopping.
+    if (accessLog.file != -1) {
+        if (accessLog.output.data) {
+            pthread_cancel(accessLog.thread);
+            pthread_join(accessLog.thread, NULL);
+            accessLog_drain(&accessLog);
+            buffer_delete(&accessLog.output);
+        }
+
+        if (accessLog.file != STDOUT_FILENO) {
+            close(accessLog.file);
+        }
+    }
+
+    for (int64_t i = 0; i < numThreads; ++i) {
+        logRing_delete(&threads[i].log);
     }
     free(threads);
 
-    close(sock);
+    connectionQueue_delete(&connectionQueue);
+    cache_delete(&fileCache);
+    cache_delete(&listingCache);
+    responseTemplates_delete();
+    mimeTable_delete(&mimeTypes);
+
+    if (sock != -1) {
+        close(sock);
+    }
 }
 
-// Ensure cleanup happens when we get 
+// Ensure cleanup happens when we get
 // signal that stops the process.
 void onSignal(int sig) {
     exit(0);
@@ -1332,7 +5448,26 @@ void onSignal(int sig) {
 // MAIN
 /////////////////////////////
 int main(int argc, char** argv) {
-    uint32_t port = 5000;
+    options.port = 5000;
+    options.queueDepth = CONNECTION_QUEUE_DEFAULT_DEPTH;
+    options.keepAliveTimeout = KEEP_ALIVE_DEFAULT_TIMEOUT;
+    options.maxRequests = KEEP_ALIVE_DEFAULT_MAX_REQUESTS;
+    options.requestMemory = REQUEST_MEMORY_DEFAULT;
+    options.accessLog = "-";
+    accessLog.file = -1;
+
+    // Buffers grow by doubling, so one that grows past
+    // BUFFER_RETAIN_SIZE gets at least twice that and its own
+    // mapping, and shrinking it gives the memory back to the
+    // system. By default, glibc raises the threshold once big
+    // blocks have been freed and keeps them in the thread's heap.
+    // Fixing it also fixes the heap trim threshold, which is
+    // raised so that the chunk buffers every streamed response
+    // allocates don't make the heap shrink and grow each time.
+#ifdef M_MMAP_THRESHOLD
+    mallopt(M_MMAP_THRESHOLD, BUFFER_RETAIN_SIZE * 2);
+    mallopt(M_TRIM_THRESHOLD, HEAP_TRIM_THRESHOLD);
+#endif
 
     // Figure out number of threads to use
     numThreads = NUM_THREADS;
@@ -1340,18 +5475,152 @@ int main(int argc, char** argv) {
         numThreads = 4;
     }
 
-    // Parse out optional port number
-    if (argc > 1) {
-        uint32_t argPort = string_toUint(argv[1]);
+    // Parse out options and optional port number
+    for (int32_t i = 1; i < argc; ++i) {
+        if (string_equals(argv[i], "--event-loop")) {
+            options.eventLoop = 1;
+            continue;
+        }
+
+        if (string_equals(argv[i], "--caching")) {
+            options.caching = 1;
+            continue;
+        }
+
+        if (string_equals(argv[i], "--gzip")) {
+            options.gzip = 1;
+            continue;
+        }
+
+        if (string_equals(argv[i], "--io-uring")) {
+            options.ioUring = 1;
+            continue;
+        }
+
+        if (string_equals(argv[i], "--metrics")) {
+            options.metrics = 1;
+            continue;
+        }
+
+        if (string_equals(argv[i], "--reuseport")) {
+            options.reusePort = 1;
+            continue;
+        }
+
+        if (string_equals(argv[i], "--queue-depth") && i + 1 < argc) {
+            uint32_t queueDepth = string_toUint(argv[++i]);
+
+            if (queueDepth > 0) {
+                options.queueDepth = queueDepth;
+            }
+            continue;
+        }
+
+        if (string_equals(argv[i], "--keep-alive-timeout") && i + 1 < argc) {
+            options.keepAliveTimeout = string_toUint(argv[++i]);
+            continue;
+        }
+
+        if (string_equals(argv[i], "--cache-size") && i + 1 < argc) {
+            options.cacheSize = string_toUint(argv[++i]);
+            continue;
+        }
+
+        if (string_equals(argv[i], "--request-memory") && i + 1 < argc) {
+            uint32_t requestMemory = string_toUint(argv[++i]);
+
+            if (requestMemory > 0) {
+                options.requestMemory = requestMemory;
+            }
+            continue;
+        }
+
+        if (string_equals(argv[i], "--mime-types") && i + 1 < argc) {
+            options.mimeTypes = argv[++i];
+            continue;
+        }
+
+        if (string_equals(argv[i], "--access-log") && i + 1 < argc) {
+            ++i;
+            options.accessLog = string_equals(argv[i], "off") ? 0 : argv[i];
+            continue;
+        }
+
+        if (string_equals(argv[i], "--log-format") && i + 1 < argc) {
+            ++i;
+
+            if (string_equals(argv[i], "combined")) {
+                options.logFormat = LOG_FORMAT_COMBINED;
+            } else if (string_equals(argv[i], "binary")) {
+                options.logFormat = LOG_FORMAT_BINARY;
+            } else {
+                options.logFormat = LOG_FORMAT_COMMON;
+            }
+            continue;
+        }
+
+        if (string_equals(argv[i], "--max-requests") && i + 1 < argc) {
+            uint32_t maxRequests = string_toUint(argv[++i]);
+
+            if (maxRequests > 0) {
+                options.maxRequests = maxRequests;
+            }
+            continue;
+        }
+
+        uint32_t argPort = string_toUint(argv[i]);
 
         if (argPort > 0) {
-            port = argPort;
+            options.port = argPort;
+        }
+    }
+
+    // Kernels without the io_uring features used get
+    // the other modes instead.
+    if (options.ioUring) {
+        Ring ring;
+
+        if (ring_init(&ring) == -1) {
+            perror("io_uring isn't available");
+            options.ioUring = 0;
         }
+
+        ring_delete(&ring);
+    }
+
+    printf("Starting cervit v" VERSION " on port %d using %d threads\n", options.port, (int32_t)numThreads);
+
+    if (options.ioUring) {
+        printf("Threads run their own io_uring loops\n");
+    } else if (options.eventLoop) {
+        printf("Threads run their own event loops\n");
+    }
+
+    if (options.reusePort) {
+        printf("Threads accept on their own listening sockets\n");
+    }
+
+    if (options.caching) {
+        printf("Clients may cache files and revalidate them\n");
+    }
+
+    if (options.gzip) {
+        printf("Compressing text responses with gzip\n");
+    }
+
+    if (options.cacheSize > 0) {
+        printf("Caching up to %d MB of files in memory\n", options.cacheSize);
+    }
+
+    if (options.metrics) {
+        printf("Serving metrics at %s\n", METRICS_PATH + 1);
     }
 
-    printf("Starting cervit v" VERSION " on port %d using %d threads\n", port, (int32_t)numThreads);
+    if (options.accessLog && !string_equals(options.accessLog, "-")) {
+        printf("Writing access log to %s\n", options.accessLog);
+    }
 
-    // Set up cleanup on exit 
+    // Set up cleanup on exit
     atexit(onClose);
     signal(SIGINT, onSignal);
     signal(SIGQUIT, onSignal);
@@ -1359,30 +5628,60 @@ int main(int argc, char** argv) {
     signal(SIGTSTP, onSignal);
     signal(SIGTERM, onSignal);
 
-    int8_t initError = 0;
+    // Clients closing early shouldn't kill the server.
+    signal(SIGPIPE, SIG_IGN);
 
-    // Set up thread control
-    int32_t errorCode = 0;
-    errorCode = pthread_mutex_init(&currentConnectionLock, NULL);
-    if (errorCode) {
-        fprintf(stderr, "Failed to create mutex. Error code: %d", errorCode);
-        initError = 1;
+    // Types from the system's mime.types are optional, but a
+    // file given on the command line has to be there.
+    mimeTable_init(&mimeTypes);
+    mimeTable_load(&mimeTypes, MIME_TYPES_SYSTEM_FILE);
+
+    if (options.mimeTypes && mimeTable_load(&mimeTypes, options.mimeTypes) == -1) {
+        perror("Failed to read mime types");
+        return 1;
+    }
+
+    // The access log is appended to, so several runs
+    // can share a file.
+    if (options.accessLog) {
+        accessLog.file = string_equals(options.accessLog, "-") ? STDOUT_FILENO : open(options.accessLog, O_WRONLY | O_APPEND | O_CREAT, 0644);
+
+        if (accessLog.file == -1) {
+            perror("Failed to open access log");
+            return 1;
+        }
     }
 
-    errorCode = pthread_cond_init(&currentConnectionWritten, NULL);
-    if (errorCode) {
-        fprintf(stderr, "Failed to create write condition. Error code: %d", errorCode);
-        initError = 1;
+    responseTemplates_init();
+    crc32_init();
+    scan_init(SCAN_AVX2);
+
+    if (options.cacheSize > 0) {
+        int64_t budget = (int64_t) options.cacheSize * 1024 * 1024;
+        cache_init(&fileCache, CACHE_FILE, budget, budget / 8 < CACHE_MAX_ENTRY_SIZE ? budget / 8 : CACHE_MAX_ENTRY_SIZE);
     }
 
-    errorCode = pthread_cond_init(&currentConnectionRead, NULL);
-    if (errorCode) {
-        fprintf(stderr, "Failed to create read condition. Error code: %d", errorCode);
-        initError = 1;
+    cache_init(&listingCache, CACHE_LISTING, LISTING_CACHE_SIZE, LISTING_CACHE_SIZE / 4);
+
+    int8_t initError = 0;
+    int32_t errorCode = 0;
+
+    // Set up thread control. Only blocking workers without
+    // their own listening sockets take connections from the
+    // main thread.
+    if (!options.eventLoop && !options.reusePort && !options.ioUring) {
+        connectionQueue_init(&connectionQueue, options.queueDepth);
     }
 
-    if (initError) {
-        return 1;
+    // Create listening sockets. In reuseport mode each
+    // thread gets its own, created once the threads are
+    // allocated.
+    sock = -1;
+    if (!options.reusePort) {
+        sock = createListeningSocket(options.port, 0, options.eventLoop);
+        if (sock == -1) {
+            return 1;
+        }
     }
 
     //Initialize threads
@@ -1395,82 +5694,143 @@ int main(int argc, char** argv) {
 
     for (int64_t i = 0; i < numThreads; ++i) {
         threads[i].id = i;
-        buffer_init(&threads[i].request.method, 16);
+        threads[i].epoll = -1;
+        memset(&threads[i].ring, 0, sizeof(Ring));
+        memset(&threads[i].metrics, 0, sizeof(Metrics));
+        threads[i].ring.fd = -1;
+        threads[i].log.records = 0;
+        threads[i].listenSocket = sock;
+        threads[i].connections = 0;
+        threads[i].lastConnection = 0;
+        threads[i].freeConnections = 0;
         buffer_init(&threads[i].request.path, 1024);
-        buffer_init(&threads[i].request.version, 16);
-        buffer_init(&threads[i].requestBuffer, 2048);
-        buffer_init(&threads[i].responseBuffer, 1024);
         buffer_init(&threads[i].dirListingBuffer, 512);
         buffer_init(&threads[i].dirnameBuffer, 512);
         buffer_init(&threads[i].filenameBuffer, 512);
-        errorCode = pthread_create(&threads[i].thread, NULL, handleRequest, &threads[i]);
-        if (errorCode) {
-            fprintf(stderr, "Failed to create thread. Error code: %d", errorCode);
-            initError = 1;
+        buffer_init(&threads[i].nameListBuffer, 512);
+        buffer_init(&threads[i].sortBuffer, 512);
+        buffer_init(&threads[i].rangeHeadersBuffer, 512);
+        buffer_init(&threads[i].etagBuffer, 64);
+        buffer_init(&threads[i].cacheKeyBuffer, 1024);
+        buffer_init(&threads[i].gzipBuffer, 1024);
+        connection_init(&threads[i].connection);
+
+        Buffer* scratch[NUM_SCRATCH_BUFFERS];
+        thread_scratchBuffers(&threads[i], scratch);
+        threads[i].requestMemory.limit = (int64_t) options.requestMemory * 1024 * 1024;
+        threads[i].requestMemory.used = 0;
+
+        for (int32_t j = 0; j < NUM_SCRATCH_BUFFERS; ++j) {
+            scratch[j]->budget = &threads[i].requestMemory;
         }
-    }
 
-    // Create listening socket
-    sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock == -1) {
-        perror("Failed to create socket");
-        initError = 1;
+        if (options.accessLog && logRing_init(&threads[i].log) == -1) {
+            fprintf(stderr, "Failed to allocate access log ring\n");
+            return 1;
+        }
+
+        threads[i].gzipEncoder.window = 0;
+        threads[i].gzipEncoder.head = 0;
+        threads[i].gzipEncoder.prev = 0;
+        threads[i].gzipEncoder.symbols = 0;
+
+        if (options.gzip && gzipEncoder_init(&threads[i].gzipEncoder) == -1) {
+            fprintf(stderr, "Failed to allocate gzip encoder\n");
+            return 1;
+        }
     }
 
-    if (initError) {
-        return 1;
+    for (int64_t i = 0; i < numThreads; ++i) {
+        if (options.reusePort) {
+            threads[i].listenSocket = createListeningSocket(options.port, 1, options.eventLoop);
+            if (threads[i].listenSocket == -1) {
+                return 1;
+            }
+        }
     }
 
-    // To prevent the socket from remaining occupied on exit.
-    int32_t sockoptTrue = 1;
-    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &sockoptTrue, sizeof(sockoptTrue)) == -1) {
-        perror("Failed to set socket options");
-        return 1;
+    // Start the logger before the threads that feed it. Anything
+    // printed so far goes out first if both write to stdout.
+    if (options.accessLog) {
+        fflush(stdout);
+        buffer_init(&accessLog.output, LOG_OUTPUT_SIZE);
+        errorCode = pthread_create(&accessLog.thread, NULL, handleAccessLog, &accessLog);
+
+        if (errorCode) {
+            fprintf(stderr, "Failed to create logger thread. Error code: %d", errorCode);
+            buffer_delete(&accessLog.output);
+            return 1;
+        }
     }
 
-    // Start listening on the socket.
-    struct sockaddr_in addr;
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = htons(port);
+    for (int64_t i = 0; i < numThreads; ++i) {
+        if (options.ioUring) {
+            if (ring_init(&threads[i].ring) == -1) {
+                perror("Failed to set up io_uring");
+                return 1;
+            }
 
-    if (bind(sock, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
-        perror("Failed to bind");
-        return 1;
+            errorCode = pthread_create(&threads[i].thread, NULL, handleRing, &threads[i]);
+        } else if (options.eventLoop) {
+            threads[i].epoll = epoll_create1(0);
+            if (threads[i].epoll == -1) {
+                perror("Failed to create epoll instance");
+                return 1;
+            }
+
+            // If the listening socket is shared, only wake one
+            // thread per incoming connection.
+            struct epoll_event event;
+            event.events = options.reusePort ? EPOLLIN : EPOLLIN | EPOLLEXCLUSIVE;
+            event.data.ptr = 0;
+
+            if (epoll_ctl(threads[i].epoll, EPOLL_CTL_ADD, threads[i].listenSocket, &event) == -1) {
+                perror("Failed to add socket to epoll");
+                return 1;
+            }
+
+            errorCode = pthread_create(&threads[i].thread, NULL, handleEvents, &threads[i]);
+        } else {
+            errorCode = pthread_create(&threads[i].thread, NULL, handleRequest, &threads[i]);
+        }
+
+        if (errorCode) {
+            fprintf(stderr, "Failed to create thread. Error code: %d", errorCode);
+            initError = 1;
+        }
     }
 
-    if (listen(sock, SOMAXCONN) == -1) {
-        perror("Failed to listen");
+    if (initError) {
         return 1;
     }
 
     printf("Socket listening\n");
+    fflush(stdout);
+
+    // Event loop, io_uring and reuseport threads accept
+    // their own connections.
+    if (options.eventLoop || options.ioUring || options.reusePort) {
+        for (int64_t i = 0; i < numThreads; ++i) {
+            pthread_join(threads[i].thread, NULL);
+        }
+
+        return 0;
+    }
 
     // Accepting socket
     int32_t connection;
 
     while(1) {
-        connection = accept(sock, 0, 0);
+        connection = accept4(sock, 0, 0, SOCK_NONBLOCK);
 
         if (connection == -1) {
             perror("Connection failed");
             continue;
         }
 
-        // Communication with worker threads.
-        // Pass accepted socket to worker.
-        pthread_mutex_lock(&currentConnectionLock);
-        currentConnection = connection;
-        currentConnectionWriteDone = 1;
-        pthread_mutex_unlock(&currentConnectionLock);
-        pthread_cond_signal(&currentConnectionWritten);
-
-        pthread_mutex_lock(&currentConnectionLock);
-        while(!currentConnectionReadDone) {
-            pthread_cond_wait(&currentConnectionRead, &currentConnectionLock);
-        }
-        currentConnectionReadDone = 0;
-        pthread_mutex_unlock(&currentConnectionLock);
+        // Pass accepted socket to workers. Only waits
+        // if the queue is full.
+        connectionQueue_push(&connectionQueue, connection);
     }
 
     return 0;
@@ -0,0 +1,1432 @@
+///////////////////////////////////////////////////////////////////////////////////
+// The MIT License (MIT)
+//
+// Copyright (c) 2018 Tarek Sherif
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of
+// this software and associated documentation files (the "Software"), to deal in
+// the Software without restriction, including without limitation the rights to
+// use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+// the Software, and to permit persons to whom the Software is furnished to do so,
+// subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+// COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+// IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+// CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+///////////////////////////////////////////////////////////////////////////////////
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "scan.h"
+#include "http.h"
+
+const char* MONTH_STRINGS[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+const char* CONTENT_TYPE_STRINGS[] = {
+    "application/octet-stream", "text/html", "application/javascript", "text/css", "text/xml", "application/json", "text/plain",
+    "image/jpeg", "image/png", "image/gif", "image/bmp", "image/svg+xml",
+    "video/ogg", "video/mp4", "video/mpeg", "video/quicktime",
+    "application/ogg", "audio/ogg", "audio/mpeg", "audio/wav",
+    "image/webp", "image/avif", "image/vnd.microsoft.icon", "video/webm",
+    "font/woff", "font/woff2", "font/ttf", "font/otf", "application/wasm", "application/pdf"
+};
+const char* CONTENT_TYPE_EXTENSIONS[] = {
+    "", "html htm", "js mjs", "css", "xml", "json", "txt",
+    "jpeg jpg", "png", "gif", "bmp", "svg",
+    "ogv", "mp4", "mpg mpeg", "mov",
+    "ogg", "oga", "mp3", "wav",
+    "webp", "avif", "ico", "webm",
+    "woff", "woff2", "ttf", "otf", "wasm", "pdf"
+};
+
+///////////////////////////////////////////////
+// STRINGS
+// A "string" is a null-terminated sequence
+// of chars.
+///////////////////////////////////////////////
+
+int64_t string_length(const char* string) {
+    int64_t length = 0;
+    while (string[length] != '\0') {
+        ++length;
+    }
+
+    return length;
+}
+
+int8_t string_equals(const char* string1, const char* string2) {
+    int64_t i = 0;
+    while (string1[i] != '\0' && string2[i] != '\0') {
+        if (string1[i] != string2[i]) {
+            return 0;
+        }
+        ++i;
+    }
+
+    return string1[i] == '\0' && string2[i] == '\0';
+}
+
+uint32_t string_toUint(const char* string) {
+    int64_t i = string_length(string) - 1;
+    uint32_t multiplier = 1;
+    uint32_t result = 0;
+    while (i >= 0) {
+        char c = string[i];
+        if (c < '0' || c > '9') {
+            return 0;
+        }
+        result += (string[i] - '0') * multiplier;
+        multiplier *= 10;
+        --i;
+    }
+
+    return result;
+}
+
+/////////////////////////////////////////////
+// ARRAYS
+// An "array" is a sequence of bytes (int8_t) 
+// and a length value indicating the number 
+// bytes in the sequence.
+/////////////////////////////////////////////
+
+int8_t array_equalsString(int8_t* array, int64_t length, char* string) {
+    int64_t i;
+    for (i = 0; i < length; ++i) {
+        int8_t c1 = array[i];
+        int8_t c2 = string[i];
+
+        if (c2 == '\0') {
+            // String was too short
+            return 0;
+        }
+
+        if (c1 != c2) {
+            return 0;
+        }
+    }
+
+    return string[i] == '\0';
+}
+
+int8_t array_caseEqualsString(int8_t* array, int64_t length, char* string) {
+    int8_t toLower = 'a' - 'A';
+    int64_t i;
+    for (i = 0; i < length; ++i) {
+        int8_t c1 = array[i];
+        int8_t c2 = string[i];
+
+        if (c2 == '\0') {
+            // String was too short
+            return 0;
+        }
+
+        if (c1 >= 'A' && c1 <= 'Z') {
+            c1 += toLower;
+        }
+
+        if (c2 >= 'A' && c2 <= 'Z') {
+            c2 += toLower;
+        }
+
+        if (c1 != c2) {
+            return 0;
+        }
+    }
+
+    return string[i] == '\0';
+}
+
+int8_t array_containsToken(int8_t* array, int64_t length, char* token) {
+    int64_t i = 0;
+    while (i < length) {
+        while (i < length && (array[i] == ' ' || array[i] == '\t')) {
+            ++i;
+        }
+
+        int64_t start = i;
+        while (i < length && array[i] != ',') {
+            ++i;
+        }
+
+        int64_t end = i;
+        while (end > start && (array[end - 1] == ' ' || array[end - 1] == '\t')) {
+            --end;
+        }
+
+        if (array_caseEqualsString(array + start, end - start, token)) {
+            return 1;
+        }
+
+        ++i;
+    }
+
+    return 0;
+}
+
+uint64_t array_hash(const int8_t* array, int64_t length) {
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (int64_t i = 0; i < length; ++i) {
+        hash ^= (uint8_t) array[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+///////////////////////////////////////////////
+// BUFFERS
+// Buffers are dynamic arrays that will
+// automatically allocate the memory required
+// to store data appended to them.
+///////////////////////////////////////////////
+
+void buffer_init(Buffer* buffer, int64_t size) {
+    buffer->data = malloc(size);
+    buffer->length = 0;
+    buffer->size = buffer->data ? size : 0;
+    buffer->budget = 0;
+    buffer->failed = buffer->data == 0;
+}
+
+void buffer_delete(Buffer* buffer) {
+    if (buffer->data == 0) {
+        return;
+    }
+    free(buffer->data);
+    buffer->data = 0;
+    buffer->length = 0;
+    buffer->size = 0;
+}
+
+int8_t buffer_checkAllocation(Buffer* buffer, int64_t requestedSize) {
+    if (requestedSize <= buffer->size) {
+        return 0;
+    }
+
+    int64_t newSize = buffer->size > 0 ? buffer->size : requestedSize;
+    int8_t* newData;
+    while (newSize < requestedSize) {
+        newSize <<= 1;
+    }
+
+    // Past the budget, grow by only as much as requested.
+    MemoryBudget* budget = buffer->budget;
+    if (budget && budget->used + newSize - buffer->size > budget->limit) {
+        newSize = requestedSize;
+
+        if (budget->used + newSize - buffer->size > budget->limit) {
+            buffer->failed = 1;
+            return -1;
+        }
+    }
+
+    newData = realloc(buffer->data, newSize);
+    if (!newData) {
+        buffer->failed = 1;
+        return -1;
+    }
+    if (budget) {
+        budget->used += newSize - buffer->size;
+    }
+    buffer->data = newData;
+    buffer->size = newSize;
+
+    return 0;
+}
+
+void buffer_reset(Buffer* buffer, int64_t retainSize) {
+    buffer->length = 0;
+    buffer->failed = 0;
+
+    if (buffer->size <= retainSize) {
+        return;
+    }
+
+    // The contents are discarded anyway, so a fresh allocation
+    // saves realloc copying them.
+    MemoryBudget* budget = buffer->budget;
+
+    free(buffer->data);
+    buffer_init(buffer, retainSize);
+    buffer->budget = budget;
+}
+
+void buffer_appendFromArray(Buffer* buffer, const int8_t* array, int64_t length) {
+    if (buffer->failed || buffer_checkAllocation(buffer, buffer->length + length) == -1) {
+        return;
+    }
+    memcpy(buffer->data + buffer->length, array, length);
+    buffer->length += length;
+}
+
+void buffer_appendFromChar(Buffer* buffer, char c) {
+    buffer_appendFromArray(buffer, (int8_t *)&c, 1);
+}
+
+void buffer_appendFromString(Buffer* buffer, const char* string) {
+    buffer_appendFromArray(buffer, (int8_t *)string, string_length(string));
+}
+
+void buffer_appendFromUint(Buffer* buffer, uint64_t n) {
+    int8_t result[20];
+    int64_t i = 20;
+
+    do {
+        result[--i] = '0' + n % 10;
+        n /= 10;
+    } while (n > 0);
+
+    buffer_appendFromArray(buffer, result + i, 20 - i);
+}
+
+void buffer_appendFromHex(Buffer* buffer, uint64_t n) {
+    int8_t result[16];
+    int64_t i = 16;
+
+    do {
+        result[--i] = "0123456789abcdef"[n & 0xf];
+        n >>= 4;
+    } while (n > 0);
+
+    buffer_appendFromArray(buffer, result + i, 16 - i);
+}
+
+int8_t buffer_externalNull(Buffer* buffer) {
+    // If buffer isn't currently null-terminated, add null
+    // in first unused byte for the read.
+    if (buffer->data[buffer->length - 1] != '\0') {
+        if (buffer_checkAllocation(buffer, buffer->length + 1) == -1) {
+            return -1;
+        }
+
+        buffer->data[buffer->length] = '\0';
+    }
+
+    return 0;
+}
+
+//////////////////////////////////////////
+// CONTENT TYPES
+//
+// Content types are picked by file
+// extension from a hash table filled in
+// at startup with the built-in types,
+// then the system's mime.types file and
+// any given with --mime-types.
+//////////////////////////////////////////
+
+int8_t isMimeTypeCompressible(int8_t* name, int64_t length) {
+    return (length > 5 && array_caseEqualsString(name, 5, "text/")) ||
+        (length > 5 && array_caseEqualsString(name + length - 5, 5, "+json")) ||
+        (length > 4 && array_caseEqualsString(name + length - 4, 4, "+xml")) ||
+        array_caseEqualsString(name, length, "application/javascript") ||
+        array_caseEqualsString(name, length, "application/json") ||
+        array_caseEqualsString(name, length, "application/xml");
+}
+
+ContentType* mimeTable_type(MimeTable* table, int32_t contentType) {
+    return (ContentType*) table->types.data + contentType;
+}
+
+int32_t mimeTable_typeCount(MimeTable* table) {
+    return table->types.length / sizeof(ContentType);
+}
+
+int32_t mimeTable_makeKey(char* key, const int8_t* extension, int64_t length) {
+    if (length == 0 || length >= MIME_EXTENSION_SIZE) {
+        return -1;
+    }
+
+    memset(key, 0, MIME_EXTENSION_SIZE);
+
+    for (int64_t i = 0; i < length; ++i) {
+        char c = extension[i];
+        key[i] = c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+    }
+
+    return 0;
+}
+
+MimeSlot* mimeTable_findSlot(MimeTable* table, const char* key) {
+    int64_t index = array_hash((const int8_t*) key, string_length(key)) & table->mask;
+
+    while (table->slots[index].contentType != -1 && memcmp(table->slots[index].extension, key, MIME_EXTENSION_SIZE) != 0) {
+        index = (index + 1) & table->mask;
+    }
+
+    return &table->slots[index];
+}
+
+void mimeTable_allocateSlots(MimeTable* table, int64_t slotCount) {
+    table->slots = malloc(slotCount * sizeof(MimeSlot));
+
+    if (!table->slots) {
+        fprintf(stderr, "mimeTable_allocateSlots: Out of memory\n");
+        exit(1);
+    }
+
+    for (int64_t i = 0; i < slotCount; ++i) {
+        table->slots[i].contentType = -1;
+    }
+
+    table->mask = slotCount - 1;
+}
+
+void mimeTable_grow(MimeTable* table) {
+    MimeSlot* oldSlots = table->slots;
+    int64_t oldCount = table->mask + 1;
+
+    mimeTable_allocateSlots(table, oldCount * 2);
+
+    for (int64_t i = 0; i < oldCount; ++i) {
+        if (oldSlots[i].contentType != -1) {
+            *mimeTable_findSlot(table, oldSlots[i].extension) = oldSlots[i];
+        }
+    }
+
+    free(oldSlots);
+}
+
+void mimeTable_setExtension(MimeTable* table, const int8_t* extension, int64_t length, int32_t contentType) {
+    char key[MIME_EXTENSION_SIZE];
+
+    if (mimeTable_makeKey(key, extension, length) == -1) {
+        return;
+    }
+
+    if ((table->count + 1) * 2 > table->mask + 1) {
+        mimeTable_grow(table);
+    }
+
+    MimeSlot* slot = mimeTable_findSlot(table, key);
+
+    if (slot->contentType == -1) {
+        memcpy(slot->extension, key, MIME_EXTENSION_SIZE);
+        ++table->count;
+    }
+
+    slot->contentType = contentType;
+}
+
+void mimeTable_setExtensions(MimeTable* table, const int8_t* list, int64_t length, int32_t contentType) {
+    int64_t i = 0;
+
+    while (i < length) {
+        while (i < length && (list[i] == ' ' || list[i] == '\t')) {
+            ++i;
+        }
+
+        int64_t start = i;
+        while (i < length && list[i] != ' ' && list[i] != '\t') {
+            ++i;
+        }
+
+        if (i > start) {
+            mimeTable_setExtension(table, list + start, i - start, contentType);
+        }
+    }
+}
+
+int32_t mimeTable_addType(MimeTable* table, int8_t* name, int64_t length) {
+    int32_t count = mimeTable_typeCount(table);
+
+    for (int32_t i = 0; i < count; ++i) {
+        Buffer* typeName = &mimeTable_type(table, i)->name;
+
+        if (typeName->length == length && memcmp(typeName->data, name, length) == 0) {
+            return i;
+        }
+    }
+
+    ContentType type;
+    buffer_init(&type.name, length + 1);
+    buffer_appendFromArray(&type.name, name, length);
+    type.headers.data = 0;
+    type.headers.length = 0;
+    type.headers.size = 0;
+    type.headers.budget = 0;
+    type.headers.failed = 0;
+    type.compressible = isMimeTypeCompressible(name, length);
+    buffer_appendFromArray(&table->types, (int8_t *) &type, sizeof(ContentType));
+
+    return count;
+}
+
+void mimeTable_parse(MimeTable* table, int8_t* data, int64_t length) {
+    int64_t i = 0;
+
+    while (i < length) {
+        int64_t lineEnd = i;
+        while (lineEnd < length && data[lineEnd] != '\n' && data[lineEnd] != '#') {
+            ++lineEnd;
+        }
+
+        while (i < lineEnd && (data[i] == ' ' || data[i] == '\t')) {
+            ++i;
+        }
+
+        int64_t nameStart = i;
+        while (i < lineEnd && data[i] != ' ' && data[i] != '\t' && data[i] != '\r') {
+            ++i;
+        }
+
+        int64_t nameLength = i - nameStart;
+
+        // Trailing carriage returns aren't part of the last extension.
+        int64_t extensionsEnd = lineEnd;
+        while (extensionsEnd > i && (data[extensionsEnd - 1] == '\r' || data[extensionsEnd - 1] == ' ' || data[extensionsEnd - 1] == '\t')) {
+            --extensionsEnd;
+        }
+
+        // Types without extensions can't be picked, so they
+        // aren't added.
+        if (nameLength > 0 && extensionsEnd > i) {
+            int32_t contentType = mimeTable_addType(table, data + nameStart, nameLength);
+            mimeTable_setExtensions(table, data + i, extensionsEnd - i, contentType);
+        }
+
+        i = lineEnd;
+        while (i < length && data[i] != '\n') {
+            ++i;
+        }
+        ++i;
+    }
+}
+
+void mimeTable_init(MimeTable* table) {
+    buffer_init(&table->types, NUM_BUILTIN_CONTENT_TYPES * 2 * sizeof(ContentType));
+    mimeTable_allocateSlots(table, MIME_TABLE_INITIAL_SLOTS);
+    table->count = 0;
+
+    for (int32_t i = 0; i < NUM_BUILTIN_CONTENT_TYPES; ++i) {
+        int32_t contentType = mimeTable_addType(table, (int8_t *) CONTENT_TYPE_STRINGS[i], string_length(CONTENT_TYPE_STRINGS[i]));
+        mimeTable_setExtensions(table, (int8_t *) CONTENT_TYPE_EXTENSIONS[i], string_length(CONTENT_TYPE_EXTENSIONS[i]), contentType);
+    }
+}
+
+int32_t mimeTable_load(MimeTable* table, const char* filename) {
+    int32_t fd = open(filename, O_RDONLY);
+
+    if (fd == -1) {
+        return -1;
+    }
+
+    Buffer contents;
+    buffer_init(&contents, 64 * 1024);
+
+    while (1) {
+        if (buffer_checkAllocation(&contents, contents.length + 4096) == -1) {
+            close(fd);
+            buffer_delete(&contents);
+            return -1;
+        }
+
+        int64_t bytesRead = read(fd, contents.data + contents.length, contents.size - contents.length);
+
+        if (bytesRead == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytesRead == -1) {
+            close(fd);
+            buffer_delete(&contents);
+            return -1;
+        }
+
+        if (bytesRead == 0) {
+            break;
+        }
+
+        contents.length += bytesRead;
+    }
+
+    close(fd);
+    mimeTable_parse(table, contents.data, contents.length);
+    buffer_delete(&contents);
+
+    return 0;
+}
+
+void mimeTable_delete(MimeTable* table) {
+    if (!table->types.data) {
+        return;
+    }
+
+    int32_t count = mimeTable_typeCount(table);
+
+    for (int32_t i = 0; i < count; ++i) {
+        buffer_delete(&mimeTable_type(table, i)->name);
+    }
+
+    buffer_delete(&table->types);
+    free(table->slots);
+    table->slots = 0;
+}
+
+int32_t contentTypeFromBuffer(MimeTable* table, Buffer* filename) {
+    int64_t offset = filename->length - 1;
+
+    while (offset >= 0 && filename->data[offset] != '.' && filename->data[offset] != '/') {
+        --offset;
+    }
+
+    char key[MIME_EXTENSION_SIZE];
+
+    if (offset < 0 || filename->data[offset] != '.' || mimeTable_makeKey(key, filename->data + offset + 1, filename->length - offset - 1) == -1) {
+        return CONTENT_TYPE_OCTET_STREAM;
+    }
+
+    MimeSlot* slot = mimeTable_findSlot(table, key);
+
+    return slot->contentType != -1 ? slot->contentType : CONTENT_TYPE_OCTET_STREAM;
+}
+
+/////////////////////////////////
+// PARSING UTILITY FUNCTIONS
+/////////////////////////////////
+
+int8_t parseURIHexCodeFromArray(const int8_t* array) {
+    int8_t result = 0;
+    int32_t multiplier = 16;
+    for (int64_t i = 0; i < 2; ++i) {
+        int8_t c = array[i];
+
+        if (c >= 'A' && c <= 'F') {
+            result += multiplier * (10 + c - 'A');
+        } else if (c >= 'a' && c <= 'f') {
+            result += multiplier * (10 + c - 'a');
+        } else if (c >= '0' && c <= '9') {
+            result += multiplier * (c - '0');
+        } else {
+            return '\0';
+        }
+
+        multiplier >>= 4;
+    }
+
+    return result;
+}
+
+int64_t skipArraySpaces(int8_t* array, int64_t length) {
+    int64_t i = 0;
+    while (i < length) {
+        int8_t c = array[i];
+
+        if (c != ' ' && c != '\t') {
+            break;
+        }
+
+        ++i;
+    }
+
+    return i;
+}
+
+int8_t hexDecodeBuffer(Buffer* buffer) {
+    int8_t* path = buffer->data;
+    int64_t length = buffer->length;
+    
+    int64_t readIndex = 0;
+    int64_t writeIndex = 0;
+
+    while (readIndex < length) {
+        if (path[readIndex] != '%') {
+            path[writeIndex] = path[readIndex];
+            ++readIndex;
+            ++writeIndex;
+            continue;
+        }
+
+        if (readIndex + 2 >= length) {
+            return -1;
+        }
+
+        int8_t c = parseURIHexCodeFromArray(path + readIndex + 1);
+        if (c > 0) {
+            path[writeIndex] = c;
+            readIndex += 3;
+            ++writeIndex;
+        } else {
+            return -1;
+        }
+    }
+
+    buffer->length = writeIndex;
+
+    return 0;
+}
+
+void removeBufferDotSegments(Buffer* buffer) {
+    // Skip ./ prefix
+    int8_t* path = buffer->data + 2;
+    int64_t length = buffer-> length - 2;
+    
+    int64_t readIndex = 0;
+    int64_t writeIndex = 0;
+    int8_t c1, c2, c3;
+
+    while (readIndex < length) {
+        c1 = path[readIndex];
+
+        // Only interested in segments beginning with '.'
+        if (c1 != '.' || (readIndex > 0 && path[readIndex - 1] != '/')) {
+            path[writeIndex] = path[readIndex];
+            ++readIndex;
+            ++writeIndex;
+            continue;
+        }
+
+        if (readIndex + 1 == length) {
+            break;
+        }
+
+        c2 = path[readIndex + 1];
+        
+        if (c2 == '/') {
+            readIndex += 2;
+        } else if (c2 == '.') { 
+            if (readIndex + 2 == length) {
+                break;
+            }
+
+            c3 = path[readIndex + 2];
+
+            if (c3 == '/') {
+                readIndex += 3;
+
+                if (writeIndex > 0) {
+                    --writeIndex;
+                    while (writeIndex > 0 && path[writeIndex - 1] != '/') {
+                        --writeIndex;
+                    } 
+                }
+            } else {
+                path[writeIndex] = path[readIndex];
+                path[writeIndex + 1] = path[readIndex + 1];
+                readIndex += 2;
+                writeIndex += 2;
+            }
+
+        } else {
+            path[writeIndex] = path[readIndex];
+            ++readIndex;
+            ++writeIndex;
+        }
+
+    }
+
+    buffer->length = writeIndex + 2;
+}
+
+int32_t openFileFromBuffer(Buffer* buffer, int64_t flags) {
+    if (buffer_externalNull(buffer) == -1) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    return open((const char*)buffer->data, flags);
+}
+
+int32_t statFileFromBuffer(Buffer* buffer, struct stat *fileInfo) {
+    if (buffer_externalNull(buffer) == -1) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    return stat((const char*)buffer->data, fileInfo);
+}
+
+int32_t methodCodeFromSlice(Slice* method) {
+    if (array_caseEqualsString(method->data, method->length, "GET")) {
+        return HTTP_METHOD_GET;
+    }
+
+    if (array_caseEqualsString(method->data, method->length, "HEAD")) {
+        return HTTP_METHOD_HEAD;
+    }
+
+    return HTTP_METHOD_UNSUPPORTED;
+}
+
+int32_t parseAcceptEncodingsFromArray(int8_t* array, int64_t length) {
+    int32_t accepted = 0;
+    int32_t listed = 0;
+    int8_t anyAccepted = 0;
+
+    while (length > 0) {
+        int64_t index = array_findFromCharSet(array, length, ",");
+        int64_t elementLength = index == -1 ? length : index;
+        int8_t* element = array;
+
+        array += elementLength;
+        length -= elementLength;
+        if (length > 0) {
+            ++array;
+            --length;
+        }
+
+        index = skipArraySpaces(element, elementLength);
+        element += index;
+        elementLength -= index;
+
+        int64_t tokenLength = array_findFromCharSet(element, elementLength, "; \t");
+        if (tokenLength == -1) {
+            tokenLength = elementLength;
+        }
+
+        // Look for a zero q-value, e.g. "gzip;q=0" or "gzip; q=0.000".
+        int8_t refused = 0;
+        int8_t* parameters = element + tokenLength;
+        int64_t parametersLength = elementLength - tokenLength;
+
+        while (parametersLength > 1) {
+            if ((parameters[0] == 'q' || parameters[0] == 'Q') && parameters[1] == '=') {
+                refused = parametersLength > 2 && parameters[2] == '0';
+
+                for (int64_t i = 3; refused && i < parametersLength && parameters[i] != ' ' && parameters[i] != '\t' && parameters[i] != ';'; ++i) {
+                    if (parameters[i] != '0' && parameters[i] != '.') {
+                        refused = 0;
+                    }
+                }
+                break;
+            }
+
+            ++parameters;
+            --parametersLength;
+        }
+
+        int32_t encoding = -1;
+
+        if (array_caseEqualsString(element, tokenLength, "gzip") || array_caseEqualsString(element, tokenLength, "x-gzip")) {
+            encoding = CONTENT_ENCODING_GZIP;
+        } else if (array_caseEqualsString(element, tokenLength, "br")) {
+            encoding = CONTENT_ENCODING_BR;
+        } else if (array_equalsString(element, tokenLength, "*")) {
+            anyAccepted = !refused;
+            continue;
+        }
+
+        if (encoding != -1) {
+            listed |= 1 << encoding;
+
+            if (!refused) {
+                accepted |= 1 << encoding;
+            }
+        }
+    }
+
+    if (anyAccepted) {
+        accepted |= ((1 << NUM_CONTENT_ENCODINGS) - 1) & ~listed;
+    }
+
+    return accepted & ~(1 << CONTENT_ENCODING_IDENTITY);
+}
+
+int32_t headerNameFromArray(int8_t* key, int64_t length) {
+    switch (length) {
+        case 4:
+            return array_caseEqualsString(key, length, "Host") ? HEADER_HOST : HEADER_OTHER;
+        case 5:
+            return array_caseEqualsString(key, length, "Range") ? HEADER_RANGE : HEADER_OTHER;
+        case 8:
+            return array_caseEqualsString(key, length, "If-Range") ? HEADER_IF_RANGE : HEADER_OTHER;
+        case 7:
+            return array_caseEqualsString(key, length, "Referer") ? HEADER_REFERER : HEADER_OTHER;
+        case 10:
+            if (array_caseEqualsString(key, length, "Connection")) {
+                return HEADER_CONNECTION;
+            }
+
+            return array_caseEqualsString(key, length, "User-Agent") ? HEADER_USER_AGENT : HEADER_OTHER;
+        case 13:
+            return array_caseEqualsString(key, length, "If-None-Match") ? HEADER_IF_NONE_MATCH : HEADER_OTHER;
+        case 14:
+            return array_caseEqualsString(key, length, "Content-Length") ? HEADER_CONTENT_LENGTH : HEADER_OTHER;
+        case 15:
+            return array_caseEqualsString(key, length, "Accept-Encoding") ? HEADER_ACCEPT_ENCODING : HEADER_OTHER;
+        case 17:
+            if (array_caseEqualsString(key, length, "If-Modified-Since")) {
+                return HEADER_IF_MODIFIED_SINCE;
+            }
+
+            return array_caseEqualsString(key, length, "Transfer-Encoding") ? HEADER_TRANSFER_ENCODING : HEADER_OTHER;
+        default:
+            return HEADER_OTHER;
+    }
+}
+
+void requestParser_reset(RequestParser* parser) {
+    parser->state = PARSE_START;
+    parser->position = 0;
+    parser->headerCount = 0;
+
+    for (int32_t i = 0; i < NUM_HEADER_NAMES; ++i) {
+        parser->first[i] = -1;
+        parser->last[i] = -1;
+    }
+}
+
+int8_t requestParser_addHeader(RequestParser* parser, int8_t* data, Span value) {
+    if (parser->headerCount == REQUEST_MAX_HEADERS) {
+        return -1;
+    }
+
+    int32_t index = parser->headerCount++;
+    int32_t name = headerNameFromArray(data + parser->key.offset, parser->key.length);
+    HeaderField* header = &parser->headers[index];
+
+    header->key = parser->key;
+    header->value = value;
+    header->next = -1;
+
+    if (name == HEADER_OTHER) {
+        return 0;
+    }
+
+    if (parser->last[name] == -1) {
+        parser->first[name] = index;
+    } else {
+        parser->headers[parser->last[name]].next = index;
+    }
+
+    parser->last[name] = index;
+
+    return 0;
+}
+
+int32_t requestParser_parse(RequestParser* parser, int8_t* data, int64_t length) {
+    int64_t i = parser->position;
+
+    while (i < length && parser->state != PARSE_DONE && parser->state != PARSE_ERROR) {
+        int8_t c = data[i];
+        int64_t index;
+
+        switch (parser->state) {
+            // Ignore empty lines before the request line (RFC 7230, 3.5).
+            // Clients sometimes send one after a request.
+            case PARSE_START:
+                if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+                    ++i;
+                } else {
+                    parser->tokenStart = i;
+                    parser->state = PARSE_METHOD;
+                }
+                break;
+
+            case PARSE_BEFORE_TARGET:
+            case PARSE_BEFORE_VERSION:
+                if (c == ' ' || c == '\t') {
+                    ++i;
+                } else if (c == '\r' || c == '\n') {
+                    parser->state = PARSE_ERROR;
+                } else {
+                    parser->tokenStart = i;
+                    parser->state = parser->state == PARSE_BEFORE_TARGET ? PARSE_TARGET : PARSE_VERSION;
+                }
+                break;
+
+            case PARSE_METHOD:
+            case PARSE_TARGET:
+            case PARSE_VERSION: {
+                index = array_findFromCharSet(data + i, length - i, BYTESET_TOKEN_END);
+                if (index == -1) {
+                    i = length;
+                    break;
+                }
+
+                i += index;
+                Span token = { parser->tokenStart, i - parser->tokenStart };
+
+                if (parser->state == PARSE_METHOD) {
+                    parser->method = token;
+                    parser->state = PARSE_BEFORE_TARGET;
+                } else if (parser->state == PARSE_TARGET) {
+                    parser->target = token;
+                    parser->state = PARSE_BEFORE_VERSION;
+                } else {
+                    parser->version = token;
+                    parser->state = PARSE_REQUEST_LINE_END;
+                }
+                break;
+            }
+
+            case PARSE_REQUEST_LINE_END:
+                if (c == ' ' || c == '\t') {
+                    ++i;
+                } else if (c == '\r') {
+                    parser->state = PARSE_LINE_FEED;
+                    ++i;
+                } else if (c == '\n') {
+                    parser->state = PARSE_LINE_START;
+                    ++i;
+                } else {
+                    parser->state = PARSE_ERROR;
+                }
+                break;
+
+            // A line is either a header or the empty line
+            // ending the headers. One starting with whitespace
+            // would continue the previous header's value
+            // (obs-fold), which is rejected (RFC 7230, 3.2.4).
+            case PARSE_LINE_START:
+                if (c == '\r') {
+                    parser->state = PARSE_END_LINE_FEED;
+                    ++i;
+                } else if (c == '\n') {
+                    parser->state = PARSE_DONE;
+                    ++i;
+                } else if (c == ' ' || c == '\t') {
+                    parser->state = PARSE_ERROR;
+                } else {
+                    parser->tokenStart = i;
+                    parser->state = PARSE_HEADER_KEY;
+                }
+                break;
+
+            // Colon has to come immediately after header key (RFC 7230, 3.2.4)
+            case PARSE_HEADER_KEY:
+                index = array_findFromCharSet(data + i, length - i, BYTESET_HEADER_KEY_END);
+                if (index == -1) {
+                    i = length;
+                    break;
+                }
+
+                i += index;
+
+                if (data[i] != ':' || i == parser->tokenStart) {
+                    parser->state = PARSE_ERROR;
+                    break;
+                }
+
+                parser->key.offset = parser->tokenStart;
+                parser->key.length = i - parser->tokenStart;
+                parser->state = PARSE_BEFORE_VALUE;
+                ++i;
+                break;
+
+            case PARSE_BEFORE_VALUE:
+                if (c == ' ' || c == '\t') {
+                    ++i;
+                } else {
+                    parser->tokenStart = i;
+                    parser->state = PARSE_HEADER_VALUE;
+                }
+                break;
+
+            case PARSE_HEADER_VALUE: {
+                index = array_findFromCharSet(data + i, length - i, HTTP_NEWLINE);
+                if (index == -1) {
+                    i = length;
+                    break;
+                }
+
+                i += index;
+
+                // Trailing whitespace isn't part of the value.
+                int64_t end = i;
+                while (end > parser->tokenStart && (data[end - 1] == ' ' || data[end - 1] == '\t')) {
+                    --end;
+                }
+
+                Span value = { parser->tokenStart, end - parser->tokenStart };
+
+                if (requestParser_addHeader(parser, data, value) == -1) {
+                    parser->state = PARSE_ERROR;
+                    break;
+                }
+
+                parser->state = data[i] == '\r' ? PARSE_LINE_FEED : PARSE_LINE_START;
+                ++i;
+                break;
+            }
+
+            case PARSE_LINE_FEED:
+            case PARSE_END_LINE_FEED:
+                if (c != '\n') {
+                    parser->state = PARSE_ERROR;
+                    break;
+                }
+
+                parser->state = parser->state == PARSE_LINE_FEED ? PARSE_LINE_START : PARSE_DONE;
+                ++i;
+                break;
+        }
+    }
+
+    parser->position = i;
+
+    return parser->state;
+}
+
+Slice slice_fromSpan(int8_t* data, Span span) {
+    Slice slice = { data + span.offset, span.length };
+
+    return slice;
+}
+
+Slice request_header(Request* request, int32_t index) {
+    return slice_fromSpan(request->data, request->parser->headers[index].value);
+}
+
+Slice request_lastHeader(Request* request, int32_t name) {
+    int32_t index = request->parser->last[name];
+
+    if (index == -1) {
+        Slice empty = { request->data, 0 };
+        return empty;
+    }
+
+    return request_header(request, index);
+}
+
+int8_t request_fromParser(Request* request, RequestParser* parser, int8_t* data) {
+    request->parser = parser;
+    request->data = data;
+    request->method = slice_fromSpan(data, parser->method);
+    request->version = slice_fromSpan(data, parser->version);
+
+    // Keep the query (?) and skip the fragment (#), if they exist.
+    Slice target = slice_fromSpan(data, parser->target);
+    int64_t pathLength = array_findFromCharSet(target.data, target.length, "?#");
+    if (pathLength == -1) {
+        pathLength = target.length;
+    }
+
+    request->query.data = target.data + pathLength;
+    request->query.length = 0;
+
+    if (pathLength < target.length && target.data[pathLength] == '?') {
+        int64_t queryLength = array_findFromCharSet(target.data + pathLength + 1, target.length - pathLength - 1, "#");
+
+        request->query.data = target.data + pathLength + 1;
+        request->query.length = queryLength == -1 ? target.length - pathLength - 1 : queryLength;
+    }
+
+    request->path.length = 0;
+    buffer_appendFromChar(&request->path, '.');
+    buffer_appendFromArray(&request->path, target.data, pathLength);
+
+    if (hexDecodeBuffer(&request->path) == -1) {
+        return -1;
+    }
+    removeBufferDotSegments(&request->path);
+
+    request->range = request_lastHeader(request, HEADER_RANGE);
+    request->ifRange = request_lastHeader(request, HEADER_IF_RANGE);
+    request->ifModifiedSince = request_lastHeader(request, HEADER_IF_MODIFIED_SINCE);
+
+    // Repeated headers combine into one list (RFC 7230, 3.2.2).
+    request->acceptEncodings = 0;
+    for (int32_t i = parser->first[HEADER_ACCEPT_ENCODING]; i != -1; i = parser->headers[i].next) {
+        Slice value = request_header(request, i);
+        request->acceptEncodings |= parseAcceptEncodingsFromArray(value.data, value.length);
+    }
+
+    // HTTP/1.1 connections are persistent unless the client sends
+    // "Connection: close" (RFC 7230, 6.3).
+    request->keepAlive = 1;
+    for (int32_t i = parser->first[HEADER_CONNECTION]; i != -1; i = parser->headers[i].next) {
+        Slice value = request_header(request, i);
+
+        if (array_containsToken(value.data, value.length, "close")) {
+            request->keepAlive = 0;
+        }
+    }
+
+    // We don't read request bodies, so we can't tell where
+    // the next request would start.
+    Slice contentLength = request_lastHeader(request, HEADER_CONTENT_LENGTH);
+
+    if (parser->first[HEADER_TRANSFER_ENCODING] != -1 || (parser->first[HEADER_CONTENT_LENGTH] != -1 && !array_equalsString(contentLength.data, contentLength.length, "0"))) {
+        request->keepAlive = 0;
+    }
+
+    // "Host" is required, respond with 400 if not
+    // found (RFC 7230, 5.4).
+    if (parser->first[HEADER_HOST] == -1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int64_t array_parseUint(int8_t* array, int64_t length, int64_t* value) {
+    int64_t i = 0;
+    *value = 0;
+
+    while (i < length && array[i] >= '0' && array[i] <= '9') {
+        if (i == 18) {
+            return -1;
+        }
+
+        *value = *value * 10 + (array[i] - '0');
+        ++i;
+    }
+
+    return i > 0 ? i : -1;
+}
+
+void parseListingQuery(Slice* query, int64_t* offset, int64_t* limit, int32_t* format) {
+    int8_t* array = query->data;
+    int64_t length = query->length;
+
+    *offset = 0;
+    *limit = -1;
+    *format = LISTING_HTML;
+
+    while (length > 0) {
+        int64_t parameterLength = array_findFromCharSet(array, length, "&;");
+        if (parameterLength == -1) {
+            parameterLength = length;
+        }
+
+        int64_t keyLength = array_findFromCharSet(array, parameterLength, "=");
+
+        if (keyLength != -1) {
+            int8_t* value = array + keyLength + 1;
+            int64_t valueLength = parameterLength - keyLength - 1;
+            int64_t number;
+
+            if (array_equalsString(array, keyLength, "offset") && array_parseUint(value, valueLength, &number) == valueLength) {
+                *offset = number;
+            } else if (array_equalsString(array, keyLength, "limit") && array_parseUint(value, valueLength, &number) == valueLength) {
+                *limit = number;
+            } else if (array_equalsString(array, keyLength, "format")) {
+                if (array_equalsString(value, valueLength, "json")) {
+                    *format = LISTING_JSON;
+                } else if (array_equalsString(value, valueLength, "html")) {
+                    *format = LISTING_HTML;
+                }
+            }
+        }
+
+        if (parameterLength == length) {
+            break;
+        }
+
+        array += parameterLength + 1;
+        length -= parameterLength + 1;
+    }
+}
+
+int32_t parseRangesFromSlice(Slice* range, int64_t size, ByteRange* ranges) {
+    int8_t* string = range->data;
+    int64_t length = range->length;
+    int64_t unitLength = string_length(HTTP_RANGE_UNIT "=");
+    int32_t count = 0;
+    int8_t found = 0;
+
+    if (length < unitLength || !array_caseEqualsString(string, unitLength, HTTP_RANGE_UNIT "=")) {
+        return 0;
+    }
+
+    string += unitLength;
+    length -= unitLength;
+
+    while (length > 0) {
+        int64_t index = skipArraySpaces(string, length);
+        string += index;
+        length -= index;
+
+        // Empty list elements are allowed (RFC 7230, 7).
+        if (length > 0 && *string == ',') {
+            ++string;
+            --length;
+            continue;
+        }
+
+        if (length == 0) {
+            break;
+        }
+
+        int64_t first = -1;
+        int64_t last = -1;
+
+        if (*string != '-') {
+            index = array_parseUint(string, length, &first);
+            if (index == -1) {
+                return 0;
+            }
+            string += index;
+            length -= index;
+        }
+
+        if (length == 0 || *string != '-') {
+            return 0;
+        }
+
+        ++string;
+        --length;
+
+        if (length > 0 && *string >= '0' && *string <= '9') {
+            index = array_parseUint(string, length, &last);
+            if (index == -1) {
+                return 0;
+            }
+            string += index;
+            length -= index;
+        }
+
+        index = skipArraySpaces(string, length);
+        string += index;
+        length -= index;
+
+        if (length > 0 && *string != ',') {
+            return 0;
+        }
+
+        if (first == -1 && last == -1) {
+            return 0;
+        }
+
+        if (first != -1 && last != -1 && last < first) {
+            return 0;
+        }
+
+        found = 1;
+
+        // Suffix range: the last "last" bytes.
+        if (first == -1) {
+            if (last == 0 || size == 0) {
+                continue;
+            }
+
+            first = last < size ? size - last : 0;
+            last = size - 1;
+        }
+
+        if (first >= size) {
+            continue;
+        }
+
+        if (last == -1 || last >= size) {
+            last = size - 1;
+        }
+
+        if (count == RANGE_MAX_COUNT) {
+            return 0;
+        }
+
+        ranges[count].offset = first;
+        ranges[count].length = last - first + 1;
+        ++count;
+    }
+
+    if (!found) {
+        return 0;
+    }
+
+    return count > 0 ? count : -1;
+}
+
+int8_t parseHttpDateFromArray(int8_t* array, int64_t length, time_t* t) {
+    if (length != HTTP_DATE_LENGTH || array[3] != ',' || array[4] != ' ' || array[7] != ' ' || array[11] != ' ' || array[16] != ' ' || array[19] != ':' || array[22] != ':' || !array_equalsString(array + 25, 4, " GMT")) {
+        return -1;
+    }
+
+    int32_t digitOffsets[] = { 5, 12, 17, 20, 23 };
+    int32_t digitLengths[] = { 2, 4, 2, 2, 2 };
+    int64_t values[5];
+
+    for (int32_t i = 0; i < 5; ++i) {
+        if (array_parseUint(array + digitOffsets[i], digitLengths[i], &values[i]) != digitLengths[i]) {
+            return -1;
+        }
+    }
+
+    struct tm date = { 0 };
+    date.tm_mon = -1;
+
+    for (int32_t i = 0; i < 12; ++i) {
+        if (array_equalsString(array + 8, 3, (char *) MONTH_STRINGS[i])) {
+            date.tm_mon = i;
+        }
+    }
+
+    if (date.tm_mon == -1) {
+        return -1;
+    }
+
+    date.tm_mday = values[0];
+    date.tm_year = values[1] - 1900;
+    date.tm_hour = values[2];
+    date.tm_min = values[3];
+    date.tm_sec = values[4];
+    *t = timegm(&date);
+
+    return 0;
+}
+
+int32_t compareFilenames(int8_t* filename1, int8_t* filename2) {
+    int64_t i = 0;
+    while (filename1[i] || filename2[i]) {
+        if (!filename1[i]) {
+            // Name 1 is shorter
+            return -1;
+        }
+
+        if (!filename2[i]) {
+            // Name 2 is shorter
+            return 1;
+        }
+
+        int32_t cmp = filename1[i] - filename2[i];
+
+        if (cmp != 0) {
+            return cmp;
+        }
+
+        ++i;
+    }
+
+    return 0;
+}
+
+void sortFilenameList(int8_t** list, int64_t length, int8_t** scratch) {
+    int8_t** from = list;
+    int8_t** to = scratch;
+
+    for (int64_t width = 1; width < length; width *= 2) {
+        for (int64_t start = 0; start < length; start += 2 * width) {
+            int64_t middle = start + width < length ? start + width : length;
+            int64_t end = start + 2 * width < length ? start + 2 * width : length;
+            int64_t i = start;
+            int64_t j = middle;
+            int64_t k = start;
+
+            // Take from the left run on ties to keep the sort stable.
+            while (i < middle && j < end) {
+                to[k++] = compareFilenames(from[j], from[i]) < 0 ? from[j++] : from[i++];
+            }
+
+            while (i < middle) {
+                to[k++] = from[i++];
+            }
+
+            while (j < end) {
+                to[k++] = from[j++];
+            }
+        }
+
+        int8_t** swap = from;
+        from = to;
+        to = swap;
+    }
+
+    if (from != list) {
+        memcpy(list, from, length * sizeof(int8_t*));
+    }
+}
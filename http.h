@@ -0,0 +1,545 @@
+///////////////////////////////////////////////////////////////////////////////////
+// The MIT License (MIT)
+//
+// Copyright (c) 2018 Tarek Sherif
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of
+// this software and associated documentation files (the "Software"), to deal in
+// the Software without restriction, including without limitation the rights to
+// use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+// the Software, and to permit persons to whom the Software is furnished to do so,
+// subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+// COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+// IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+// CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+///////////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////
+// HTTP
+// Strings, buffers, content types and the
+// parsing of requests. Nothing here touches
+// sockets or server state, so these can be
+// linked and measured on their own (see
+// microbench.c).
+///////////////////////////////////////////////
+
+#ifndef CERVIT_HTTP_H
+#define CERVIT_HTTP_H
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define HTTP_RANGE_UNIT "bytes"
+#define HTTP_NEWLINE "\r\n"
+#define HTTP_DATE_LENGTH 29
+
+#define HTTP_METHOD_GET 1
+#define HTTP_METHOD_HEAD 2
+#define HTTP_METHOD_UNSUPPORTED -1
+
+#define RANGE_MAX_COUNT 16
+
+#define CONTENT_TYPE_OCTET_STREAM 0
+#define CONTENT_TYPE_HTML 1
+#define CONTENT_TYPE_JAVASCRIPT 2
+#define CONTENT_TYPE_CSS 3
+#define CONTENT_TYPE_XML 4
+#define CONTENT_TYPE_JSON 5
+#define CONTENT_TYPE_TEXT 6
+#define CONTENT_TYPE_JPEG 7
+#define CONTENT_TYPE_PNG 8
+#define CONTENT_TYPE_GIF 9
+#define CONTENT_TYPE_BMP 10
+#define CONTENT_TYPE_SVG 11
+#define CONTENT_TYPE_OGV 12
+#define CONTENT_TYPE_MP4 13
+#define CONTENT_TYPE_MPEG 14
+#define CONTENT_TYPE_QUICKTIME 15
+#define CONTENT_TYPE_OGG 16
+#define CONTENT_TYPE_OGA 17
+#define CONTENT_TYPE_MP3 18
+#define CONTENT_TYPE_WAV 19
+#define CONTENT_TYPE_WEBP 20
+#define CONTENT_TYPE_AVIF 21
+#define CONTENT_TYPE_ICO 22
+#define CONTENT_TYPE_WEBM 23
+#define CONTENT_TYPE_WOFF 24
+#define CONTENT_TYPE_WOFF2 25
+#define CONTENT_TYPE_TTF 26
+#define CONTENT_TYPE_OTF 27
+#define CONTENT_TYPE_WASM 28
+#define CONTENT_TYPE_PDF 29
+#define NUM_BUILTIN_CONTENT_TYPES 30
+
+#define MIME_EXTENSION_SIZE 16
+#define MIME_TABLE_INITIAL_SLOTS 256
+
+#define CONTENT_ENCODING_IDENTITY 0
+#define CONTENT_ENCODING_GZIP 1
+#define CONTENT_ENCODING_BR 2
+#define NUM_CONTENT_ENCODINGS 3
+
+#define REQUEST_MAX_HEADERS 64
+
+#define PARSE_START 0
+#define PARSE_METHOD 1
+#define PARSE_BEFORE_TARGET 2
+#define PARSE_TARGET 3
+#define PARSE_BEFORE_VERSION 4
+#define PARSE_VERSION 5
+#define PARSE_REQUEST_LINE_END 6
+#define PARSE_LINE_START 7
+#define PARSE_HEADER_KEY 8
+#define PARSE_BEFORE_VALUE 9
+#define PARSE_HEADER_VALUE 10
+#define PARSE_LINE_FEED 11
+#define PARSE_END_LINE_FEED 12
+#define PARSE_DONE 13
+#define PARSE_ERROR 14
+
+#define HEADER_OTHER 0
+#define HEADER_HOST 1
+#define HEADER_RANGE 2
+#define HEADER_IF_RANGE 3
+#define HEADER_IF_NONE_MATCH 4
+#define HEADER_IF_MODIFIED_SINCE 5
+#define HEADER_ACCEPT_ENCODING 6
+#define HEADER_CONNECTION 7
+#define HEADER_TRANSFER_ENCODING 8
+#define HEADER_CONTENT_LENGTH 9
+#define HEADER_REFERER 10
+#define HEADER_USER_AGENT 11
+#define NUM_HEADER_NAMES 12
+
+#define LISTING_HTML 0
+#define LISTING_JSON 1
+
+#define BYTESET_TOKEN_END " \t\r\n"
+#define BYTESET_HEADER_KEY_END ":" BYTESET_TOKEN_END
+
+extern const char* MONTH_STRINGS[];
+extern const char* CONTENT_TYPE_STRINGS[];
+// Extensions of the built-in content types, separated by spaces
+// as in a mime.types file.
+extern const char* CONTENT_TYPE_EXTENSIONS[];
+
+// Number of bytes a group of buffers may grow by together.
+// .limit: Number of bytes they may grow by
+// .used: Number of bytes they have grown by so far
+typedef struct {
+    int64_t limit;
+    int64_t used;
+} MemoryBudget;
+
+// Dynamically allocated array.
+// .data: stored data
+// .length: number of bytes currently stored
+// .size: number of bytes allocated to the array
+// .budget: budget the array's growth is charged to, 0 for none
+// .failed: set when the array couldn't grow to hold appended
+//     data. Appends are dropped until it's cleared.
+typedef struct {
+    int8_t* data;
+    int64_t length;
+    int64_t size;
+    MemoryBudget* budget;
+    int8_t failed;
+} Buffer;
+
+// Bytes stored elsewhere, e.g. part of a buffer.
+// .data: First byte
+// .length: Number of bytes
+typedef struct {
+    int8_t* data;
+    int64_t length;
+} Slice;
+
+// Part of a buffer, by offset so that it stays valid
+// when the buffer is reallocated.
+// .offset: Offset of the first byte
+// .length: Number of bytes
+typedef struct {
+    int32_t offset;
+    int32_t length;
+} Span;
+
+// Header of a request
+// .key: Header name
+// .value: Header value, without surrounding whitespace
+// .next: Index of the next header with the same HEADER_* name, -1 if none
+typedef struct {
+    Span key;
+    Span value;
+    int32_t next;
+} HeaderField;
+
+// State of a request being parsed as its bytes arrive. Parsing
+// stops at the last byte received and resumes from there when
+// more arrive. Spans are parts of the request buffer.
+// .state: PARSE_* value
+// .position: Offset of the next byte to parse. Once parsing is
+//     done, the length of the request.
+// .tokenStart: Offset of the start of the token being parsed
+// .method, .target, .version: Parts of the request line
+// .key: Name of the header being parsed
+// .headers: Headers parsed so far
+// .headerCount: Number of headers parsed so far
+// .first, .last: Indices of the first and last headers with each
+//     HEADER_* name (-1 if there are none), for quick lookups
+typedef struct {
+    int32_t state;
+    int32_t position;
+    int32_t tokenStart;
+    Span method;
+    Span target;
+    Span version;
+    Span key;
+    HeaderField headers[REQUEST_MAX_HEADERS];
+    int32_t headerCount;
+    int32_t first[NUM_HEADER_NAMES];
+    int32_t last[NUM_HEADER_NAMES];
+} RequestParser;
+
+// Information about the HTTP request. Apart from the path, fields
+// are slices of the connection's request buffer, which are only
+// valid while the response is being prepared.
+// .path: Decoded path of the request target, relative to the
+//     working directory
+// .query: Query string of the request target, without the '?'
+// .range, .ifRange: Values of the Range and If-Range headers, if sent
+// .ifModifiedSince: Value of the If-Modified-Since header, if sent
+// .parser: Parsed request, to look up other headers (see request_header)
+// .data: Request buffer the parser's spans are offsets into
+// .acceptEncodings: Bit set of CONTENT_ENCODING_* values the client accepts
+typedef struct {
+    Slice method;
+    Buffer path;
+    Slice query;
+    Slice version;
+    Slice range;
+    Slice ifRange;
+    Slice ifModifiedSince;
+    RequestParser* parser;
+    int8_t* data;
+    int32_t acceptEncodings;
+    int8_t keepAlive;
+} Request;
+
+// Range of bytes of a response body requested
+// with a Range header.
+// .offset: Offset of the first byte
+// .length: Number of bytes
+typedef struct {
+    int64_t offset;
+    int64_t length;
+} ByteRange;
+
+// A content type that files can be served as
+// .name: MIME type, e.g. "text/html"
+// .headers: Headers of 200 responses for files of this type, up
+//     to the Content-Length value (see responseTemplates_init)
+// .compressible: Whether it's a text format worth compressing
+typedef struct {
+    Buffer name;
+    Buffer headers;
+    int8_t compressible;
+} ContentType;
+
+// Slot of the file extension hash table
+// .extension: Lowercased extension without the '.', padded with nulls
+// .contentType: Content type of the extension, -1 if the slot is empty
+typedef struct {
+    char extension[MIME_EXTENSION_SIZE];
+    int32_t contentType;
+} MimeSlot;
+
+// Content types and the file extensions that map to them
+// .types: ContentType array. A content type is an index into it,
+//     and the first NUM_BUILTIN_CONTENT_TYPES are the CONTENT_TYPE_* values.
+// .slots: Open-addressing hash table of extensions
+// .mask: Number of slots minus one (slot count is a power of 2)
+// .count: Number of extensions in the table
+typedef struct {
+    Buffer types;
+    MimeSlot* slots;
+    int64_t mask;
+    int64_t count;
+} MimeTable;
+
+///////////////////////////////////////////////
+// STRINGS
+// A "string" is a null-terminated sequence
+// of chars.
+///////////////////////////////////////////////
+
+// Count the number of characters excluding
+// the terminating null.
+int64_t string_length(const char* string);
+
+// Check if the two string contain the same characters.
+int8_t string_equals(const char* string1, const char* string2);
+
+// Convert a string of decimal digits
+// to a uint32_t value.
+uint32_t string_toUint(const char* string);
+
+/////////////////////////////////////////////
+// ARRAYS
+// An "array" is a sequence of bytes (int8_t) 
+// and a length value indicating the number 
+// bytes in the sequence.
+/////////////////////////////////////////////
+
+// Check if the array bytes values match the character values
+// in the string.
+int8_t array_equalsString(int8_t* array, int64_t length, char* string);
+
+// Check if the array bytes values match the character values
+// in the string, disregarding case for alphabetical values [A-Za-z].
+int8_t array_caseEqualsString(int8_t* array, int64_t length, char* string);
+
+// Check if the array is a comma-separated list (e.g. an HTTP header value)
+// that contains the token, disregarding case and surrounding whitespace.
+int8_t array_containsToken(int8_t* array, int64_t length, char* token);
+
+// Hash an array of bytes (FNV-1a).
+uint64_t array_hash(const int8_t* array, int64_t length);
+
+///////////////////////////////////////////////
+// BUFFERS
+// Buffers are dynamic arrays that will
+// automatically allocate the memory required
+// to store data appended to them.
+///////////////////////////////////////////////
+
+// Initialize a buffer to the given size, with no budget. If the
+// memory can't be allocated, the buffer starts out failed.
+void buffer_init(Buffer* buffer, int64_t size);
+
+// Deallocate memory associated with a buffer.
+void buffer_delete(Buffer* buffer);
+
+// Check if buffer is large enough to hold the requested amount 
+// of data. If not, reallocate buffer with enough memory. Returns -1
+// and marks the buffer failed if growing would overdraw its budget
+// or there's no memory left, else 0.
+int8_t buffer_checkAllocation(Buffer* buffer, int64_t requestedSize);
+
+// Empty a buffer and clear its failed flag. If it has grown
+// past retainSize, its memory is freed and it starts over
+// at that size. Its budget is left for its owner to clear.
+void buffer_reset(Buffer* buffer, int64_t retainSize);
+
+// Append bytes from array to end of buffer.
+void buffer_appendFromArray(Buffer* buffer, const int8_t* array, int64_t length);
+
+// Append single character to end of buffer.
+void buffer_appendFromChar(Buffer* buffer, char c);
+
+// Append non-null bytes from string to end of buffer.
+void buffer_appendFromString(Buffer* buffer, const char* string);
+
+// Convert unsigned int to array of digit ASCII bytes
+// and append to end of buffer.
+void buffer_appendFromUint(Buffer* buffer, uint64_t n);
+
+// Append unsigned int as lowercase
+// hexadecimal digits.
+void buffer_appendFromHex(Buffer* buffer, uint64_t n);
+
+// If buffer isn't currently null-terminated, add null
+// in first unused byte. Useful when interacting
+// with system calls that expect null-termination.
+// Returns -1 if there was no room for the null, else 0.
+int8_t buffer_externalNull(Buffer* buffer);
+
+//////////////////////////////////////////
+// CONTENT TYPES
+//
+// Content types are picked by file
+// extension from a hash table filled in
+// at startup with the built-in types,
+// then the system's mime.types file and
+// any given with --mime-types.
+//////////////////////////////////////////
+
+// Check if a MIME type is a text format worth compressing:
+// text/*, JavaScript, JSON and XML, including types with a
+// +json or +xml suffix like image/svg+xml.
+int8_t isMimeTypeCompressible(int8_t* name, int64_t length);
+
+// Get a content type's name, headers and flags.
+ContentType* mimeTable_type(MimeTable* table, int32_t contentType);
+
+// Number of content types in the table.
+int32_t mimeTable_typeCount(MimeTable* table);
+
+// Copy a file extension into key, lowercased and padded with
+// nulls. Returns -1 if the extension is empty or too long to
+// be in the table.
+int32_t mimeTable_makeKey(char* key, const int8_t* extension, int64_t length);
+
+// Find the slot holding a key, or the empty slot where it
+// would go. The table always has empty slots.
+MimeSlot* mimeTable_findSlot(MimeTable* table, const char* key);
+
+// Allocate the slot array of a table with slotCount slots
+// (a power of 2), all empty.
+void mimeTable_allocateSlots(MimeTable* table, int64_t slotCount);
+
+// Double the number of slots, keeping the table at most half
+// full so probe sequences stay short.
+void mimeTable_grow(MimeTable* table);
+
+// Map a file extension (without the '.') to a content type,
+// replacing any type it had before.
+void mimeTable_setExtension(MimeTable* table, const int8_t* extension, int64_t length, int32_t contentType);
+
+// Map each extension in a list separated by spaces or
+// tabs to a content type.
+void mimeTable_setExtensions(MimeTable* table, const int8_t* list, int64_t length, int32_t contentType);
+
+// Get the content type with the given name, adding it if
+// it's not in the table yet. Only done at startup, so the
+// types are simply searched in order.
+int32_t mimeTable_addType(MimeTable* table, int8_t* name, int64_t length);
+
+// Add the content types and extensions listed in the mime.types
+// format: one type per line followed by its extensions, separated
+// by whitespace, with comments starting with '#'. Extensions that
+// are already in the table are moved to the new type.
+void mimeTable_parse(MimeTable* table, int8_t* data, int64_t length);
+
+// Initialize a table with the built-in content types.
+void mimeTable_init(MimeTable* table);
+
+// Add the content types of a mime.types file. Returns -1
+// if the file can't be read.
+int32_t mimeTable_load(MimeTable* table, const char* filename);
+
+// Deallocate memory associated with a table.
+void mimeTable_delete(MimeTable* table);
+
+// Pick the content type in table of the file name stored in buffer by
+// its extension. Returns CONTENT_TYPE_OCTET_STREAM for unknown
+// extensions and files without one.
+int32_t contentTypeFromBuffer(MimeTable* table, Buffer* filename);
+
+/////////////////////////////////
+// PARSING UTILITY FUNCTIONS
+/////////////////////////////////
+
+// Parse the character value from an array of 
+// two hexadecimal digits
+int8_t parseURIHexCodeFromArray(const int8_t* array);
+
+// Find the first byte in an array that isn't a space (' ') or 
+// tab('\t'), return the index.
+int64_t skipArraySpaces(int8_t* array, int64_t length);
+
+// Decode any percent-encoded characters
+// from the buffer.
+int8_t hexDecodeBuffer(Buffer* buffer);
+
+// Remove path '.' and '..' from a path stored in a buffer. (RFC 3986, 5.3.4)
+void removeBufferDotSegments(Buffer* buffer);
+
+// Open file whose name is stored in buffer.
+int32_t openFileFromBuffer(Buffer* buffer, int64_t flags);
+
+// Stat file whose name is stored in buffer.
+int32_t statFileFromBuffer(Buffer* buffer, struct stat *fileInfo);
+
+// We only support GET and HEAD. Return an int representing
+// the method.
+int32_t methodCodeFromSlice(Slice* method);
+
+// Parse the value of an Accept-Encoding header (RFC 7231, 5.3.4)
+// into a bit set of the CONTENT_ENCODING_* values it allows.
+// Codings with a q-value of 0 are refused, and "*" stands for
+// any coding not listed.
+int32_t parseAcceptEncodingsFromArray(int8_t* array, int64_t length);
+
+// Get the HEADER_* value of a header name. Only names the
+// server looks at are told apart, by length first.
+int32_t headerNameFromArray(int8_t* key, int64_t length);
+
+// Get ready to parse a new request from the start of the buffer.
+void requestParser_reset(RequestParser* parser);
+
+// Add a header to the parser's table, linking it to earlier headers
+// with the same name. Returns -1 if the table is full.
+int8_t requestParser_addHeader(RequestParser* parser, int8_t* data, Span value);
+
+// Parse the bytes of the request that have arrived since the last
+// call. data and length are the whole request buffer. Tokens are
+// found with the delimiter searches in scan.c, so most bytes are
+// skipped over in blocks rather than one at a time. Returns
+// PARSE_DONE once the headers are complete, PARSE_ERROR if the
+// request is malformed or has too many headers, or the state
+// parsing stopped in if more bytes are needed.
+int32_t requestParser_parse(RequestParser* parser, int8_t* data, int64_t length);
+
+// Get a slice of data from a span of it.
+Slice slice_fromSpan(int8_t* data, Span span);
+
+// Get the value of the request header at index in the
+// parser's table.
+Slice request_header(Request* request, int32_t index);
+
+// Get the value of the last header with a HEADER_* name,
+// or an empty slice if there isn't one.
+Slice request_lastHeader(Request* request, int32_t name);
+
+// Fill in the request from a parser that's done, with slices of data,
+// the request buffer it parsed. The path is copied since it's decoded.
+// Returns -1 if the request is invalid.
+int8_t request_fromParser(Request* request, RequestParser* parser, int8_t* data);
+
+// Parse a run of decimal digits at the start of the array into value.
+// Returns the number of digits, or -1 if there are none or the
+// number is too big.
+int64_t array_parseUint(int8_t* array, int64_t length, int64_t* value);
+
+// Parse the offset, limit and format parameters of a directory listing
+// query string, e.g. "offset=100&limit=50&format=json". Unknown or
+// malformed parameters are ignored, leaving the defaults of the whole
+// listing as HTML. A limit of -1 means no limit.
+void parseListingQuery(Slice* query, int64_t* offset, int64_t* limit, int32_t* format);
+
+// Parse the value of a Range header (RFC 7233, 2.1) for a body of
+// the given size into at most RANGE_MAX_COUNT ranges. Ranges that
+// start past the end of the body are dropped and ranges that run
+// past it are shortened. Returns the number of ranges, 0 if the
+// header should be ignored (not byte ranges, malformed or too many
+// ranges) or -1 if none of the ranges can be satisfied.
+int32_t parseRangesFromSlice(Slice* range, int64_t size, ByteRange* ranges);
+
+// Parse an HTTP date in the preferred format (RFC 7231, 7.1.1.1),
+// e.g. "Sun, 06 Nov 1994 08:49:37 GMT". The obsolete formats
+// aren't accepted, so headers using them are ignored. Returns
+// 0 if succesful, else -1.
+int8_t parseHttpDateFromArray(int8_t* array, int64_t length, time_t* t);
+
+// Null-terminated byte sequences for alphabetical ordering. Result
+// < 0 means filename1 comes first. Result > 0 means filename2
+// should come first, 0 means they're the same.
+// Note that these are byte sequences rather than char strings
+// because they're pointers into a buffer (see readDirectoryNames).
+int32_t compareFilenames(int8_t* filename1, int8_t* filename2);
+
+// Sort a list of strings with a bottom-up merge sort, merging runs
+// back and forth between the list and scratch, which must have room
+// for length pointers. Used for directory listing responses (see
+// readDirectoryNames).
+void sortFilenameList(int8_t** list, int64_t length, int8_t** scratch);
+
+#endif
@@ -0,0 +1,840 @@
+///////////////////////////////////////////////////////////////////////////////////
+// The MIT License (MIT)
+//
+// Copyright (c) 2018 Tarek Sherif
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of
+// this software and associated documentation files (the "Software"), to deal in
+// the Software without restriction, including without limitation the rights to
+// use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+// the Software, and to permit persons to whom the Software is furnished to do so,
+// subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+// COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+// IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+// CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+///////////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////
+// Load generator for cervit. Builds a fixed
+// set of files in a temporary directory,
+// starts a server in it on loopback and hits
+// it from several connections at once, each
+// on its own thread, with the same request
+// mixes every time. Each mix is run with
+// kept-alive connections and with a new
+// connection per request, and reports
+// requests per second and latency
+// percentiles.
+//
+// Build and run:
+//   $ make bench
+//
+// Or, to pass options to the server:
+//   $ make load-bench
+//   $ ./load-bench --connections 16 ./cervit --event-loop
+///////////////////////////////////////////////
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define BENCH_DEFAULT_PORT 5099
+#define BENCH_DEFAULT_CONNECTIONS 8
+#define BENCH_DEFAULT_SECONDS 2
+#define BENCH_WARMUP_SECONDS 0.5
+#define BENCH_STARTUP_SECONDS 5
+#define BENCH_MAX_SERVER_ARGS 64
+
+#define NUM_SMALL_FILES 64
+#define SMALL_FILE_SIZE 1024
+#define LARGE_FILE_SIZE (1024 * 1024)
+#define NUM_LISTING_ENTRIES 1000
+
+#define CLIENT_BUFFER_SIZE 65536
+#define REQUEST_MAX_SIZE 256
+
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS (64 * HISTOGRAM_SUB_BUCKETS)
+
+#define MIX_SMALL 0
+#define MIX_LARGE 1
+#define MIX_LISTING 2
+#define MIX_MISSING 3
+#define MIX_MIXED 4
+#define NUM_MIXES 5
+
+// Share of each kind of request in the mixed mix, out of 10.
+const int32_t MIXED_SEQUENCE[] = { MIX_SMALL, MIX_SMALL, MIX_LISTING, MIX_SMALL, MIX_SMALL, MIX_MISSING, MIX_SMALL, MIX_LARGE, MIX_SMALL, MIX_SMALL };
+const char* MIX_NAMES[] = { "small files", "large file", "listing", "404", "mixed" };
+
+// Latency histogram. Durations in nanoseconds are bucketed by
+// their power of two and the next HISTOGRAM_SUB_BITS bits, so
+// percentiles are accurate to within about 6%.
+// .counts: Number of durations in each bucket
+// .total: Number of durations recorded
+typedef struct {
+    int64_t counts[HISTOGRAM_BUCKETS];
+    int64_t total;
+} Histogram;
+
+// Connection to the server and bytes received on it
+// that haven't been parsed yet.
+// .socket: Connected socket, -1 if not connected
+// .data: Receive buffer
+// .start, .end: Range of data not parsed yet
+// .received: Total number of bytes received
+typedef struct {
+    int32_t socket;
+    int8_t data[CLIENT_BUFFER_SIZE];
+    int64_t start;
+    int64_t end;
+    int64_t received;
+} Client;
+
+// Run of one request mix, shared by the worker threads.
+// .mix: MIX_* value
+// .keepAlive: Send every request on one connection instead of
+//     opening a new one for each
+// .measureStart: Time results start being recorded (after the warm-up)
+// .end: Time to stop sending requests
+typedef struct {
+    int32_t mix;
+    int8_t keepAlive;
+    double measureStart;
+    double end;
+} Scenario;
+
+// A thread sending requests on one connection at a time
+// .thread: The pthread object
+// .id: Index of the worker, which picks its first file
+// .scenario: Run it's taking part in
+// .latency: Time from sending each request (or connecting, without
+//     keep-alive) until its response is complete
+// .requests: Number of requests completed
+// .errors: Number of requests that failed or got an unexpected status
+// .bytes: Number of bytes received
+typedef struct {
+    pthread_t thread;
+    int32_t id;
+    Scenario* scenario;
+    Client client;
+    Histogram latency;
+    int64_t requests;
+    int64_t errors;
+    int64_t bytes;
+} Worker;
+
+uint32_t port = BENCH_DEFAULT_PORT;
+
+double now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+//////////////////////////////////////////
+// HISTOGRAMS
+//////////////////////////////////////////
+
+int32_t histogram_bucket(uint64_t duration) {
+    if (duration < HISTOGRAM_SUB_BUCKETS) {
+        return duration;
+    }
+
+    int32_t octave = 63 - __builtin_clzll(duration);
+    int32_t subBucket = (duration >> (octave - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1);
+
+    return (octave - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS + subBucket;
+}
+
+// Get the duration in nanoseconds that all durations in
+// a bucket are below.
+uint64_t histogram_bucketLimit(int32_t bucket) {
+    if (bucket < HISTOGRAM_SUB_BUCKETS) {
+        return bucket + 1;
+    }
+
+    int32_t octave = bucket / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+    int32_t subBucket = bucket % HISTOGRAM_SUB_BUCKETS;
+
+    return (uint64_t) (HISTOGRAM_SUB_BUCKETS + subBucket + 1) << (octave - HISTOGRAM_SUB_BITS);
+}
+
+void histogram_record(Histogram* histogram, uint64_t duration) {
+    ++histogram->counts[histogram_bucket(duration)];
+    ++histogram->total;
+}
+
+void histogram_merge(Histogram* to, Histogram* from) {
+    for (int32_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        to->counts[i] += from->counts[i];
+    }
+
+    to->total += from->total;
+}
+
+// Get the duration (in nanoseconds) a fraction of all
+// recorded durations are below.
+uint64_t histogram_percentile(Histogram* histogram, double fraction) {
+    int64_t target = histogram->total * fraction;
+    int64_t seen = 0;
+
+    for (int32_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        seen += histogram->counts[i];
+
+        if (seen > target) {
+            return histogram_bucketLimit(i);
+        }
+    }
+
+    return 0;
+}
+
+//////////////////////////////////////////
+// CLIENT
+//
+// Blocking HTTP/1.1 client that reads
+// just enough of each response to find
+// where it ends: the status, and the
+// Content-Length or chunk sizes.
+//////////////////////////////////////////
+
+int8_t client_connect(Client* client) {
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    client->socket = socket(AF_INET, SOCK_STREAM, 0);
+    client->start = 0;
+    client->end = 0;
+
+    if (client->socket == -1) {
+        return -1;
+    }
+
+    int32_t noDelay = 1;
+    setsockopt(client->socket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+    if (connect(client->socket, (struct sockaddr*) &address, sizeof(address)) == -1) {
+        close(client->socket);
+        client->socket = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+void client_close(Client* client) {
+    if (client->socket != -1) {
+        close(client->socket);
+        client->socket = -1;
+    }
+}
+
+int8_t client_send(Client* client, const char* request, int64_t length) {
+    int64_t sent = 0;
+
+    while (sent < length) {
+        int64_t result = send(client->socket, request + sent, length - sent, MSG_NOSIGNAL);
+
+        if (result == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return -1;
+        }
+
+        sent += result;
+    }
+
+    return 0;
+}
+
+// Receive more bytes after the unparsed ones. Returns the number
+// of bytes received, 0 if the server closed the connection or
+// -1 on error.
+int64_t client_fill(Client* client) {
+    if (client->start == client->end) {
+        client->start = 0;
+        client->end = 0;
+    } else if (client->start > 0) {
+        memmove(client->data, client->data + client->start, client->end - client->start);
+        client->end -= client->start;
+        client->start = 0;
+    }
+
+    if (client->end == CLIENT_BUFFER_SIZE) {
+        return -1;
+    }
+
+    while (1) {
+        int64_t received = recv(client->socket, client->data + client->end, CLIENT_BUFFER_SIZE - client->end, 0);
+
+        if (received == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if (received > 0) {
+            client->end += received;
+            client->received += received;
+        }
+
+        return received;
+    }
+}
+
+// Find the next "\r\n" in the unparsed bytes, receiving more
+// until there is one. Returns its offset in data, or -1.
+int64_t client_findLine(Client* client) {
+    // Bytes already searched, counted from start since
+    // filling moves the unparsed bytes.
+    int64_t searched = 0;
+
+    while (1) {
+        int8_t* from = client->data + client->start + searched;
+        int8_t* found = memmem(from, client->end - client->start - searched, "\r\n", 2);
+
+        if (found) {
+            return found - client->data;
+        }
+
+        // The newline may be split between receives.
+        searched = client->end - client->start > 0 ? client->end - client->start - 1 : 0;
+
+        if (client_fill(client) <= 0) {
+            return -1;
+        }
+    }
+}
+
+// Skip over length bytes of the body.
+int8_t client_skip(Client* client, int64_t length) {
+    while (length > 0) {
+        if (client->start == client->end && client_fill(client) <= 0) {
+            return -1;
+        }
+
+        int64_t available = client->end - client->start;
+        int64_t skipped = available < length ? available : length;
+        client->start += skipped;
+        length -= skipped;
+    }
+
+    return 0;
+}
+
+// Read a body sent with the chunked transfer coding.
+int8_t client_skipChunks(Client* client) {
+    while (1) {
+        int64_t lineEnd = client_findLine(client);
+
+        if (lineEnd == -1) {
+            return -1;
+        }
+
+        char sizeString[17] = { 0 };
+        int64_t sizeLength = lineEnd - client->start < 16 ? lineEnd - client->start : 16;
+        memcpy(sizeString, client->data + client->start, sizeLength);
+        int64_t size = strtoll(sizeString, 0, 16);
+        client->start = lineEnd + 2;
+
+        if (size == 0) {
+            break;
+        }
+
+        if (client_skip(client, size + 2) == -1) {
+            return -1;
+        }
+    }
+
+    // Skip trailers, up to the empty line.
+    while (1) {
+        int64_t lineEnd = client_findLine(client);
+
+        if (lineEnd == -1) {
+            return -1;
+        }
+
+        int8_t empty = lineEnd == client->start;
+        client->start = lineEnd + 2;
+
+        if (empty) {
+            return 0;
+        }
+    }
+}
+
+// Read a whole response. Returns its status code, or -1 if
+// the connection failed or the response couldn't be parsed.
+// The connection is closed if the server is closing it.
+int32_t client_readResponse(Client* client) {
+    int64_t lineEnd = client_findLine(client);
+
+    if (lineEnd == -1 || lineEnd - client->start < 12 || memcmp(client->data + client->start, "HTTP/1.1 ", 9) != 0) {
+        return -1;
+    }
+
+    int32_t status = atoi((char *) client->data + client->start + 9);
+    int64_t contentLength = -1;
+    int8_t chunked = 0;
+    int8_t closing = 0;
+    client->start = lineEnd + 2;
+
+    // Headers, up to the empty line.
+    while (1) {
+        lineEnd = client_findLine(client);
+
+        if (lineEnd == -1) {
+            return -1;
+        }
+
+        char* line = (char *) client->data + client->start;
+        int64_t length = lineEnd - client->start;
+
+        if (length == 0) {
+            client->start = lineEnd + 2;
+            break;
+        }
+
+        if (length > 15 && strncasecmp(line, "Content-Length:", 15) == 0) {
+            contentLength = strtoll(line + 15, 0, 10);
+        } else if (length > 18 && strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+            chunked = 1;
+        } else if (length == 17 && strncasecmp(line, "Connection: close", 17) == 0) {
+            closing = 1;
+        }
+
+        client->start = lineEnd + 2;
+    }
+
+    if (chunked || contentLength >= 0) {
+        if ((chunked ? client_skipChunks(client) : client_skip(client, contentLength)) == -1) {
+            return -1;
+        }
+
+        if (closing) {
+            client_close(client);
+        }
+
+        return status;
+    }
+
+    // No length, so the body ends when the connection does.
+    while (1) {
+        int64_t received = client_fill(client);
+        client->start = client->end;
+
+        if (received == 0) {
+            return status;
+        }
+
+        if (received == -1) {
+            return -1;
+        }
+    }
+}
+
+//////////////////////////////////////////
+// WORKERS
+//////////////////////////////////////////
+
+// Write the request a worker sends as its nth request into
+// request, and return its length. Workers start at different
+// files so they don't all ask for the same one at once.
+int64_t writeRequest(char* request, int32_t mix, int8_t keepAlive, int64_t n, int32_t* expectedStatus) {
+    if (mix == MIX_MIXED) {
+        mix = MIXED_SEQUENCE[n % (sizeof(MIXED_SEQUENCE) / sizeof(int32_t))];
+    }
+
+    char path[64];
+
+    switch (mix) {
+        case MIX_SMALL:
+            snprintf(path, sizeof(path), "/small/%d.txt", (int32_t) (n % NUM_SMALL_FILES));
+            break;
+        case MIX_LARGE:
+            snprintf(path, sizeof(path), "/large.bin");
+            break;
+        case MIX_LISTING:
+            snprintf(path, sizeof(path), "/listing/");
+            break;
+        default:
+            snprintf(path, sizeof(path), "/missing/%d", (int32_t) (n % NUM_SMALL_FILES));
+    }
+
+    *expectedStatus = mix == MIX_MISSING ? 404 : 200;
+
+    return snprintf(request, REQUEST_MAX_SIZE, "GET %s HTTP/1.1\r\nHost: localhost\r\nUser-Agent: cervit-load-bench\r\n%s\r\n", path, keepAlive ? "" : "Connection: close\r\n");
+}
+
+void *runWorker(void* args) {
+    Worker* worker = (Worker*) args;
+    Scenario* scenario = worker->scenario;
+    Client* client = &worker->client;
+    char request[REQUEST_MAX_SIZE];
+    int64_t n = worker->id * 7;
+    int8_t counting = 0;
+
+    client->socket = -1;
+    client->received = 0;
+
+    while (1) {
+        double start = now();
+
+        if (start >= scenario->end) {
+            break;
+        }
+
+        int8_t measured = start >= scenario->measureStart;
+        int32_t expectedStatus;
+        int64_t length = writeRequest(request, scenario->mix, scenario->keepAlive, n++, &expectedStatus);
+
+        // Only count bytes received after the warm-up.
+        if (measured && !counting) {
+            client->received = 0;
+            counting = 1;
+        }
+
+        if (client->socket == -1 && client_connect(client) == -1) {
+            worker->errors += measured;
+            continue;
+        }
+
+        int32_t status = client_send(client, request, length) == -1 ? -1 : client_readResponse(client);
+
+        if (status == -1 || !scenario->keepAlive) {
+            client_close(client);
+        }
+
+        if (!measured) {
+            continue;
+        }
+
+        if (status != expectedStatus) {
+            ++worker->errors;
+            continue;
+        }
+
+        histogram_record(&worker->latency, (now() - start) * 1e9);
+        ++worker->requests;
+    }
+
+    worker->bytes = client->received;
+    client_close(client);
+
+    return 0;
+}
+
+// Run a request mix on a number of connections and print
+// a line of results.
+int8_t runScenario(int32_t mix, int8_t keepAlive, int32_t numConnections, double seconds) {
+    Worker* workers = calloc(numConnections, sizeof(Worker));
+    Histogram* latency = calloc(1, sizeof(Histogram));
+
+    if (!workers || !latency) {
+        fprintf(stderr, "Failed to allocate workers\n");
+        free(workers);
+        free(latency);
+        return -1;
+    }
+
+    Scenario scenario;
+    scenario.mix = mix;
+    scenario.keepAlive = keepAlive;
+    scenario.measureStart = now() + BENCH_WARMUP_SECONDS;
+    scenario.end = scenario.measureStart + seconds;
+
+    for (int32_t i = 0; i < numConnections; ++i) {
+        workers[i].id = i;
+        workers[i].scenario = &scenario;
+        int32_t errorCode = pthread_create(&workers[i].thread, NULL, runWorker, &workers[i]);
+
+        if (errorCode) {
+            fprintf(stderr, "Failed to create thread. Error code: %d\n", errorCode);
+            exit(1);
+        }
+    }
+
+    int64_t requests = 0;
+    int64_t errors = 0;
+    int64_t bytes = 0;
+
+    for (int32_t i = 0; i < numConnections; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        histogram_merge(latency, &workers[i].latency);
+        requests += workers[i].requests;
+        errors += workers[i].errors;
+        bytes += workers[i].bytes;
+    }
+
+    printf(
+        "%-12s %-10s %12.0f %10.1f %10.1f %10.1f %10.1f %8ld\n",
+        MIX_NAMES[mix],
+        keepAlive ? "keep-alive" : "close",
+        requests / seconds,
+        bytes / seconds / (1024 * 1024),
+        histogram_percentile(latency, 0.5) / 1e3,
+        histogram_percentile(latency, 0.99) / 1e3,
+        histogram_percentile(latency, 0.999) / 1e3,
+        (long) errors
+    );
+    fflush(stdout);
+
+    free(workers);
+    free(latency);
+
+    return 0;
+}
+
+//////////////////////////////////////////
+// FIXTURES AND SERVER
+//////////////////////////////////////////
+
+int8_t writeFile(const char* path, int64_t size) {
+    int32_t file = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (file == -1) {
+        perror(path);
+        return -1;
+    }
+
+    char block[4096];
+    for (int32_t i = 0; i < (int32_t) sizeof(block); ++i) {
+        block[i] = i % 64 == 63 ? '\n' : 'a' + i % 26;
+    }
+
+    while (size > 0) {
+        int64_t length = size < (int64_t) sizeof(block) ? size : (int64_t) sizeof(block);
+
+        if (write(file, block, length) != length) {
+            perror(path);
+            close(file);
+            return -1;
+        }
+
+        size -= length;
+    }
+
+    close(file);
+
+    return 0;
+}
+
+// Fill the directory the server is run in: small files, one
+// large file and a directory without an index.html.
+int8_t createFixtures(const char* directory) {
+    char path[4096];
+
+    snprintf(path, sizeof(path), "%s/small", directory);
+    mkdir(path, 0755);
+
+    for (int32_t i = 0; i < NUM_SMALL_FILES; ++i) {
+        snprintf(path, sizeof(path), "%s/small/%d.txt", directory, i);
+
+        if (writeFile(path, SMALL_FILE_SIZE) == -1) {
+            return -1;
+        }
+    }
+
+    snprintf(path, sizeof(path), "%s/large.bin", directory);
+
+    if (writeFile(path, LARGE_FILE_SIZE) == -1) {
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "%s/listing", directory);
+    mkdir(path, 0755);
+
+    for (int32_t i = 0; i < NUM_LISTING_ENTRIES; ++i) {
+        snprintf(path, sizeof(path), "%s/listing/entry-%04d.txt", directory, i);
+
+        if (writeFile(path, i) == -1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int32_t removeFixture(const char* path, const struct stat* info, int32_t type, struct FTW* ftw) {
+    return remove(path);
+}
+
+// Start the server in directory. Its output is discarded.
+// Returns its pid, or -1 if it didn't start listening.
+pid_t startServer(const char* directory, char** serverArgs, int32_t numServerArgs) {
+    char portString[16];
+    char* argv[BENCH_MAX_SERVER_ARGS + 3];
+
+    snprintf(portString, sizeof(portString), "%u", port);
+    argv[0] = serverArgs[0];
+    argv[1] = portString;
+
+    for (int32_t i = 1; i < numServerArgs; ++i) {
+        argv[i + 1] = serverArgs[i];
+    }
+
+    argv[numServerArgs + 1] = 0;
+
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        perror("Failed to start server");
+        return -1;
+    }
+
+    if (pid == 0) {
+        int32_t devNull = open("/dev/null", O_WRONLY);
+        dup2(devNull, STDOUT_FILENO);
+
+        if (chdir(directory) == -1) {
+            perror("Failed to enter fixture directory");
+            _exit(1);
+        }
+
+        execv(argv[0], argv);
+        perror("Failed to run server");
+        _exit(1);
+    }
+
+    // Wait for it to accept connections.
+    double deadline = now() + BENCH_STARTUP_SECONDS;
+    Client* client = malloc(sizeof(Client));
+
+    while (now() < deadline) {
+        if (client_connect(client) == 0) {
+            client_close(client);
+            free(client);
+            return pid;
+        }
+
+        if (waitpid(pid, 0, WNOHANG) == pid) {
+            break;
+        }
+
+        usleep(10000);
+    }
+
+    free(client);
+    fprintf(stderr, "Server didn't start listening on port %u\n", port);
+    kill(pid, SIGKILL);
+    waitpid(pid, 0, 0);
+
+    return -1;
+}
+
+// Run every mix, with and without keep-alive, against the
+// server. Returns 0 if they all ran.
+int8_t runScenarios(int32_t numConnections, double seconds) {
+    int8_t result = 0;
+
+    printf("%d connections, %.1f s per run after %.1f s of warm-up\n\n", numConnections, seconds, BENCH_WARMUP_SECONDS);
+    printf("%-12s %-10s %12s %10s %10s %10s %10s %8s\n", "mix", "connection", "req/s", "MB/s", "p50 us", "p99 us", "p999 us", "errors");
+
+    for (int32_t mix = 0; mix < NUM_MIXES && result == 0; ++mix) {
+        for (int8_t keepAlive = 1; keepAlive >= 0 && result == 0; --keepAlive) {
+            result = runScenario(mix, keepAlive, numConnections, seconds);
+        }
+    }
+
+    return result;
+}
+
+//////////////////////////////////////////
+// MAIN
+//////////////////////////////////////////
+
+int main(int argc, char** argv) {
+    int32_t numConnections = BENCH_DEFAULT_CONNECTIONS;
+    double seconds = BENCH_DEFAULT_SECONDS;
+    char serverPath[4096];
+    char* defaultServer[] = { "./cervit" };
+    char** serverArgs = defaultServer;
+    int32_t numServerArgs = 1;
+
+    // Options come first. The first other argument is the
+    // server, and the rest are passed on to it.
+    for (int32_t i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--connections") == 0 && i + 1 < argc) {
+            numConnections = atoi(argv[++i]);
+            continue;
+        }
+
+        if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+            seconds = atof(argv[++i]);
+            continue;
+        }
+
+        if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            port = atoi(argv[++i]);
+            continue;
+        }
+
+        serverArgs = argv + i;
+        numServerArgs = argc - i;
+        break;
+    }
+
+    if (numConnections < 1 || seconds <= 0 || numServerArgs > BENCH_MAX_SERVER_ARGS) {
+        fprintf(stderr, "Usage: %s [--connections N] [--seconds S] [--port P] [server [server options...]]\n", argv[0]);
+        return 1;
+    }
+
+    // The server is run from the fixture directory.
+    if (!realpath(serverArgs[0], serverPath)) {
+        perror(serverArgs[0]);
+        return 1;
+    }
+
+    serverArgs[0] = serverPath;
+
+    char directory[] = "/tmp/cervit-bench-XXXXXX";
+
+    if (!mkdtemp(directory)) {
+        perror("Failed to create fixture directory");
+        return 1;
+    }
+
+    int32_t result = 1;
+    pid_t server = createFixtures(directory) == -1 ? -1 : startServer(directory, serverArgs, numServerArgs);
+
+    if (server != -1) {
+        result = runScenarios(numConnections, seconds);
+        kill(server, SIGTERM);
+        waitpid(server, 0, 0);
+    }
+
+    nftw(directory, removeFixture, 16, FTW_DEPTH | FTW_PHYS);
+
+    return result;
+}
@@ -0,0 +1,478 @@
+///////////////////////////////////////////////////////////////////////////////////
+// The MIT License (MIT)
+//
+// Copyright (c) 2018 Tarek Sherif
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of
+// this software and associated documentation files (the "Software"), to deal in
+// the Software without restriction, including without limitation the rights to
+// use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+// the Software, and to permit persons to whom the Software is furnished to do so,
+// subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+// COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+// IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+// CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+///////////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////
+// Microbenchmark for the request parsing and
+// string functions in http.c and scan.c.
+// Times each one on a corpus of requests
+// like browsers and tools send, and on
+// adversarial ones built to hit the slow
+// paths: long values, many headers, heavy
+// percent-encoding and dot segments.
+//
+// The searches in scan.c are also timed at
+// every level the CPU supports, along with
+// the byte-at-a-time loops they replaced,
+// and checked against them.
+//
+// Cycles are counted with the time stamp
+// counter on x86, which ticks at a fixed
+// rate rather than the core clock. Elsewhere
+// bytes per cycle isn't reported.
+//
+// Build and run:
+//   $ make microbench
+//   $ ./microbench
+///////////////////////////////////////////////
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "scan.h"
+#include "http.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_CYCLES() __rdtsc()
+#else
+#define BENCH_CYCLES() 0
+#endif
+
+#define BENCH_SECONDS 0.2
+#define ADVERSARIAL_SIZE 8192
+
+#define KERNEL_PARSE_REQUEST 0
+#define KERNEL_FIND_CHARSET 1
+#define KERNEL_HEX_DECODE 2
+#define KERNEL_DOT_SEGMENTS 3
+#define KERNEL_CONTENT_TYPE 4
+#define KERNEL_APPEND_UINT 5
+#define KERNEL_HTTP_DATE 6
+#define KERNEL_RANGES 7
+#define KERNEL_ACCEPT_ENCODING 8
+#define KERNEL_HEADER_END 9
+
+const char* BROWSER_REQUEST =
+    "GET /assets/js/app.bundle.min.js?v=3f2a9c HTTP/1.1\r\n"
+    "Host: localhost:5000\r\n"
+    "Connection: keep-alive\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+    "Accept: */*\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Dest: script\r\n"
+    "Referer: http://localhost:5000/index.html\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "If-None-Match: \"ce8152-433000-18def29f13479760\"\r\n"
+    "\r\n";
+
+const char* CURL_REQUEST =
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: localhost:5000\r\n"
+    "User-Agent: curl/8.5.0\r\n"
+    "Accept: */*\r\n"
+    "\r\n";
+
+const char* RANGE_REQUEST =
+    "GET /videos/intro.mp4 HTTP/1.1\r\n"
+    "Host: localhost:5000\r\n"
+    "Range: bytes=1048576-2097151\r\n"
+    "If-Range: \"ce8152-433000-18def29f13479760\"\r\n"
+    "Accept-Encoding: identity\r\n"
+    "\r\n";
+
+// Only bare LF line endings, which are accepted (RFC 7230, 3.5).
+const char* BARE_LF_REQUEST =
+    "GET /style.css HTTP/1.1\n"
+    "Host: localhost:5000\n"
+    "Accept: text/css,*/*;q=0.1\n"
+    "\n";
+
+// Requests the parser has to reject. They're checked rather
+// than timed: a header line starting with whitespace is a
+// folded continuation of the previous one (obs-fold), not a
+// new header or the end of the headers (RFC 7230, 3.2.4).
+const char* REJECTED_REQUESTS[] = {
+    "GET / HTTP/1.1\r\nHost: localhost\r\n Connection: close\r\n\r\n",
+    "GET / HTTP/1.1\r\nHost: localhost\r\n\tConnection: close\r\n\r\n",
+    "GET / HTTP/1.1\r\nHost: localhost\r\n \r\n\r\n"
+};
+
+// A kernel run on one input
+// .name: Label for the report
+// .kernel: KERNEL_* value
+// .data, .length: Input passed on every call
+// .number: Input of KERNEL_APPEND_UINT
+// .charSet: Charset searched for by KERNEL_FIND_CHARSET
+typedef struct {
+    const char* name;
+    int32_t kernel;
+    const int8_t* data;
+    int64_t length;
+    uint64_t number;
+    const char* charSet;
+} Benchmark;
+
+// Reused by the kernels between calls, like a thread's
+// buffers are in the server.
+// .parser, .request: For KERNEL_PARSE_REQUEST
+// .buffer: Copy of the input for kernels that change it in
+//     place, or output of KERNEL_APPEND_UINT
+// .mimeTypes: Built-in content types
+// .original: Whether the searches run the loops scan.c
+//     replaced instead of scan.c
+typedef struct {
+    RequestParser parser;
+    Request request;
+    Buffer buffer;
+    MimeTable mimeTypes;
+    int8_t original;
+} Scratch;
+
+volatile int64_t sink;
+
+// The searches scan.c replaced: the charset compared one
+// character at a time, and the header end checked for at
+// every offset.
+int64_t originalFindFromCharSet(const int8_t* array, int64_t length, const char* charSet) {
+    for (int64_t i = 0; i < length; ++i) {
+        for (int64_t j = 0; charSet[j]; ++j) {
+            if (array[i] == charSet[j]) {
+                return i;
+            }
+        }
+    }
+
+    return -1;
+}
+
+int64_t originalNewline(const int8_t* array, int64_t length) {
+    if (length > 0 && array[0] == '\n') {
+        return 1;
+    }
+
+    if (length > 1 && array[0] == '\r' && array[1] == '\n') {
+        return 2;
+    }
+
+    return 0;
+}
+
+int64_t originalFindHttpHeaderEnd(const int8_t* array, int64_t length) {
+    for (int64_t i = 0; i < length; ++i) {
+        int64_t first = originalNewline(array + i, length - i);
+
+        if (first) {
+            int64_t second = originalNewline(array + i + first, length - i - first);
+
+            if (second) {
+                return i + first + second;
+            }
+        }
+    }
+
+    return -1;
+}
+
+double now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+// Run a kernel once. Kernels that change their input work on
+// a copy, and the copy is part of what's timed, as it is in
+// the server (request_fromParser copies the path).
+int64_t runKernel(Benchmark* benchmark, Scratch* scratch) {
+    int8_t* data = (int8_t *) benchmark->data;
+    Buffer* buffer = &scratch->buffer;
+
+    switch (benchmark->kernel) {
+        case KERNEL_PARSE_REQUEST: {
+            requestParser_reset(&scratch->parser);
+            int32_t state = requestParser_parse(&scratch->parser, data, benchmark->length);
+
+            if (state != PARSE_DONE) {
+                return -state;
+            }
+
+            return request_fromParser(&scratch->request, &scratch->parser, data) + scratch->request.path.length;
+        }
+        case KERNEL_FIND_CHARSET:
+            if (scratch->original) {
+                return originalFindFromCharSet(data, benchmark->length, benchmark->charSet);
+            }
+
+            return array_findFromCharSet(data, benchmark->length, benchmark->charSet);
+        case KERNEL_HEADER_END:
+            if (scratch->original) {
+                return originalFindHttpHeaderEnd(data, benchmark->length);
+            }
+
+            return array_findHttpHeaderEnd(data, benchmark->length);
+        case KERNEL_HEX_DECODE:
+            buffer->length = 0;
+            buffer_appendFromArray(buffer, data, benchmark->length);
+
+            return hexDecodeBuffer(buffer) + buffer->length;
+        case KERNEL_DOT_SEGMENTS:
+            buffer->length = 0;
+            buffer_appendFromArray(buffer, data, benchmark->length);
+            removeBufferDotSegments(buffer);
+
+            return buffer->length;
+        case KERNEL_CONTENT_TYPE:
+            buffer->length = 0;
+            buffer_appendFromArray(buffer, data, benchmark->length);
+
+            return contentTypeFromBuffer(&scratch->mimeTypes, buffer);
+        case KERNEL_APPEND_UINT:
+            buffer->length = 0;
+            buffer_appendFromUint(buffer, benchmark->number);
+
+            return buffer->length;
+        case KERNEL_HTTP_DATE: {
+            time_t t = 0;
+
+            return parseHttpDateFromArray(data, benchmark->length, &t) + t;
+        }
+        case KERNEL_RANGES: {
+            ByteRange ranges[RANGE_MAX_COUNT];
+            Slice range = { data, benchmark->length };
+
+            return parseRangesFromSlice(&range, 1 << 30, ranges);
+        }
+        default:
+            return parseAcceptEncodingsFromArray(data, benchmark->length);
+    }
+}
+
+// Run a kernel until BENCH_SECONDS have passed. Sets the
+// average nanoseconds and time stamp counter cycles per call.
+void timeKernel(Benchmark* benchmark, Scratch* scratch, double* nanoseconds, double* cycles) {
+    int64_t iterations = 0;
+    int64_t batch = 256;
+    uint64_t startCycles = BENCH_CYCLES();
+    double start = now();
+    double elapsed;
+
+    do {
+        for (int64_t i = 0; i < batch; ++i) {
+            sink += runKernel(benchmark, scratch);
+        }
+
+        iterations += batch;
+        elapsed = now() - start;
+    } while (elapsed < BENCH_SECONDS);
+
+    *cycles = (double) (BENCH_CYCLES() - startCycles) / iterations;
+    *nanoseconds = elapsed * 1e9 / iterations;
+}
+
+// Build a string of count copies of a pattern. The
+// strings live until the process exits.
+const char* repeat(const char* prefix, const char* pattern, int64_t count, const char* suffix) {
+    int64_t patternLength = strlen(pattern);
+    int64_t prefixLength = strlen(prefix);
+    char* string = malloc(prefixLength + patternLength * count + strlen(suffix) + 1);
+    char* end = string + prefixLength;
+
+    memcpy(string, prefix, prefixLength);
+
+    for (int64_t i = 0; i < count; ++i) {
+        memcpy(end, pattern, patternLength);
+        end += patternLength;
+    }
+
+    strcpy(end, suffix);
+
+    return string;
+}
+
+// A request with as many headers as the parser takes.
+const char* manyHeadersRequest(void) {
+    char* request = malloc(REQUEST_MAX_HEADERS * 32 + 64);
+    int64_t length = sprintf(request, "GET / HTTP/1.1\r\nHost: localhost\r\n");
+
+    for (int32_t i = 1; i < REQUEST_MAX_HEADERS; ++i) {
+        length += sprintf(request + length, "X-Header-%d: value-%d\r\n", i, i);
+    }
+
+    strcpy(request + length, "\r\n");
+
+    return request;
+}
+
+int main(void) {
+    const char* longValueRequest = repeat("GET / HTTP/1.1\r\nHost: localhost\r\nCookie: ", "a=0123456789abcdef; ", ADVERSARIAL_SIZE / 20, "\r\n\r\n");
+    const char* encodedRequest = repeat("GET /", "%61%62%63%2F", ADVERSARIAL_SIZE / 12, " HTTP/1.1\r\nHost: localhost\r\n\r\n");
+    const char* longQueryRequest = repeat("GET /search?", "term=value&", ADVERSARIAL_SIZE / 11, " HTTP/1.1\r\nHost: localhost\r\n\r\n");
+    const char* manyHeaders = manyHeadersRequest();
+    const char* encodedPath = repeat("./", "%61%62%63%2F", ADVERSARIAL_SIZE / 12, "");
+    const char* dotPath = repeat(".", "/a/./b/../c/..", ADVERSARIAL_SIZE / 14, "/index.html");
+    const char* longPath = repeat("", "/abcdefghijklmno", ADVERSARIAL_SIZE / 16, " ");
+    const char* longHeaders = repeat("", "abcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyzabcdefghijk\n", ADVERSARIAL_SIZE / 64, "\r\n\r\n");
+    const char* userAgent = strstr(BROWSER_REQUEST, "User-Agent");
+    const char* manyRanges = repeat("bytes=0-0", ",10-19", RANGE_MAX_COUNT - 1, "");
+    const char* longAcceptEncoding = repeat("", "x-custom;q=0.5, ", 64, "gzip;q=1.0, br;q=0.9");
+
+    Benchmark benchmarks[] = {
+        { "parse, browser request", KERNEL_PARSE_REQUEST, (const int8_t*) BROWSER_REQUEST, 0, 0, 0 },
+        { "parse, curl request", KERNEL_PARSE_REQUEST, (const int8_t*) CURL_REQUEST, 0, 0, 0 },
+        { "parse, range request", KERNEL_PARSE_REQUEST, (const int8_t*) RANGE_REQUEST, 0, 0, 0 },
+        { "parse, bare LF request", KERNEL_PARSE_REQUEST, (const int8_t*) BARE_LF_REQUEST, 0, 0, 0 },
+        { "parse, 8K cookie", KERNEL_PARSE_REQUEST, (const int8_t*) longValueRequest, 0, 0, 0 },
+        { "parse, 64 headers", KERNEL_PARSE_REQUEST, (const int8_t*) manyHeaders, 0, 0, 0 },
+        { "parse, 8K encoded path", KERNEL_PARSE_REQUEST, (const int8_t*) encodedRequest, 0, 0, 0 },
+        { "parse, 8K query", KERNEL_PARSE_REQUEST, (const int8_t*) longQueryRequest, 0, 0, 0 },
+        { "hex decode, plain path", KERNEL_HEX_DECODE, (const int8_t*) "./assets/js/app.bundle.min.js", 0, 0, 0 },
+        { "hex decode, one escape", KERNEL_HEX_DECODE, (const int8_t*) "./docs/Release%20Notes.html", 0, 0, 0 },
+        { "hex decode, 8K escapes", KERNEL_HEX_DECODE, (const int8_t*) encodedPath, 0, 0, 0 },
+        { "dot segments, none", KERNEL_DOT_SEGMENTS, (const int8_t*) "./assets/js/app.bundle.min.js", 0, 0, 0 },
+        { "dot segments, a few", KERNEL_DOT_SEGMENTS, (const int8_t*) "./assets/../js/./app.js", 0, 0, 0 },
+        { "dot segments, 8K", KERNEL_DOT_SEGMENTS, (const int8_t*) dotPath, 0, 0, 0 },
+        { "content type, .js", KERNEL_CONTENT_TYPE, (const int8_t*) "./assets/js/app.bundle.min.js", 0, 0, 0 },
+        { "content type, none", KERNEL_CONTENT_TYPE, (const int8_t*) "./LICENSE", 0, 0, 0 },
+        { "content type, long ext", KERNEL_CONTENT_TYPE, (const int8_t*) "./file.averyveryverylongextension", 0, 0, 0 },
+        { "append uint, 0", KERNEL_APPEND_UINT, 0, 0, 0, 0 },
+        { "append uint, 1234567", KERNEL_APPEND_UINT, 0, 0, 1234567, 0 },
+        { "append uint, max", KERNEL_APPEND_UINT, 0, 0, UINT64_MAX, 0 },
+        { "http date", KERNEL_HTTP_DATE, (const int8_t*) "Sun, 06 Nov 1994 08:49:37 GMT", 0, 0, 0 },
+        { "ranges, one", KERNEL_RANGES, (const int8_t*) "bytes=1048576-2097151", 0, 0, 0 },
+        { "ranges, most allowed", KERNEL_RANGES, (const int8_t*) manyRanges, 0, 0, 0 },
+        { "accept-encoding, browser", KERNEL_ACCEPT_ENCODING, (const int8_t*) "gzip, deflate, br, zstd", 0, 0, 0 },
+        { "accept-encoding, 64 codings", KERNEL_ACCEPT_ENCODING, (const int8_t*) longAcceptEncoding, 0, 0, 0 }
+    };
+    int32_t count = sizeof(benchmarks) / sizeof(Benchmark);
+
+    // Run at every level and without scan.c.
+    Benchmark searches[] = {
+        { "header end, browser request", KERNEL_HEADER_END, (const int8_t*) BROWSER_REQUEST, 0, 0, 0 },
+        { "header end, 8K of headers", KERNEL_HEADER_END, (const int8_t*) longHeaders, 0, 0, 0 },
+        { "token end, method", KERNEL_FIND_CHARSET, (const int8_t*) BROWSER_REQUEST, 0, 0, BYTESET_TOKEN_END },
+        { "path end, request target", KERNEL_FIND_CHARSET, (const int8_t*) BROWSER_REQUEST + 4, 0, 0, "?#" },
+        { "path end, 8K path", KERNEL_FIND_CHARSET, (const int8_t*) longPath, 0, 0, "?#" },
+        { "header key end, User-Agent", KERNEL_FIND_CHARSET, (const int8_t*) userAgent, 0, 0, BYTESET_HEADER_KEY_END },
+        { "newline, User-Agent value", KERNEL_FIND_CHARSET, (const int8_t*) userAgent, 0, 0, HTTP_NEWLINE }
+    };
+    int32_t searchCount = sizeof(searches) / sizeof(Benchmark);
+    int32_t level = scan_init(SCAN_AVX2);
+
+    Scratch* scratch = malloc(sizeof(Scratch));
+    scratch->original = 0;
+    buffer_init(&scratch->request.path, 1024);
+    buffer_init(&scratch->buffer, 1024);
+    mimeTable_init(&scratch->mimeTypes);
+
+    int32_t failed = 0;
+
+    for (uint64_t i = 0; i < sizeof(REJECTED_REQUESTS) / sizeof(REJECTED_REQUESTS[0]); ++i) {
+        requestParser_reset(&scratch->parser);
+
+        if (requestParser_parse(&scratch->parser, (int8_t *) REJECTED_REQUESTS[i], strlen(REJECTED_REQUESTS[i])) != PARSE_ERROR) {
+            fprintf(stderr, "rejected request %d was accepted\n", (int) i);
+            failed = 1;
+        }
+    }
+
+    printf("Searches use %s\n\n", scan_levelName(level));
+    printf("%-30s %8s %10s %12s\n", "kernel", "bytes", "ns/op", "bytes/cycle");
+
+    for (int32_t i = 0; i < count; ++i) {
+        Benchmark* benchmark = &benchmarks[i];
+        double nanoseconds;
+        double cycles;
+
+        if (benchmark->kernel == KERNEL_APPEND_UINT) {
+            runKernel(benchmark, scratch);
+            benchmark->length = scratch->buffer.length;
+        } else {
+            benchmark->length = strlen((const char*) benchmark->data);
+        }
+
+        // The request corpus should all parse, or the error
+        // path is what gets timed.
+        if (benchmark->kernel == KERNEL_PARSE_REQUEST && runKernel(benchmark, scratch) < 0) {
+            fprintf(stderr, "%s: request wasn't parsed\n", benchmark->name);
+            failed = 1;
+        }
+
+        timeKernel(benchmark, scratch, &nanoseconds, &cycles);
+
+        if (cycles > 0) {
+            printf("%-30s %8ld %10.1f %12.2f\n", benchmark->name, (long) benchmark->length, nanoseconds, benchmark->length / cycles);
+        } else {
+            printf("%-30s %8ld %10.1f %12s\n", benchmark->name, (long) benchmark->length, nanoseconds, "-");
+        }
+    }
+
+    printf("\n%-30s %10s", "ns per search", "original");
+    for (int32_t i = SCAN_SCALAR; i <= level; ++i) {
+        printf(" %10s", scan_levelName(i));
+    }
+    printf("\n");
+
+    for (int32_t i = 0; i < searchCount; ++i) {
+        Benchmark* search = &searches[i];
+        double nanoseconds;
+        double cycles;
+
+        search->length = strlen((const char*) search->data);
+
+        scratch->original = 1;
+        int64_t expected = runKernel(search, scratch);
+        timeKernel(search, scratch, &nanoseconds, &cycles);
+        printf("%-30s %10.1f", search->name, nanoseconds);
+        scratch->original = 0;
+
+        for (int32_t searchLevel = SCAN_SCALAR; searchLevel <= level; ++searchLevel) {
+            scan_init(searchLevel);
+
+            // Every level should find the same thing as the
+            // original search.
+            int64_t found = runKernel(search, scratch);
+            if (found != expected) {
+                fprintf(stderr, "%s: %s found %ld, expected %ld\n", search->name, scan_levelName(searchLevel), (long) found, (long) expected);
+                failed = 1;
+            }
+
+            timeKernel(search, scratch, &nanoseconds, &cycles);
+            printf(" %10.1f", nanoseconds);
+        }
+
+        printf("\n");
+    }
+
+    mimeTable_delete(&scratch->mimeTypes);
+    buffer_delete(&scratch->buffer);
+    buffer_delete(&scratch->request.path);
+    free(scratch);
+
+    return failed;
+}
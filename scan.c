@@ -0,0 +1,284 @@
+///////////////////////////////////////////////////////////////////////////////////
+// The MIT License (MIT)
+//
+// Copyright (c) 2018 Tarek Sherif
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of
+// this software and associated documentation files (the "Software"), to deal in
+// the Software without restriction, including without limitation the rights to
+// use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+// the Software, and to permit persons to whom the Software is furnished to do so,
+// subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+// COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+// IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+// CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+///////////////////////////////////////////////////////////////////////////////////
+
+#include <stdint.h>
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+// Charsets with more characters than this are searched with
+// the scalar version.
+#define SCAN_MAX_CHARSET 8
+
+// Check if the newline at index is followed by another one.
+// If so, return the index just past the second, else
+// return -1.
+static int64_t headerEndAt(const int8_t* array, int64_t length, int64_t index) {
+    if (index + 1 < length && array[index + 1] == '\n') {
+        return index + 2;
+    }
+
+    if (index + 2 < length && array[index + 1] == '\r' && array[index + 2] == '\n') {
+        return index + 3;
+    }
+
+    return -1;
+}
+
+//////////////
+// Scalar
+//////////////
+
+// Test each byte against a 256-bit set built from the charset,
+// rather than against each character of the charset in turn.
+static int64_t findFromCharSetScalar(const int8_t* array, int64_t length, const char* charSet) {
+    uint64_t set[4] = { 0, 0, 0, 0 };
+
+    for (int64_t j = 0; charSet[j]; ++j) {
+        uint8_t c = charSet[j];
+        set[c >> 6] |= 1ULL << (c & 63);
+    }
+
+    for (int64_t i = 0; i < length; ++i) {
+        uint8_t c = array[i];
+
+        if (set[c >> 6] & (1ULL << (c & 63))) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// A pair of newlines always ends in '\n', so only look
+// further at those.
+static int64_t findHttpHeaderEndScalar(const int8_t* array, int64_t length) {
+    for (int64_t i = 0; i < length; ++i) {
+        if (array[i] == '\n') {
+            int64_t end = headerEndAt(array, length, i);
+
+            if (end != -1) {
+                return end;
+            }
+        }
+    }
+
+    return -1;
+}
+
+#ifdef SCAN_X86
+
+//////////////
+// SSE2
+//////////////
+
+// Compare 16 bytes at a time against each character of the
+// charset, then hand the remaining bytes to the scalar version.
+static int64_t findFromCharSetSse2(const int8_t* array, int64_t length, const char* charSet) {
+    __m128i chars[SCAN_MAX_CHARSET];
+    int32_t count = 0;
+
+    while (charSet[count]) {
+        if (count == SCAN_MAX_CHARSET) {
+            return findFromCharSetScalar(array, length, charSet);
+        }
+
+        chars[count] = _mm_set1_epi8(charSet[count]);
+        ++count;
+    }
+
+    int64_t i = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*) (array + i));
+        __m128i matches = _mm_setzero_si128();
+
+        for (int32_t j = 0; j < count; ++j) {
+            matches = _mm_or_si128(matches, _mm_cmpeq_epi8(bytes, chars[j]));
+        }
+
+        uint32_t mask = _mm_movemask_epi8(matches);
+
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+
+    int64_t index = findFromCharSetScalar(array + i, length - i, charSet);
+
+    return index == -1 ? -1 : i + index;
+}
+
+// Find the '\n's 16 bytes at a time and check each one
+// for a following newline.
+static int64_t findHttpHeaderEndSse2(const int8_t* array, int64_t length) {
+    __m128i newline = _mm_set1_epi8('\n');
+    int64_t i = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*) (array + i));
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, newline));
+
+        while (mask) {
+            int64_t end = headerEndAt(array, length, i + __builtin_ctz(mask));
+
+            if (end != -1) {
+                return end;
+            }
+
+            mask &= mask - 1;
+        }
+    }
+
+    int64_t end = findHttpHeaderEndScalar(array + i, length - i);
+
+    return end == -1 ? -1 : i + end;
+}
+
+//////////////
+// AVX2
+//////////////
+
+__attribute__((target("avx2")))
+static int64_t findFromCharSetAvx2(const int8_t* array, int64_t length, const char* charSet) {
+    __m256i chars[SCAN_MAX_CHARSET];
+    int32_t count = 0;
+
+    while (charSet[count]) {
+        if (count == SCAN_MAX_CHARSET) {
+            return findFromCharSetScalar(array, length, charSet);
+        }
+
+        chars[count] = _mm256_set1_epi8(charSet[count]);
+        ++count;
+    }
+
+    int64_t i = 0;
+
+    for (; i + 32 <= length; i += 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i*) (array + i));
+        __m256i matches = _mm256_setzero_si256();
+
+        for (int32_t j = 0; j < count; ++j) {
+            matches = _mm256_or_si256(matches, _mm256_cmpeq_epi8(bytes, chars[j]));
+        }
+
+        uint32_t mask = _mm256_movemask_epi8(matches);
+
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+
+    // Clear the upper halves of the AVX registers before running
+    // SSE code, which would otherwise stall on them.
+    _mm256_zeroupper();
+    int64_t index = findFromCharSetSse2(array + i, length - i, charSet);
+
+    return index == -1 ? -1 : i + index;
+}
+
+__attribute__((target("avx2")))
+static int64_t findHttpHeaderEndAvx2(const int8_t* array, int64_t length) {
+    __m256i newline = _mm256_set1_epi8('\n');
+    int64_t i = 0;
+
+    for (; i + 32 <= length; i += 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i*) (array + i));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, newline));
+
+        while (mask) {
+            int64_t end = headerEndAt(array, length, i + __builtin_ctz(mask));
+
+            if (end != -1) {
+                return end;
+            }
+
+            mask &= mask - 1;
+        }
+    }
+
+    // Newlines in the blocks were checked against the whole
+    // array, so only the tail is left.
+    _mm256_zeroupper();
+    int64_t end = findHttpHeaderEndSse2(array + i, length - i);
+
+    return end == -1 ? -1 : i + end;
+}
+
+#endif
+
+// Versions in use, set by scan_init
+static int64_t (*findFromCharSet)(const int8_t* array, int64_t length, const char* charSet) = findFromCharSetScalar;
+static int64_t (*findHttpHeaderEnd)(const int8_t* array, int64_t length) = findHttpHeaderEndScalar;
+
+int64_t array_findFromCharSet(const int8_t* array, int64_t length, const char* charSet) {
+    return findFromCharSet(array, length, charSet);
+}
+
+int64_t array_findHttpHeaderEnd(const int8_t* array, int64_t length) {
+    return findHttpHeaderEnd(array, length);
+}
+
+int32_t scan_init(int32_t maxLevel) {
+    int32_t level = SCAN_SCALAR;
+
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+
+    if (maxLevel >= SCAN_SSE2 && __builtin_cpu_supports("sse2")) {
+        level = SCAN_SSE2;
+    }
+
+    if (maxLevel >= SCAN_AVX2 && __builtin_cpu_supports("avx2")) {
+        level = SCAN_AVX2;
+    }
+#endif
+
+    switch (level) {
+#ifdef SCAN_X86
+        case SCAN_AVX2:
+            findFromCharSet = findFromCharSetAvx2;
+            findHttpHeaderEnd = findHttpHeaderEndAvx2;
+            break;
+        case SCAN_SSE2:
+            findFromCharSet = findFromCharSetSse2;
+            findHttpHeaderEnd = findHttpHeaderEndSse2;
+            break;
+#endif
+        default:
+            findFromCharSet = findFromCharSetScalar;
+            findHttpHeaderEnd = findHttpHeaderEndScalar;
+    }
+
+    return level;
+}
+
+const char* scan_levelName(int32_t level) {
+    const char* names[] = { "scalar", "sse2", "avx2" };
+
+    return names[level];
+}
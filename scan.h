@@ -0,0 +1,61 @@
+///////////////////////////////////////////////////////////////////////////////////
+// The MIT License (MIT)
+//
+// Copyright (c) 2018 Tarek Sherif
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of
+// this software and associated documentation files (the "Software"), to deal in
+// the Software without restriction, including without limitation the rights to
+// use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+// the Software, and to permit persons to whom the Software is furnished to do so,
+// subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+// COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+// IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+// CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+///////////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////
+// SCANNING
+// Searches through request bytes for the
+// delimiters the parser splits on. Each
+// search has a scalar version and, on x86,
+// SSE2 and AVX2 versions that test 16 or 32
+// bytes at a time. scan_init picks the best
+// one the CPU supports.
+///////////////////////////////////////////////
+
+#ifndef CERVIT_SCAN_H
+#define CERVIT_SCAN_H
+
+#include <stdint.h>
+
+#define SCAN_SCALAR 0
+#define SCAN_SSE2 1
+#define SCAN_AVX2 2
+
+// Select the search versions to use: the best ones the CPU
+// supports, up to maxLevel (a SCAN_* value). Returns the level
+// selected.
+int32_t scan_init(int32_t maxLevel);
+
+// Name of a SCAN_* level, for reporting.
+const char* scan_levelName(int32_t level);
+
+// Find first occurance in the array of any of the characters in
+// a charset (represented as a null-terminated string). If found,
+// return index, else return -1.
+int64_t array_findFromCharSet(const int8_t* array, int64_t length, const char* charSet);
+
+// Find the first pair of HTTP newlines in the array, where each
+// newline is either "\r\n" or a bare "\n". If found, return the
+// index just past them, else return -1.
+int64_t array_findHttpHeaderEnd(const int8_t* array, int64_t length);
+
+#endif